@@ -1,2 +1,6 @@
 $(BIN)/evanescent.exe: \
-	$(BIN)/src/tcp_server_gnu.cpp.o
+	$(BIN)/src/tcp_server_gnu.cpp.o \
+	$(BIN)/src/io_ring_linux.cpp.o \
+	$(BIN)/src/local_ingest_linux.cpp.o \
+	$(BIN)/src/spill_linux.cpp.o \
+	$(BIN)/src/upgrade_linux.cpp.o
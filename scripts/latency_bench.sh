@@ -0,0 +1,107 @@
+#!/usr/bin/env bash
+# Measures the chunk delivery latency of a live upload, from the producer
+# writing a chunk to the readers receiving it, with the default socket options
+# and with a latency-tuned socket profile.
+# Usage: ./scripts/latency_bench.sh [bin directory]
+# Environment: READERS (default 4), CHUNKS (default 300), CHUNK_SIZE (default
+# 2000 bytes), PERIOD_MS (default 10), PROFILE (default "live").
+set -euo pipefail
+readonly BIN=${1:-bin}
+readonly port=18600
+
+readonly tmpDir=/tmp/latency-bench-$$
+trap "rm -rf $tmpDir" EXIT
+mkdir -p $tmpDir
+
+export READERS=${READERS:-4}
+export CHUNKS=${CHUNKS:-300}
+export CHUNK_SIZE=${CHUNK_SIZE:-2000}
+export PERIOD_MS=${PERIOD_MS:-10}
+readonly PROFILE=${PROFILE:-live}
+
+# Every chunk starts with the (monotonic) time it was written at:
+# the readers, on the same host, compute the delay when they have received
+# the whole chunk.
+cat > $tmpDir/bench.py <<'EOF'
+import os, socket, struct, sys, threading, time
+
+host, port = "127.0.0.1", int(sys.argv[1])
+readers = int(os.environ["READERS"])
+chunks = int(os.environ["CHUNKS"])
+chunkSize = int(os.environ["CHUNK_SIZE"])
+period = int(os.environ["PERIOD_MS"]) / 1000.0
+url = "/bench.m4s"
+delays = []
+lock = threading.Lock()
+
+def connect():
+  s = socket.create_connection((host, port))
+  s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+  return s
+
+def produce():
+  s = connect()
+  s.sendall(("PUT %s HTTP/1.1\r\nHost: bench\r\nTransfer-Encoding: chunked\r\n\r\n" % url).encode())
+  for i in range(chunks):
+    payload = struct.pack("<q", time.monotonic_ns()) + b"x" * (chunkSize - 8)
+    s.sendall(b"%X\r\n" % len(payload) + payload + b"\r\n")
+    time.sleep(period)
+  s.sendall(b"0\r\n\r\n")
+  s.recv(4096)
+  s.close()
+
+def consume():
+  s = connect()
+  s.sendall(("GET %s HTTP/1.1\r\nHost: bench\r\n\r\n" % url).encode())
+  f = s.makefile("rb", buffering=0)
+  while f.readline() not in (b"\r\n", b""):
+    pass # headers
+  body = b""
+  received = 0
+  while received < chunks:
+    size = int(f.readline().strip() or b"0", 16)
+    if size == 0:
+      break
+    data = b""
+    while len(data) < size + 2:
+      data += f.read(size + 2 - len(data))
+    body += data[:size]
+    while len(body) >= chunkSize:
+      sent = struct.unpack("<q", body[:8])[0]
+      with lock:
+        delays.append((time.monotonic_ns() - sent) / 1000.0)
+      body = body[chunkSize:]
+      received += 1
+  s.close()
+
+threads = [threading.Thread(target=consume) for i in range(readers)]
+for t in threads:
+  t.start()
+time.sleep(0.2) # the readers wait for the resource (long polling)
+produce()
+for t in threads:
+  t.join()
+
+delays.sort()
+pick = lambda p: delays[min(len(delays) - 1, int(len(delays) * p / 100))]
+print("chunks=%d p50_us=%.0f p90_us=%.0f p99_us=%.0f max_us=%.0f" % (len(delays), pick(50), pick(90), pick(99), delays[-1]))
+EOF
+
+function run
+{
+  local readonly name=$1
+  shift
+
+  $BIN/evanescent.exe --port $port "$@" 2>$tmpDir/$name.log &
+  local readonly pid=$!
+  sleep 0.2
+
+  echo -n "$name: "
+  python3 $tmpDir/bench.py $port
+
+  kill -INT $pid
+  wait $pid || true
+}
+
+run default
+run tuned --ingest-socket nodelay --egress-socket $PROFILE
@@ -0,0 +1,214 @@
+#include "buffer_pool.h"
+
+#include <atomic>
+#include <cstring> // memcpy
+#include <mutex>
+#include <vector>
+
+namespace
+{
+// Size classes: 256 bytes, then four evenly spaced classes per power of two
+// (320, 384, 448, 512, 640, ...), which bounds the internal waste to 25%.
+// Requests above the largest class are served directly by the heap.
+const int MinShift = 8;
+const int MaxShift = 26;
+const int StepsPerOctave = 4;
+const int NumClasses = (MaxShift - MinShift) * StepsPerOctave + 1;
+
+// Upper bound on the amount of idle memory kept on the free lists.
+const size_t MaxCachedBytes = size_t(256) * 1024 * 1024;
+
+int bitLength(size_t n)
+{
+  int r = 0;
+
+  while(n)
+  {
+    n >>= 1;
+    r++;
+  }
+
+  return r;
+}
+
+// returns -1 for sizes that are too big to be pooled
+int classOf(size_t size)
+{
+  if(size <= (size_t(1) << MinShift))
+    return 0;
+
+  if(size > (size_t(1) << MaxShift))
+    return -1;
+
+  auto const shift = bitLength(size - 1); // 2^(shift-1) < size <= 2^shift
+  auto const base = size_t(1) << (shift - 1);
+  auto const step = base / StepsPerOctave;
+  auto const index = (size - base + step - 1) / step; // 1..StepsPerOctave
+
+  return (shift - 1 - MinShift) * StepsPerOctave + int(index);
+}
+
+size_t classSize(int sizeClass)
+{
+  if(sizeClass == 0)
+    return size_t(1) << MinShift;
+
+  auto const octave = (sizeClass - 1) / StepsPerOctave;
+  auto const index = (sizeClass - 1) % StepsPerOctave + 1;
+  auto const base = size_t(1) << (MinShift + octave);
+
+  return base + index * (base / StepsPerOctave);
+}
+
+struct Pool
+{
+  struct SizeClass
+  {
+    std::mutex mutex;
+    std::vector<uint8_t*> freeList;
+  };
+
+  SizeClass classes[NumClasses];
+  std::atomic<size_t> cachedBytes { 0 };
+
+  uint8_t* alloc(size_t size, size_t& capacity)
+  {
+    auto const sizeClass = classOf(size);
+
+    if(sizeClass < 0)
+    {
+      capacity = size;
+      return new uint8_t[size];
+    }
+
+    capacity = classSize(sizeClass);
+
+    {
+      auto& c = classes[sizeClass];
+      std::unique_lock<std::mutex> lock(c.mutex);
+
+      if(!c.freeList.empty())
+      {
+        auto r = c.freeList.back();
+        c.freeList.pop_back();
+        cachedBytes -= capacity;
+        return r;
+      }
+    }
+
+    return new uint8_t[capacity];
+  }
+
+  void free(uint8_t* p, size_t capacity)
+  {
+    auto const sizeClass = classOf(capacity);
+
+    if(sizeClass < 0 || classSize(sizeClass) != capacity || cachedBytes + capacity > MaxCachedBytes)
+    {
+      delete[] p;
+      return;
+    }
+
+    auto& c = classes[sizeClass];
+    std::unique_lock<std::mutex> lock(c.mutex);
+    c.freeList.push_back(p);
+    cachedBytes += capacity;
+  }
+};
+
+Pool& pool()
+{
+  // intentionally leaked: buffers may still be released by detached
+  // client threads while the process exits.
+  static Pool* p = new Pool;
+  return *p;
+}
+}
+
+PooledBuffer::~PooledBuffer()
+{
+  release();
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other)
+{
+  *this = std::move(other);
+}
+
+PooledBuffer & PooledBuffer::operator = (PooledBuffer&& other)
+{
+  if(this == &other)
+    return *this;
+
+  release();
+
+  m_data = other.m_data;
+  m_size = other.m_size;
+  m_capacity = other.m_capacity;
+
+  other.m_data = nullptr;
+  other.m_size = 0;
+  other.m_capacity = 0;
+
+  return *this;
+}
+
+void PooledBuffer::reserve(size_t capacity)
+{
+  if(capacity <= m_capacity)
+    return;
+
+  size_t newCapacity = 0;
+  auto newData = pool().alloc(capacity, newCapacity);
+
+  if(m_size)
+    memcpy(newData, m_data, m_size);
+
+  auto const size = m_size;
+  release();
+
+  m_data = newData;
+  m_size = size;
+  m_capacity = newCapacity;
+}
+
+void PooledBuffer::resize(size_t size)
+{
+  reserve(size);
+  m_size = size;
+}
+
+void PooledBuffer::assign(const uint8_t* src, size_t len)
+{
+  clear();
+  append(src, len);
+}
+
+void PooledBuffer::append(const uint8_t* src, size_t len)
+{
+  if(m_size + len > m_capacity)
+  {
+    // amortize the growth of producer-side buffers
+    auto capacity = m_capacity + m_capacity / 2;
+
+    if(capacity < m_size + len)
+      capacity = m_size + len;
+
+    reserve(capacity);
+  }
+
+  if(len)
+    memcpy(m_data + m_size, src, len);
+
+  m_size += len;
+}
+
+void PooledBuffer::release()
+{
+  if(m_data)
+    pool().free(m_data, m_capacity);
+
+  m_data = nullptr;
+  m_size = 0;
+  m_capacity = 0;
+}
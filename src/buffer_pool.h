@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef> // size_t
+#include <cstdint>
+
+// A growable byte buffer whose storage comes from a process-wide pool of
+// size classes. Released storage is kept on per-class free lists and handed
+// back to the next buffer of a similar size, so that a steady stream of
+// near-constant-size chunks and segments doesn't hit the global heap.
+struct PooledBuffer
+{
+  PooledBuffer() = default;
+  ~PooledBuffer();
+
+  PooledBuffer(PooledBuffer&& other);
+  PooledBuffer & operator = (PooledBuffer&& other);
+
+  PooledBuffer(PooledBuffer const &) = delete;
+  PooledBuffer & operator = (PooledBuffer const &) = delete;
+
+  uint8_t* data() { return m_data; }
+  const uint8_t* data() const { return m_data; }
+  size_t size() const { return m_size; }
+  size_t capacity() const { return m_capacity; }
+
+  // grows the storage to at least 'capacity' bytes, preserving the contents.
+  void reserve(size_t capacity);
+
+  // sets the size, growing the storage if needed.
+  // Newly exposed bytes are left uninitialized.
+  void resize(size_t size);
+
+  void assign(const uint8_t* src, size_t len);
+  void append(const uint8_t* src, size_t len);
+
+  // drops the contents, but keeps the storage for reuse.
+  void clear() { m_size = 0; }
+
+  // gives the storage back to the pool.
+  void release();
+
+private:
+  uint8_t* m_data = nullptr;
+  size_t m_size = 0;
+  size_t m_capacity = 0;
+};
@@ -0,0 +1,104 @@
+#include "compression.h"
+
+#include <cctype> // isspace, tolower
+#include <cstdlib> // atof
+#include <cstring> // strlen
+
+#include <zlib.h>
+
+using namespace std;
+
+namespace
+{
+bool endsWith(const string& s, const char* suffix)
+{
+  auto const n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+bool equalsNoCase(const string& a, const char* b)
+{
+  if(strlen(b) != a.size())
+    return false;
+
+  for(size_t i = 0; i < a.size(); ++i)
+    if(tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+      return false;
+
+  return true;
+}
+}
+
+bool isCompressible(const string& url)
+{
+  auto const path = url.substr(0, url.find('?'));
+
+  return endsWith(path, ".mpd")
+         || endsWith(path, ".m3u8")
+         || endsWith(path, ".xml")
+         || endsWith(path, ".json");
+}
+
+bool acceptsEncoding(const string& acceptEncoding, const char* coding)
+{
+  size_t pos = 0;
+
+  // e.g: "gzip, deflate;q=0.5, br;q=0"
+  while(pos < acceptEncoding.size())
+  {
+    auto end = acceptEncoding.find(',', pos);
+
+    if(end == string::npos)
+      end = acceptEncoding.size();
+
+    auto nameEnd = acceptEncoding.find(';', pos);
+
+    if(nameEnd == string::npos || nameEnd > end)
+      nameEnd = end;
+
+    auto nameBegin = pos;
+
+    while(nameBegin < nameEnd && isspace((unsigned char)acceptEncoding[nameBegin]))
+      nameBegin++;
+
+    while(nameEnd > nameBegin && isspace((unsigned char)acceptEncoding[nameEnd - 1]))
+      nameEnd--;
+
+    auto const name = acceptEncoding.substr(nameBegin, nameEnd - nameBegin);
+
+    if(equalsNoCase(name, coding))
+    {
+      auto const q = acceptEncoding.find("q=", nameEnd);
+
+      // "q=0" refuses the coding
+      if(q == string::npos || q > end || atof(acceptEncoding.c_str() + q + 2) > 0)
+        return true;
+    }
+
+    pos = end + 1;
+  }
+
+  return false;
+}
+
+bool gzipCompress(const uint8_t* src, size_t len, PooledBuffer& dst)
+{
+  z_stream zs {};
+
+  // 15 + 16: maximum window, gzip wrapper
+  if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+
+  dst.resize(deflateBound(&zs, len));
+
+  zs.next_in = (Bytef*)src;
+  zs.avail_in = len;
+  zs.next_out = dst.data();
+  zs.avail_out = dst.size();
+
+  auto const ret = deflate(&zs, Z_FINISH);
+  dst.resize(zs.total_out);
+  deflateEnd(&zs);
+
+  return ret == Z_STREAM_END;
+}
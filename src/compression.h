@@ -0,0 +1,21 @@
+#pragma once
+
+// Precompressed variants of text resources (manifests).
+// Manifests are polled by every player: they're compressed once, when they're
+// complete, and the encoded copy is served to the clients accepting it.
+
+#include <string>
+
+#include "buffer_pool.h"
+
+// Whether a resource is worth compressing, judging from its URL
+// (e.g. MPD and HLS playlists; media segments are already compressed).
+bool isCompressible(const std::string& url);
+
+// Whether an 'Accept-Encoding' header value explicitly allows 'coding'
+// (e.g. "gzip"). The '*' wildcard isn't honored.
+bool acceptsEncoding(const std::string& acceptEncoding, const char* coding);
+
+// Compresses [src, src + len) into 'dst', in the gzip format.
+// Returns false on failure.
+bool gzipCompress(const uint8_t* src, size_t len, PooledBuffer& dst);
@@ -0,0 +1,246 @@
+#include "egress.h"
+
+#include <algorithm> // min, max
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+typedef std::chrono::steady_clock Clock;
+
+const int NumClasses = (int)EgressClass::Count;
+
+// Bytes per round of each class, i.e. their weights (8:4:1).
+// At least MaxEgressGrant, so that any grant fits in one round.
+const int64_t Quantum[NumClasses] =
+{
+  128 * 1024, // Manifest
+  64 * 1024, // LiveEdge
+  16 * 1024, // Historical
+};
+
+// How much unused rate a bucket keeps, i.e. the allowed burst.
+const int BurstMs = 50;
+
+// How often the scheduler checks the buckets, while they're empty.
+const auto RefillPeriod = std::chrono::milliseconds(1);
+
+// Tokens are taken even if the bucket doesn't hold enough (it goes into
+// debt), so grants bigger than the burst still go through.
+struct TokenBucket
+{
+  uint64_t rate = 0; // bytes per second, 0: unlimited
+  double tokens = 0;
+  Clock::time_point lastRefill = Clock::now();
+
+  void setRate(uint64_t rate_)
+  {
+    rate = rate_;
+    tokens = burst();
+    lastRefill = Clock::now();
+  }
+
+  double burst() const
+  {
+    return std::max<double>(rate * BurstMs / 1000.0, MaxEgressGrant);
+  }
+
+  void refill(Clock::time_point now)
+  {
+    auto const elapsed = std::chrono::duration<double>(now - lastRefill).count();
+    tokens = std::min(tokens + rate * elapsed, burst());
+    lastRefill = now;
+  }
+
+  bool ready() const
+  {
+    return !rate || tokens > 0;
+  }
+
+  void take(size_t len)
+  {
+    tokens -= len;
+  }
+};
+
+struct Waiter
+{
+  size_t len;
+  bool granted = false;
+  std::condition_variable cv;
+};
+
+struct ClassQueue
+{
+  std::deque<Waiter*> waiters;
+  int64_t deficit = 0;
+  TokenBucket bucket;
+};
+
+struct Scheduler
+{
+  std::mutex mutex;
+  std::condition_variable waiting; // wakes the scheduler thread up
+  TokenBucket total;
+  ClassQueue classes[NumClasses];
+  int current = 0; // the class whose turn it is
+  bool inTurn = false; // 'current' already got its quantum
+};
+
+// never destroyed: its thread may be waiting on it at exit
+Scheduler& g_scheduler = *new Scheduler;
+
+std::atomic<bool> g_scheduled;
+std::once_flag g_started;
+
+// Grants what the tokens allow, in deficit round-robin order.
+// Returns whether anything was granted.
+bool grant()
+{
+  auto const now = Clock::now();
+  g_scheduler.total.refill(now);
+
+  for(auto& c : g_scheduler.classes)
+    c.bucket.refill(now);
+
+  bool granted = false;
+  int idleTurns = 0;
+
+  while(idleTurns < NumClasses && g_scheduler.total.ready())
+  {
+    auto& c = g_scheduler.classes[g_scheduler.current];
+    bool grantedInTurn = false;
+
+    if(!c.waiters.empty() && c.bucket.ready())
+    {
+      if(!g_scheduler.inTurn)
+      {
+        c.deficit = std::min(c.deficit + Quantum[g_scheduler.current], 2 * Quantum[g_scheduler.current]);
+        g_scheduler.inTurn = true;
+      }
+
+      while(!c.waiters.empty() && (int64_t)c.waiters.front()->len <= c.deficit && g_scheduler.total.ready() && c.bucket.ready())
+      {
+        auto waiter = c.waiters.front();
+        c.waiters.pop_front();
+
+        c.deficit -= waiter->len;
+        g_scheduler.total.take(waiter->len);
+        c.bucket.take(waiter->len);
+
+        waiter->granted = true;
+        waiter->cv.notify_one();
+        grantedInTurn = true;
+      }
+
+      // out of tokens: the turn goes on after the refill
+      if(!g_scheduler.total.ready())
+        break;
+    }
+
+    if(c.waiters.empty())
+      c.deficit = 0;
+
+    granted |= grantedInTurn;
+    idleTurns = grantedInTurn ? 0 : idleTurns + 1;
+
+    g_scheduler.inTurn = false;
+    g_scheduler.current = (g_scheduler.current + 1) % NumClasses;
+  }
+
+  return granted;
+}
+
+bool hasWaiters()
+{
+  for(auto& c : g_scheduler.classes)
+    if(!c.waiters.empty())
+      return true;
+
+  return false;
+}
+
+void schedule()
+{
+  std::unique_lock<std::mutex> lock(g_scheduler.mutex);
+
+  while(1)
+  {
+    if(grant())
+      continue;
+
+    if(hasWaiters())
+      g_scheduler.waiting.wait_for(lock, RefillPeriod);
+    else
+      g_scheduler.waiting.wait(lock);
+  }
+}
+}
+
+const char* egressClassName(EgressClass c)
+{
+  switch(c)
+  {
+  case EgressClass::Manifest: return "manifest";
+  case EgressClass::LiveEdge: return "live";
+  case EgressClass::Historical: return "historical";
+  case EgressClass::Count: break;
+  }
+
+  return "unknown";
+}
+
+EgressClass parseEgressClass(std::string const& name)
+{
+  for(int i = 0; i < NumClasses; ++i)
+  {
+    if(name == egressClassName((EgressClass)i))
+      return (EgressClass)i;
+  }
+
+  throw runtime_error("Invalid egress class '" + name + "'");
+}
+
+void setEgressRate(uint64_t rate)
+{
+  std::unique_lock<std::mutex> lock(g_scheduler.mutex);
+  g_scheduler.total.setRate(rate);
+  g_scheduled = g_scheduled || rate;
+}
+
+void setEgressClassRate(EgressClass c, uint64_t rate)
+{
+  std::unique_lock<std::mutex> lock(g_scheduler.mutex);
+  g_scheduler.classes[(int)c].bucket.setRate(rate);
+  g_scheduled = g_scheduled || rate;
+}
+
+bool isEgressScheduled()
+{
+  return g_scheduled;
+}
+
+void acquireEgress(EgressClass c, size_t len)
+{
+  if(!g_scheduled)
+    return;
+
+  std::call_once(g_started, [] () { thread(schedule).detach(); });
+
+  Waiter waiter;
+  waiter.len = std::min(len, MaxEgressGrant);
+
+  std::unique_lock<std::mutex> lock(g_scheduler.mutex);
+  g_scheduler.classes[(int)c].waiters.push_back(&waiter);
+  g_scheduler.waiting.notify_one();
+
+  while(!waiter.granted)
+    waiter.cv.wait(lock);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+// Egress scheduler: when the outgoing bandwidth is limited, the readers are
+// served by priority class rather than all competing equally, so catch-up
+// and DVR downloads don't delay the live players.
+//
+// Each GET belongs to a class. Before writing, a reader asks for the bytes
+// it's about to send, and blocks until the scheduler grants them. Grants go
+// round-robin over the classes, each one getting a quantum of bytes per round
+// in proportion to its weight (deficit round-robin), within the total rate and
+// the rate of the class (token buckets).
+//
+// Without any rate configured, the scheduler is bypassed.
+
+#include <cstddef> // size_t
+#include <cstdint>
+#include <string>
+
+enum class EgressClass
+{
+  Manifest, // manifests and playlists: small, and on the critical path
+  LiveEdge, // resources still being uploaded
+  Historical, // complete resources: catch-up, DVR
+
+  Count,
+};
+
+const char* egressClassName(EgressClass c);
+
+// Throws if 'name' isn't a class name.
+EgressClass parseEgressClass(std::string const& name);
+
+// In bytes per second. 0: unlimited.
+void setEgressRate(uint64_t rate);
+void setEgressClassRate(EgressClass c, uint64_t rate);
+
+bool isEgressScheduled();
+
+// The largest grant: callers split their writes into pieces of this size.
+const size_t MaxEgressGrant = 16 * 1024;
+
+// Blocks until 'len' (at most MaxEgressGrant) bytes of class 'c' can be sent.
+void acquireEgress(EgressClass c, size_t len);
@@ -0,0 +1,465 @@
+#include "hpack.h"
+
+using namespace std;
+
+namespace
+{
+struct HuffmanCode
+{
+  uint32_t code; // right-aligned
+  uint8_t length; // in bits
+};
+
+// RFC 7541, Appendix B (without EOS, which can't be decoded)
+const HuffmanCode HuffmanCodes[256] =
+{
+  { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+  { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+  { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+  { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+  { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+  { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+  { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+  { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+  { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+  { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+  { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+  { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+  { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+  { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+  { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+  { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+  { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+  { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+  { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+  { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+  { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+  { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+  { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+  { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+  { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+  { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+  { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+  { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+  { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+  { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+  { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+  { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+  { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+  { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+  { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+  { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+  { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+  { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+  { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+  { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+  { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+  { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+  { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+  { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+  { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+  { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+  { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+  { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+  { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+  { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+  { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+  { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+  { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+  { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+  { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+  { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+  { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+  { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+  { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+  { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+  { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+  { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+  { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+  { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+};
+
+// RFC 7541, Appendix A
+const char* const StaticTable[][2] =
+{
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+const size_t StaticTableSize = sizeof StaticTable / sizeof *StaticTable;
+
+// Binary tree of the Huffman codes. The leaves hold the symbols.
+struct HuffmanTree
+{
+  struct Node
+  {
+    int child[2] = { -1, -1 };
+    int symbol = -1;
+  };
+
+  HuffmanTree()
+  {
+    nodes.emplace_back();
+
+    for(int symbol = 0; symbol < 256; ++symbol)
+    {
+      auto const& c = HuffmanCodes[symbol];
+      int node = 0;
+
+      for(int bit = c.length - 1; bit >= 0; --bit)
+      {
+        auto const b = (c.code >> bit) & 1;
+
+        if(nodes[node].child[b] < 0)
+        {
+          nodes[node].child[b] = nodes.size();
+          nodes.emplace_back();
+        }
+
+        node = nodes[node].child[b];
+      }
+
+      nodes[node].symbol = symbol;
+    }
+  }
+
+  vector<Node> nodes;
+};
+
+bool huffmanDecode(const uint8_t* src, size_t len, string& dst)
+{
+  static const HuffmanTree tree;
+
+  int node = 0;
+  int pendingBits = 0; // since the last symbol
+  bool allOnes = true;
+
+  for(size_t i = 0; i < len; ++i)
+  {
+    for(int bit = 7; bit >= 0; --bit)
+    {
+      auto const b = (src[i] >> bit) & 1;
+      node = tree.nodes[node].child[b];
+
+      if(node < 0)
+        return false; // EOS
+
+      pendingBits++;
+      allOnes = allOnes && b;
+
+      if(tree.nodes[node].symbol >= 0)
+      {
+        dst += (char)tree.nodes[node].symbol;
+        node = 0;
+        pendingBits = 0;
+        allOnes = true;
+      }
+    }
+  }
+
+  // the padding is the beginning of EOS: at most 7 bits, all set
+  return pendingBits < 8 && allOnes;
+}
+
+bool decodeInteger(const uint8_t*& p, const uint8_t* end, int prefixBits, uint64_t& value)
+{
+  if(p == end)
+    return false;
+
+  uint64_t const max = (1u << prefixBits) - 1;
+  value = *p++ & max;
+
+  if(value < max)
+    return true;
+
+  for(int shift = 0; shift < 56; shift += 7)
+  {
+    if(p == end)
+      return false;
+
+    auto const b = *p++;
+    value += (uint64_t)(b & 0x7f) << shift;
+
+    if(!(b & 0x80))
+      return true;
+  }
+
+  return false; // too big
+}
+
+bool decodeString(const uint8_t*& p, const uint8_t* end, string& s)
+{
+  if(p == end)
+    return false;
+
+  bool const huffman = *p & 0x80;
+  uint64_t len;
+
+  if(!decodeInteger(p, end, 7, len) || len > (uint64_t)(end - p))
+    return false;
+
+  s.clear();
+
+  if(huffman)
+  {
+    if(!huffmanDecode(p, len, s))
+      return false;
+  }
+  else
+    s.assign((const char*)p, len);
+
+  p += len;
+  return true;
+}
+
+void encodeInteger(string& dst, uint8_t flags, int prefixBits, uint64_t value)
+{
+  uint64_t const max = (1u << prefixBits) - 1;
+
+  if(value < max)
+  {
+    dst += (char)(flags | value);
+    return;
+  }
+
+  dst += (char)(flags | max);
+  value -= max;
+
+  while(value >= 0x80)
+  {
+    dst += (char)(0x80 | (value & 0x7f));
+    value >>= 7;
+  }
+
+  dst += (char)value;
+}
+
+void encodeString(string& dst, string const& s)
+{
+  encodeInteger(dst, 0x00, 7, s.size());
+  dst += s;
+}
+
+// 32 bytes of overhead per entry (RFC 7541, 4.1)
+size_t entrySize(HeaderField const& field)
+{
+  return field.first.size() + field.second.size() + 32;
+}
+}
+
+bool HpackDecoder::decode(const uint8_t* block, size_t len, HeaderList& headers, bool& tooBig)
+{
+  auto p = block;
+  auto const end = block + len;
+  size_t listSize = 0;
+  tooBig = false;
+
+  auto append = [&] (HeaderField& field)
+    {
+      listSize += entrySize(field);
+
+      if(listSize > MaxHeaderListSize)
+        tooBig = true;
+      else
+        headers.push_back(std::move(field));
+    };
+
+  while(p < end)
+  {
+    auto const first = *p;
+
+    if(first & 0x80)
+    {
+      // indexed field
+      uint64_t index;
+      HeaderField field;
+
+      if(!decodeInteger(p, end, 7, index) || !lookup(index, field))
+        return false;
+
+      append(field);
+    }
+    else if((first & 0xe0) == 0x20)
+    {
+      // dynamic table size update
+      uint64_t size;
+
+      if(!decodeInteger(p, end, 5, size) || size > MaxTableSize)
+        return false;
+
+      m_maxTableSize = size;
+      evict();
+    }
+    else
+    {
+      // literal field: with incremental indexing, without indexing,
+      // or never indexed
+      bool const indexing = (first & 0xc0) == 0x40;
+      uint64_t index;
+      HeaderField field;
+
+      if(!decodeInteger(p, end, indexing ? 6 : 4, index))
+        return false;
+
+      if(index == 0)
+      {
+        if(!decodeString(p, end, field.first))
+          return false;
+      }
+      else if(!lookup(index, field))
+        return false;
+
+      if(!decodeString(p, end, field.second))
+        return false;
+
+      if(indexing)
+        insert(field);
+
+      append(field);
+    }
+  }
+
+  return true;
+}
+
+bool HpackDecoder::lookup(uint64_t index, HeaderField& field) const
+{
+  if(index == 0)
+    return false;
+
+  if(index <= StaticTableSize)
+  {
+    field.first = StaticTable[index - 1][0];
+    field.second = StaticTable[index - 1][1];
+    return true;
+  }
+
+  index -= StaticTableSize + 1;
+
+  if(index >= m_table.size())
+    return false;
+
+  field = m_table[index];
+  return true;
+}
+
+void HpackDecoder::insert(HeaderField const& field)
+{
+  auto const size = entrySize(field);
+
+  // too big: empties the table
+  if(size > m_maxTableSize)
+  {
+    m_table.clear();
+    m_tableSize = 0;
+    return;
+  }
+
+  m_table.push_front(field);
+  m_tableSize += size;
+  evict();
+}
+
+void HpackDecoder::evict()
+{
+  while(m_tableSize > m_maxTableSize)
+  {
+    m_tableSize -= entrySize(m_table.back());
+    m_table.pop_back();
+  }
+}
+
+void hpackEncode(HeaderList const& headers, string& block)
+{
+  for(auto& field : headers)
+  {
+    size_t nameIndex = 0;
+    size_t index = 0;
+
+    for(size_t i = 0; i < StaticTableSize && !index; ++i)
+    {
+      if(field.first != StaticTable[i][0])
+        continue;
+
+      if(!nameIndex)
+        nameIndex = i + 1;
+
+      if(field.second == StaticTable[i][1])
+        index = i + 1;
+    }
+
+    if(index)
+    {
+      // e.g. ":status: 200"
+      encodeInteger(block, 0x80, 7, index);
+      continue;
+    }
+
+    // literal without indexing
+    encodeInteger(block, 0x00, 4, nameIndex);
+
+    if(!nameIndex)
+      encodeString(block, field.first);
+
+    encodeString(block, field.second);
+  }
+}
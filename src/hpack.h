@@ -0,0 +1,46 @@
+#pragma once
+
+// HPACK (RFC 7541): the header compression of HTTP/2.
+
+#include <cstddef> // size_t
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility> // pair
+#include <vector>
+
+typedef std::pair<std::string, std::string> HeaderField;
+typedef std::vector<HeaderField> HeaderList;
+
+// Decodes the header blocks sent by the peer, in order: their dynamic table
+// is shared by the whole connection.
+struct HpackDecoder
+{
+  // SETTINGS_HEADER_TABLE_SIZE (the default: we don't advertise another one)
+  enum { MaxTableSize = 4096 };
+
+  // SETTINGS_MAX_HEADER_LIST_SIZE: the biggest decoded header list, counting
+  // the names, the values, and 32 bytes per field. Indexed fields make a
+  // small block expand a lot, so it's checked while decoding.
+  enum { MaxHeaderListSize = 64 * 1024 };
+
+  // Appends the fields of 'block' to 'headers'.
+  // Past MaxHeaderListSize, the rest of the fields are still decoded (the
+  // dynamic table must follow), but dropped, and 'tooBig' is set.
+  // Returns false if 'block' is malformed (a connection error).
+  bool decode(const uint8_t* block, size_t len, HeaderList& headers, bool& tooBig);
+
+private:
+  bool lookup(uint64_t index, HeaderField& field) const;
+  void insert(HeaderField const& field);
+  void evict();
+
+  std::deque<HeaderField> m_table; // the newest first
+  size_t m_tableSize = 0;
+  size_t m_maxTableSize = MaxTableSize;
+};
+
+// Appends the encoding of 'headers' to 'block'. The names must be lowercase.
+// The peer's dynamic table isn't used, nor Huffman coding: responses only
+// have a few short headers.
+void hpackEncode(HeaderList const& headers, std::string& block);
@@ -0,0 +1,33 @@
+#pragma once
+
+// HTTP/1.1 helpers, shared by the server (main.cpp) and the parts of the relay
+// that talk HTTP to other relays.
+
+#include <map>
+#include <string>
+
+#include "tcp_server.h" // IStream
+
+struct HttpRequest
+{
+  std::string method; // e.g: PUT, POST, GET
+  std::string url; // e.g: /toto/dash.mp4
+  std::string version; // e.g: HTTP/1.1
+
+  std::map<std::string, std::string> headers;
+};
+
+// Reads a line into 'r', reusing its storage. The line ending is stripped.
+void readLine(IStream* s, std::string& r);
+std::string readLine(IStream* s);
+
+// Writes 'l', followed by a line ending.
+void writeLine(IStream* s, const char* l);
+
+// Extracts the next space-delimited word of 'line', starting at 'pos'.
+void nextWord(const std::string& line, size_t& pos, std::string& word);
+
+// Reads header lines, up to (and including) the empty line.
+void parseHeaders(IStream* s, std::map<std::string, std::string>& headers);
+
+HttpRequest parseRequest(IStream* s);
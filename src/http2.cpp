@@ -0,0 +1,881 @@
+#include "http2.h"
+#include "buffer_pool.h"
+#include "tcp_server.h" // DbgTrace
+#include "timer_wheel.h"
+
+#include <algorithm> // min
+#include <chrono>
+#include <condition_variable>
+#include <cstring> // memcmp, memcpy, memmove
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+const char Preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+enum FrameType : uint8_t
+{
+  Frame_Data = 0,
+  Frame_Headers = 1,
+  Frame_Priority = 2,
+  Frame_RstStream = 3,
+  Frame_Settings = 4,
+  Frame_PushPromise = 5,
+  Frame_Ping = 6,
+  Frame_GoAway = 7,
+  Frame_WindowUpdate = 8,
+  Frame_Continuation = 9,
+};
+
+enum : uint8_t
+{
+  Flag_EndStream = 0x1,
+  Flag_Ack = 0x1, // SETTINGS, PING
+  Flag_EndHeaders = 0x4,
+  Flag_Padded = 0x8,
+  Flag_Priority = 0x20,
+};
+
+enum : uint16_t
+{
+  Setting_MaxConcurrentStreams = 3,
+  Setting_InitialWindowSize = 4,
+  Setting_MaxFrameSize = 5,
+  Setting_MaxHeaderListSize = 6,
+};
+
+enum ErrorCode : uint32_t
+{
+  Error_None = 0,
+  Error_Protocol = 1,
+  Error_Internal = 2,
+  Error_FlowControl = 3,
+  Error_FrameSize = 6,
+  Error_RefusedStream = 7,
+  Error_Cancel = 8,
+  Error_Compression = 9,
+};
+
+const uint32_t MaxConcurrentStreams = 128;
+const uint32_t DefaultMaxFrameSize = 16384; // also the biggest frame we accept
+const int64_t DefaultWindowSize = 65535;
+const int64_t MaxWindowSize = 0x7fffffff;
+const size_t MaxHeaderBlockSize = 64 * 1024;
+
+// How much of a request body the client can send ahead of its reading
+// (SETTINGS_INITIAL_WINDOW_SIZE), also added to the connection window.
+const uint32_t ReceiveWindowSize = 1024 * 1024;
+
+// Above this, the request threads wait for the connection thread to send
+// what they queued: bounds the memory used by a slow client, and how long
+// a new response (e.g. a manifest) waits behind the queued segment data.
+const size_t MaxQueuedBytes = 64 * 1024;
+
+uint32_t readU32(const uint8_t* p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void writeU32(uint8_t* p, uint32_t val)
+{
+  p[0] = val >> 24;
+  p[1] = val >> 16;
+  p[2] = val >> 8;
+  p[3] = val;
+}
+
+struct Frame
+{
+  uint8_t type;
+  uint8_t flags;
+  uint32_t streamId;
+  PooledBuffer payload;
+};
+
+struct StreamState
+{
+  int64_t window; // how much DATA we can send
+  uint32_t readCredit = 0; // read, but not credited back yet
+
+  // the request body, received but not read yet: [bodyPos, body.size())
+  PooledBuffer body;
+  size_t bodyPos = 0;
+  bool bodyComplete = false;
+};
+
+// State shared by the connection thread and the request threads.
+struct Connection
+{
+  // Only used by the connection thread, and by queue() until 'closed'.
+  IStream* s;
+  std::thread::id connectionThread;
+
+  std::mutex mutex;
+  std::condition_variable canSend; // window, queue space, stream reset, or closed
+  std::condition_variable canRead; // request body, stream reset, or closed
+
+  PooledBuffer output; // frames waiting for the connection thread
+  bool closed = false;
+
+  int64_t window = DefaultWindowSize; // connection-level send window
+  int64_t initialWindow = DefaultWindowSize; // SETTINGS_INITIAL_WINDOW_SIZE of the client
+  size_t maxFrameSize = DefaultMaxFrameSize; // SETTINGS_MAX_FRAME_SIZE of the client
+  int bodyTimeout_ms = 0; // a request body not progressing for this long is reset (0: never)
+  uint32_t receivedCredit = 0; // received, but not credited back yet
+
+  // the open streams
+  std::map<uint32_t, StreamState> streams;
+
+  // Must be called with 'mutex' locked.
+  void queue(uint8_t type, uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t len)
+  {
+    uint8_t header[9];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    writeU32(header + 5, streamId);
+
+    output.append(header, sizeof header);
+
+    if(len)
+      output.append(payload, len);
+
+    // the connection thread sends it before waiting
+    if(std::this_thread::get_id() != connectionThread)
+      s->wakeUp();
+  }
+
+  // Must be called with 'mutex' locked.
+  void queueRstStream(uint32_t streamId, ErrorCode code)
+  {
+    uint8_t payload[4];
+    writeU32(payload, code);
+    queue(Frame_RstStream, 0, streamId, payload, sizeof payload);
+  }
+
+  // Must be called with 'mutex' locked.
+  void queueWindowUpdate(uint32_t streamId, uint32_t increment)
+  {
+    uint8_t payload[4];
+    writeU32(payload, increment);
+    queue(Frame_WindowUpdate, 0, streamId, payload, sizeof payload);
+  }
+
+  // Must be called with 'mutex' locked.
+  // Batches the WINDOW_UPDATE frames: one per half window.
+  void credit(uint32_t streamId, uint32_t& pending, uint32_t increment)
+  {
+    pending += increment;
+
+    if(pending < ReceiveWindowSize / 2)
+      return;
+
+    queueWindowUpdate(streamId, pending);
+    pending = 0;
+  }
+
+  // Must be called with 'mutex' locked.
+  // Throws if the stream can't be written to anymore.
+  StreamState& openStream(uint32_t id)
+  {
+    if(closed)
+      throw runtime_error("HTTP/2: connection closed");
+
+    auto i = streams.find(id);
+
+    if(i == streams.end())
+      throw runtime_error("HTTP/2: stream reset");
+
+    return i->second;
+  }
+};
+
+struct RequestStream : Http2Stream
+{
+  RequestStream(std::shared_ptr<Connection> conn_, uint32_t id_) : conn(conn_), id(id_)
+  {
+  }
+
+  ~RequestStream()
+  {
+    std::unique_lock<std::mutex> lock(conn->mutex);
+
+    // the handler failed before the end
+    if(!conn->closed && conn->streams.erase(id))
+    {
+      conn->queueRstStream(id, Error_Internal);
+      conn->canSend.notify_all();
+    }
+  }
+
+  size_t readBody(uint8_t* data, size_t len, bool& complete) override
+  {
+    complete = false;
+    std::unique_lock<std::mutex> lock(conn->mutex);
+
+    while(1)
+    {
+      if(conn->closed)
+        return 0;
+
+      auto i = conn->streams.find(id);
+
+      if(i == conn->streams.end())
+        return 0; // reset
+
+      auto& stream = i->second;
+      auto const available = stream.body.size() - stream.bodyPos;
+
+      if(available > 0)
+      {
+        auto const n = std::min(len, available);
+        memcpy(data, stream.body.data() + stream.bodyPos, n);
+        stream.bodyPos += n;
+
+        if(stream.bodyPos == stream.body.size())
+        {
+          stream.body.clear();
+          stream.bodyPos = 0;
+        }
+
+        // the client can send more
+        if(!stream.bodyComplete)
+          conn->credit(id, stream.readCredit, n);
+
+        return n;
+      }
+
+      if(stream.bodyComplete)
+      {
+        complete = true;
+        return 0;
+      }
+
+      if(!conn->bodyTimeout_ms)
+      {
+        conn->canRead.wait(lock);
+        continue;
+      }
+
+      // re-armed on each arrival
+      if(conn->canRead.wait_for(lock, std::chrono::milliseconds(conn->bodyTimeout_ms)) == std::cv_status::timeout)
+      {
+        auto const j = conn->streams.find(id);
+
+        if(j != conn->streams.end() && j->second.body.size() == j->second.bodyPos && !j->second.bodyComplete)
+        {
+          DbgTrace("event=connection_timeout phase=body protocol=http2\n");
+          conn->streams.erase(j);
+          conn->queueRstStream(id, Error_Cancel);
+          conn->canSend.notify_all();
+          return 0;
+        }
+      }
+    }
+  }
+
+  void writeHeaders(int status, HeaderList const& headers, bool endStream) override
+  {
+    HeaderList fields;
+    fields.push_back({ ":status", to_string(status) });
+    fields.insert(fields.end(), headers.begin(), headers.end());
+
+    string block;
+    hpackEncode(fields, block);
+
+    std::unique_lock<std::mutex> lock(conn->mutex);
+    conn->openStream(id);
+
+    // a block bigger than a frame goes on in CONTINUATION frames, queued
+    // together: nothing may come in between.
+    auto data = (const uint8_t*)block.data();
+    auto len = block.size();
+    uint8_t type = Frame_Headers;
+    uint8_t flags = endStream ? Flag_EndStream : 0;
+
+    while(1)
+    {
+      auto const n = std::min(len, conn->maxFrameSize);
+
+      if(n == len)
+        flags |= Flag_EndHeaders;
+
+      conn->queue(type, flags, id, data, n);
+
+      data += n;
+      len -= n;
+
+      if(len == 0)
+        break;
+
+      type = Frame_Continuation;
+      flags = 0;
+    }
+
+    if(endStream)
+      conn->streams.erase(id);
+  }
+
+  void writeData(const uint8_t* data, size_t len) override
+  {
+    while(len > 0)
+    {
+      std::unique_lock<std::mutex> lock(conn->mutex);
+      StreamState* stream;
+
+      while(1)
+      {
+        stream = &conn->openStream(id);
+
+        if(stream->window > 0 && conn->window > 0 && conn->output.size() < MaxQueuedBytes)
+          break;
+
+        conn->canSend.wait(lock);
+      }
+
+      auto const n = std::min({ len, (size_t)stream->window, (size_t)conn->window, conn->maxFrameSize });
+      stream->window -= n;
+      conn->window -= n;
+      conn->queue(Frame_Data, 0, id, data, n);
+
+      data += n;
+      len -= n;
+    }
+  }
+
+  void end() override
+  {
+    std::unique_lock<std::mutex> lock(conn->mutex);
+    conn->openStream(id);
+    conn->queue(Frame_Data, Flag_EndStream, id, nullptr, 0);
+    conn->streams.erase(id);
+  }
+
+  const std::shared_ptr<Connection> conn;
+  const uint32_t id;
+};
+
+struct ConnectionThread
+{
+  ConnectionThread(IStream* s_, std::function<void(HttpRequest& req, Http2Stream* stream)> handler_, int idle_timeout_ms_)
+    : s(s_), handler(handler_), idle_timeout_ms(idle_timeout_ms_), conn(make_shared<Connection>())
+  {
+    conn->s = s;
+    conn->connectionThread = std::this_thread::get_id();
+    conn->bodyTimeout_ms = idle_timeout_ms;
+  }
+
+  ~ConnectionThread()
+  {
+    std::unique_lock<std::mutex> lock(conn->mutex);
+    conn->closed = true;
+    conn->streams.clear();
+    conn->canSend.notify_all();
+    conn->canRead.notify_all();
+  }
+
+  void run()
+  {
+    uint8_t preface[sizeof Preface - 1];
+
+    if(s->read(preface, sizeof preface) != sizeof preface || memcmp(preface, Preface, sizeof preface) != 0)
+      throw runtime_error("HTTP/2: invalid connection preface");
+
+    {
+      uint8_t settings[18];
+      settings[0] = 0;
+      settings[1] = Setting_MaxConcurrentStreams;
+      writeU32(settings + 2, MaxConcurrentStreams);
+      settings[6] = 0;
+      settings[7] = Setting_InitialWindowSize;
+      writeU32(settings + 8, ReceiveWindowSize);
+      settings[12] = 0;
+      settings[13] = Setting_MaxHeaderListSize;
+      writeU32(settings + 14, HpackDecoder::MaxHeaderListSize);
+
+      std::unique_lock<std::mutex> lock(conn->mutex);
+      conn->queue(Frame_Settings, 0, 0, settings, sizeof settings);
+      conn->queueWindowUpdate(0, ReceiveWindowSize - DefaultWindowSize);
+    }
+
+    Frame frame;
+
+    while(1)
+    {
+      flush();
+      watchIdle();
+
+      if(!s->waitReadable(-1))
+        continue; // woken up, to send
+
+      if(!readFrame(frame))
+        break; // connection closed
+
+      if(frame.type == Frame_GoAway)
+        break;
+
+      processFrame(frame);
+    }
+
+    flush();
+  }
+
+  // Closes the connection once it has had no open streams for
+  // 'idle_timeout_ms'.
+  void watchIdle()
+  {
+    if(!idle_timeout_ms)
+      return;
+
+    bool idle;
+
+    {
+      std::unique_lock<std::mutex> lock(conn->mutex);
+      idle = conn->streams.empty();
+    }
+
+    if(idle && !idleTimerArmed)
+    {
+      auto stream = s;
+      auto onIdle = [stream] ()
+        {
+          DbgTrace("event=connection_timeout phase=idle protocol=http2\n");
+          stream->abort();
+        };
+
+      idleTimer.arm(idle_timeout_ms, onIdle);
+    }
+    else if(!idle && idleTimerArmed)
+      idleTimer.cancel();
+
+    idleTimerArmed = idle;
+  }
+
+  // Sends what the request threads queued.
+  void flush()
+  {
+    {
+      std::unique_lock<std::mutex> lock(conn->mutex);
+
+      if(conn->output.size() == 0)
+        return;
+
+      std::swap(sending, conn->output);
+      conn->canSend.notify_all();
+    }
+
+    s->write(sending.data(), sending.size());
+    sending.clear();
+  }
+
+  bool readFrame(Frame& frame)
+  {
+    uint8_t header[9];
+
+    if(s->read(header, sizeof header) != sizeof header)
+      return false;
+
+    auto const len = (size_t)header[0] << 16 | (size_t)header[1] << 8 | header[2];
+    frame.type = header[3];
+    frame.flags = header[4];
+    frame.streamId = readU32(header + 5) & 0x7fffffff;
+
+    if(len > DefaultMaxFrameSize)
+      fail(Error_FrameSize, "HTTP/2: frame too big");
+
+    frame.payload.resize(len);
+
+    return s->read(frame.payload.data(), len) == len;
+  }
+
+  // Sends GOAWAY, and throws.
+  [[noreturn]] void fail(ErrorCode code, const char* reason)
+  {
+    {
+      uint8_t payload[8];
+      writeU32(payload, lastStreamId);
+      writeU32(payload + 4, code);
+
+      std::unique_lock<std::mutex> lock(conn->mutex);
+      conn->queue(Frame_GoAway, 0, 0, payload, sizeof payload);
+    }
+
+    flush();
+    throw runtime_error(reason);
+  }
+
+  void processFrame(Frame& frame)
+  {
+    auto const payload = frame.payload.data();
+    auto const len = frame.payload.size();
+
+    if(inHeaderBlock && frame.type != Frame_Continuation)
+      fail(Error_Protocol, "HTTP/2: expected CONTINUATION");
+
+    switch(frame.type)
+    {
+    case Frame_Data:
+      {
+        if(frame.streamId == 0)
+          fail(Error_Protocol, "HTTP/2: DATA on stream 0");
+
+        size_t padding = 0;
+
+        if(frame.flags & Flag_Padded)
+        {
+          if(len < 1 || payload[0] >= len)
+            fail(Error_Protocol, "HTTP/2: invalid padding");
+
+          padding = 1 + payload[0];
+        }
+
+        std::unique_lock<std::mutex> lock(conn->mutex);
+
+        // the connection window is credited back on reception, not when the
+        // body is read: a request that isn't read doesn't hold back the others
+        conn->credit(0, conn->receivedCredit, len);
+
+        auto i = conn->streams.find(frame.streamId);
+
+        if(i == conn->streams.end() || i->second.bodyComplete)
+          break; // e.g. already answered
+
+        auto& stream = i->second;
+        auto const dataLen = len - padding;
+
+        // the stream window, once the body is read
+        if(!(frame.flags & Flag_EndStream))
+          conn->credit(frame.streamId, stream.readCredit, padding);
+
+        auto const unread = stream.body.size() - stream.bodyPos;
+
+        if(unread + dataLen > ReceiveWindowSize)
+        {
+          conn->streams.erase(i);
+          conn->queueRstStream(frame.streamId, Error_FlowControl);
+          conn->canRead.notify_all();
+          break;
+        }
+
+        // drop what was read
+        if(stream.bodyPos > 0)
+        {
+          memmove(stream.body.data(), stream.body.data() + stream.bodyPos, unread);
+          stream.body.resize(unread);
+          stream.bodyPos = 0;
+        }
+
+        if(dataLen > 0)
+          stream.body.append(payload + (frame.flags & Flag_Padded ? 1 : 0), dataLen);
+
+        if(frame.flags & Flag_EndStream)
+          stream.bodyComplete = true;
+
+        conn->canRead.notify_all();
+        break;
+      }
+
+    case Frame_Headers:
+      {
+        if(frame.streamId == 0 || frame.streamId % 2 == 0)
+          fail(Error_Protocol, "HTTP/2: invalid stream identifier");
+
+        size_t begin = 0;
+        size_t end = len;
+
+        if(frame.flags & Flag_Padded)
+        {
+          if(len < 1 || payload[0] >= len)
+            fail(Error_Protocol, "HTTP/2: invalid padding");
+
+          begin += 1;
+          end -= payload[0];
+        }
+
+        // stream dependency and weight: ignored
+        if(frame.flags & Flag_Priority)
+          begin += 5;
+
+        if(begin > end)
+          fail(Error_FrameSize, "HTTP/2: HEADERS too short");
+
+        headerBlock.assign(payload + begin, end - begin);
+        headerStreamId = frame.streamId;
+        headerEndStream = frame.flags & Flag_EndStream;
+
+        if(frame.flags & Flag_EndHeaders)
+          processHeaderBlock();
+        else
+          inHeaderBlock = true;
+
+        break;
+      }
+
+    case Frame_Continuation:
+      {
+        if(!inHeaderBlock || frame.streamId != headerStreamId)
+          fail(Error_Protocol, "HTTP/2: unexpected CONTINUATION");
+
+        if(headerBlock.size() + len > MaxHeaderBlockSize)
+          fail(Error_Protocol, "HTTP/2: header block too big");
+
+        headerBlock.append(payload, len);
+
+        if(frame.flags & Flag_EndHeaders)
+        {
+          inHeaderBlock = false;
+          processHeaderBlock();
+        }
+
+        break;
+      }
+
+    case Frame_RstStream:
+      {
+        std::unique_lock<std::mutex> lock(conn->mutex);
+
+        if(conn->streams.erase(frame.streamId))
+        {
+          DbgTrace("event=http2_stream_reset stream=%u\n", frame.streamId);
+          conn->canSend.notify_all();
+          conn->canRead.notify_all();
+        }
+
+        break;
+      }
+
+    case Frame_Settings:
+      {
+        if(frame.flags & Flag_Ack)
+          break;
+
+        if(frame.streamId != 0 || len % 6 != 0)
+          fail(Error_FrameSize, "HTTP/2: invalid SETTINGS");
+
+        std::unique_lock<std::mutex> lock(conn->mutex);
+
+        for(size_t i = 0; i < len; i += 6)
+        {
+          auto const id = payload[i] << 8 | payload[i + 1];
+          auto const value = readU32(payload + i + 2);
+
+          if(id == Setting_InitialWindowSize)
+          {
+            if(value > MaxWindowSize)
+            {
+              lock.unlock();
+              fail(Error_FlowControl, "HTTP/2: invalid initial window size");
+            }
+
+            // applies to the open streams too
+            for(auto& stream : conn->streams)
+              stream.second.window += value - conn->initialWindow;
+
+            conn->initialWindow = value;
+          }
+          else if(id == Setting_MaxFrameSize)
+          {
+            if(value < DefaultMaxFrameSize || value > 0xffffff)
+            {
+              lock.unlock();
+              fail(Error_Protocol, "HTTP/2: invalid max frame size");
+            }
+
+            conn->maxFrameSize = value;
+          }
+        }
+
+        conn->queue(Frame_Settings, Flag_Ack, 0, nullptr, 0);
+        conn->canSend.notify_all();
+        break;
+      }
+
+    case Frame_Ping:
+      {
+        if(frame.streamId != 0 || len != 8)
+          fail(Error_FrameSize, "HTTP/2: invalid PING");
+
+        if(frame.flags & Flag_Ack)
+          break;
+
+        std::unique_lock<std::mutex> lock(conn->mutex);
+        conn->queue(Frame_Ping, Flag_Ack, 0, payload, len);
+        break;
+      }
+
+    case Frame_WindowUpdate:
+      {
+        if(len != 4)
+          fail(Error_FrameSize, "HTTP/2: invalid WINDOW_UPDATE");
+
+        auto const increment = readU32(payload) & 0x7fffffff;
+
+        std::unique_lock<std::mutex> lock(conn->mutex);
+
+        if(frame.streamId == 0)
+        {
+          conn->window += increment;
+
+          if(increment == 0 || conn->window > MaxWindowSize)
+          {
+            lock.unlock();
+            fail(Error_FlowControl, "HTTP/2: invalid connection window update");
+          }
+        }
+        else
+        {
+          auto i = conn->streams.find(frame.streamId);
+
+          if(i != conn->streams.end())
+          {
+            i->second.window += increment;
+
+            if(increment == 0 || i->second.window > MaxWindowSize)
+            {
+              conn->streams.erase(i);
+              conn->queueRstStream(frame.streamId, Error_FlowControl);
+            }
+          }
+        }
+
+        conn->canSend.notify_all();
+        break;
+      }
+
+    case Frame_PushPromise:
+      fail(Error_Protocol, "HTTP/2: PUSH_PROMISE from a client");
+
+    default:
+      break; // PRIORITY, and unknown frame types, are ignored
+    }
+  }
+
+  // Answers 431 (Request Header Fields Too Large), and closes the stream.
+  void replyHeadersTooBig(uint32_t id)
+  {
+    string block;
+    hpackEncode({ { ":status", "431" } }, block);
+
+    std::unique_lock<std::mutex> lock(conn->mutex);
+    conn->queue(Frame_Headers, Flag_EndStream | Flag_EndHeaders, id, (const uint8_t*)block.data(), block.size());
+
+    // the client can stop sending the body (RFC 9113, section 8.1)
+    if(!headerEndStream)
+      conn->queueRstStream(id, Error_None);
+  }
+
+  void processHeaderBlock()
+  {
+    HeaderList fields;
+    bool tooBig;
+
+    // decoded even if the stream is refused: the dynamic table must follow
+    if(!decoder.decode(headerBlock.data(), headerBlock.size(), fields, tooBig))
+      fail(Error_Compression, "HTTP/2: invalid header block");
+
+    auto const id = headerStreamId;
+
+    // trailers of a request body: ignored
+    if(id <= lastStreamId)
+    {
+      std::unique_lock<std::mutex> lock(conn->mutex);
+
+      if(conn->streams.count(id))
+        return;
+
+      lock.unlock();
+      fail(Error_Protocol, "HTTP/2: HEADERS on a closed stream");
+    }
+
+    lastStreamId = id;
+
+    if(tooBig)
+    {
+      DbgTrace("event=error_reply stream=%u status=431 reason=headers_too_big\n", id);
+      replyHeadersTooBig(id);
+      return;
+    }
+
+    HttpRequest req;
+    req.version = "HTTP/2";
+
+    for(auto& field : fields)
+    {
+      if(field.first == ":method")
+        req.method = field.second;
+      else if(field.first == ":path")
+        req.url = field.second;
+      else if(field.first[0] != ':')
+        req.headers[field.first] = field.second;
+    }
+
+    std::unique_lock<std::mutex> lock(conn->mutex);
+
+    if(req.method.empty() || req.url.empty())
+    {
+      conn->queueRstStream(id, Error_Protocol);
+      return;
+    }
+
+    if(conn->streams.size() >= MaxConcurrentStreams)
+    {
+      conn->queueRstStream(id, Error_RefusedStream);
+      return;
+    }
+
+    auto& stream = conn->streams[id];
+    stream.window = conn->initialWindow;
+    stream.bodyComplete = headerEndStream;
+    lock.unlock();
+
+    auto requestThread = [conn = conn, handler = handler, id] (HttpRequest req)
+      {
+        RequestStream stream(conn, id);
+
+        try
+        {
+          handler(req, &stream);
+        }
+        catch(std::exception const& e)
+        {
+          DbgTrace("event=http2_stream_error stream=%u error=%s\n", id, e.what());
+        }
+      };
+
+    thread(requestThread, std::move(req)).detach();
+  }
+
+  IStream* const s;
+  const std::function<void(HttpRequest& req, Http2Stream* stream)> handler;
+  const int idle_timeout_ms;
+  const std::shared_ptr<Connection> conn;
+
+  HpackDecoder decoder;
+  uint32_t lastStreamId = 0;
+  PooledBuffer sending;
+
+  Timer idleTimer;
+  bool idleTimerArmed = false;
+
+  // header block being received, over HEADERS and CONTINUATION frames
+  PooledBuffer headerBlock;
+  uint32_t headerStreamId = 0;
+  bool headerEndStream = false;
+  bool inHeaderBlock = false;
+};
+}
+
+void serveHttp2(IStream* s, std::function<void(HttpRequest& req, Http2Stream* stream)> handler, int idle_timeout_ms)
+{
+  ConnectionThread connection(s, handler, idle_timeout_ms);
+  connection.run();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+// HTTP/2 (RFC 9113), server side, for the TLS connections that negotiated
+// "h2" through ALPN.
+//
+// The connection thread reads the frames, and is the only one writing to the
+// connection. Each request is served by a thread of its own (like an HTTP/1
+// connection), whose response frames are queued for the connection thread,
+// and wake it up. DATA frames honor the flow control windows of the client,
+// so a stalled stream doesn't hold back the other ones. Request bodies are
+// buffered per stream, and credited back to the client as they are read.
+
+#include <cstddef> // size_t
+#include <cstdint>
+#include <functional>
+
+#include "hpack.h" // HeaderList
+#include "http.h" // HttpRequest
+
+// One request, and its response.
+struct Http2Stream
+{
+  virtual ~Http2Stream() = default;
+
+  // Reads the next part of the request body, blocking until some arrives.
+  // Returns 0 at the end of the body, or if the stream was cut short (reset
+  // by the client, body timeout, connection closed): 'complete' tells them
+  // apart, it's only set if the client ended the body (END_STREAM).
+  virtual size_t readBody(uint8_t* data, size_t len, bool& complete) = 0;
+
+  // The names of 'headers' must be lowercase.
+  // 'endStream': the response has no body.
+  virtual void writeHeaders(int status, HeaderList const& headers, bool endStream) = 0;
+
+  // Blocks while the flow control windows are exhausted.
+  // Throws if the client reset the stream, or closed the connection.
+  virtual void writeData(const uint8_t* data, size_t len) = 0;
+
+  // Ends the response body.
+  virtual void end() = 0;
+};
+
+// Serves the HTTP/2 connection 's', from the client connection preface,
+// until the client closes it, or leaves it without open streams for
+// 'idle_timeout_ms' (0: forever). A request body that doesn't progress for
+// 'idle_timeout_ms' has its stream reset.
+// 'handler' is called on a thread of its own for each request. The header
+// names of 'req' are lowercase, and its version is "HTTP/2".
+void serveHttp2(IStream* s, std::function<void(HttpRequest& req, Http2Stream* stream)> handler, int idle_timeout_ms);
@@ -0,0 +1,53 @@
+#pragma once
+
+// Linux-only io_uring backend, used by tcp_server_gnu.cpp.
+// Talks to the kernel through raw syscalls, so there's no liburing dependency.
+
+#include <cstddef> // size_t
+#include <cstdint>
+#include <functional>
+
+// A single ring, shared by the accept loop and all the connection threads.
+// Operations block the calling thread until completion, like the plain socket
+// calls they replace: each one is handed over to the kernel, and one
+// dedicated thread reaps the completions and wakes up the caller. Submissions
+// made concurrently share an io_uring_enter() call.
+// If the completions can't be reaped anymore, the pending operations fail,
+// and the next ones throw.
+struct IoRing
+{
+  // returns nullptr if io_uring isn't usable on this kernel
+  // (too old, disabled by sysctl, or filtered by seccomp),
+  // or if the relay was built against kernel headers older than 5.19.
+  static IoRing* create(unsigned entries);
+
+  // These return the syscall-style result: a byte count,
+  // or a negative errno value.
+  int send(int fd, const uint8_t* data, size_t len, int flags);
+  int recv(int fd, uint8_t* data, size_t len, int flags);
+
+  // Receives into a buffer picked by the kernel from the provided-buffer ring.
+  // 'consume' is called with the received bytes, before the buffer is
+  // handed back to the kernel.
+  // Only available if 'hasProvidedBuffers()' returns true.
+  int recvProvided(int fd, std::function<void(const uint8_t* data, size_t len)> consume);
+  bool hasProvidedBuffers() const;
+
+  // Arms a (multishot, if supported) accept on 'listenFd'.
+  // Also restarts accepting after 'stopAccept'.
+  void startAccept(int listenFd);
+
+  // Blocks until a new connection is accepted, or 'timeout_ms' expires.
+  // Returns the accepted socket, -ETIMEDOUT, or another negative errno value.
+  int nextAccepted(int timeout_ms);
+
+  // Cancels the accept armed by 'startAccept'. The connections accepted
+  // before are still returned by 'nextAccepted', then it returns -ECANCELED.
+  void stopAccept();
+
+  struct Impl;
+  Impl* const impl;
+
+private:
+  IoRing(Impl* impl_) : impl(impl_) {}
+};
@@ -0,0 +1,685 @@
+#include "io_ring.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring> // memset
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// OS-specific
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Built without the backend if linux/io_uring.h is older than 5.19:
+// 'create' then always fails, and the sockets are used instead.
+#ifdef IORING_ACCEPT_MULTISHOT
+
+namespace
+{
+int sysSetup(unsigned entries, io_uring_params* params)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int sysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+int sysRegister(int fd, unsigned opcode, void* arg, unsigned count)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+template<typename T>
+T loadAcquire(T* p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template<typename T>
+void storeRelease(T* p, T val)
+{
+  __atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
+
+// Links the submitted ops together (see 'IoRing::Impl::inFlight').
+struct OpLink
+{
+  OpLink* prev = nullptr;
+  OpLink* next = nullptr;
+};
+
+// The target of a completion, stored in the 'user_data' of its sqe.
+struct Op : OpLink
+{
+  virtual void complete(int res, uint32_t flags) = 0;
+
+  bool inFlight = false;
+
+protected:
+  ~Op() = default;
+};
+
+// Lives on the stack of the thread waiting for it.
+struct BlockingOp : Op
+{
+  void complete(int res, uint32_t flags) override
+  {
+    // notify while holding the lock: the waiter destroys us as soon as it
+    // sees 'done'.
+    std::unique_lock<std::mutex> lock(mutex);
+    result = res;
+    cqeFlags = flags;
+    done = true;
+    cond.notify_one();
+  }
+
+  int wait()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while(!done)
+      cond.wait(lock);
+
+    return result;
+  }
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool done = false;
+  int result = 0;
+  uint32_t cqeFlags = 0;
+};
+
+struct AcceptOp : Op
+{
+  void complete(int res, uint32_t flags) override
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if(!(flags & IORING_CQE_F_MORE))
+      armed = false;
+
+    if(res == -EINVAL && multishot)
+      multishot = false; // kernel < 5.19: re-arm as single-shot
+    else if(res != -ECANCELED)
+      accepted.push_back(res);
+
+    cond.notify_all();
+  }
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::deque<int> accepted;
+  int listenFd = -1;
+  bool armed = false;
+  bool multishot = true;
+  bool stopped = false; // don't re-arm
+};
+
+const unsigned BufferGroup = 0;
+const unsigned BufferCount = 256; // must be a power of two
+const unsigned BufferSize = 16 * 1024;
+}
+
+struct IoRing::Impl
+{
+  int fd = -1;
+
+  // submission queue, shared by all threads
+  std::mutex sqMutex;
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqArray;
+  unsigned sqMask;
+  unsigned sqEntries;
+  io_uring_sqe* sqes;
+  unsigned pending = 0; // filled but not yet passed to io_uring_enter
+  bool flushing = false;
+
+  // completion queue, only accessed by the reaper thread
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  io_uring_cqe* cqes;
+
+  // provided buffers for receives
+  std::mutex bufMutex;
+  io_uring_buf_ring* bufRing = nullptr;
+  uint8_t* bufBase = nullptr;
+  uint16_t bufTail = 0;
+
+  AcceptOp acceptOp;
+
+  // The ops submitted and not completed yet: failed all at once if the
+  // completions can't be reaped anymore.
+  std::mutex inFlightMutex;
+  OpLink inFlight { &inFlight, &inFlight }; // list head
+  int failure = 0; // negative errno, once the ring is unusable
+
+  // Returns false if the submission queue is full.
+  // Throws if the ring is unusable.
+  template<typename Fill>
+  bool submit(Op* op, Fill fill)
+  {
+    {
+      std::unique_lock<std::mutex> lock(sqMutex);
+
+      auto const head = loadAcquire(sqHead);
+      auto const tail = *sqTail;
+
+      if(tail - head >= sqEntries)
+        return false;
+
+      track(op);
+
+      auto const index = tail & sqMask;
+      auto sqe = &sqes[index];
+      memset(sqe, 0, sizeof *sqe);
+      fill(sqe);
+      sqe->user_data = (uint64_t)(uintptr_t)op;
+      sqArray[index] = index;
+      storeRelease(sqTail, tail + 1);
+
+      pending++;
+
+      // another thread is already in 'flush', it will pick this one up
+      if(flushing)
+        return true;
+
+      flushing = true;
+    }
+
+    flush();
+    return true;
+  }
+
+  // Passes the pending sqes to the kernel. Only one thread flushes at a time,
+  // the others just queue their sqes, which batches concurrent submissions.
+  void flush()
+  {
+    while(1)
+    {
+      unsigned count;
+
+      {
+        std::unique_lock<std::mutex> lock(sqMutex);
+        count = pending;
+        pending = 0;
+
+        if(count == 0)
+        {
+          flushing = false;
+          return;
+        }
+      }
+
+      while(count > 0)
+      {
+        int ret = sysEnter(fd, count, 0, 0);
+
+        if(ret < 0)
+        {
+          if(errno == EINTR)
+            continue;
+
+          if(errno == EAGAIN || errno == EBUSY)
+          {
+            // completion queue is backed up: let the reaper drain it
+            std::this_thread::yield();
+            continue;
+          }
+
+          auto const err = errno;
+          perror("io_uring_enter");
+          failUnsubmitted(-err);
+          break;
+        }
+
+        if(ret == 0)
+          std::this_thread::yield();
+
+        count -= ret;
+      }
+    }
+  }
+
+  // Takes back the sqes the kernel didn't consume, and completes them with
+  // 'res': nobody else would submit them, and their waiters would block forever.
+  void failUnsubmitted(int res)
+  {
+    std::vector<Op*> failed;
+
+    {
+      std::unique_lock<std::mutex> lock(sqMutex);
+
+      auto const head = loadAcquire(sqHead);
+      auto const tail = *sqTail;
+
+      for(auto i = head; i != tail; ++i)
+        failed.push_back((Op*)(uintptr_t)sqes[i & sqMask].user_data);
+
+      storeRelease(sqTail, head);
+      pending = 0;
+    }
+
+    for(auto op : failed)
+      if(untrack(op))
+        op->complete(res, 0);
+  }
+
+  // Called with 'sqMutex' held, before the op can complete.
+  void track(Op* op)
+  {
+    std::unique_lock<std::mutex> lock(inFlightMutex);
+
+    if(failure)
+      throw std::runtime_error("io_uring is unusable");
+
+    if(op->inFlight)
+      return; // a multishot accept, re-armed while still armed
+
+    op->inFlight = true;
+    op->prev = inFlight.prev;
+    op->next = &inFlight;
+    inFlight.prev->next = op;
+    inFlight.prev = op;
+  }
+
+  // Returns false if the op was already completed.
+  bool untrack(Op* op)
+  {
+    std::unique_lock<std::mutex> lock(inFlightMutex);
+    return unlink(op);
+  }
+
+  bool unlink(Op* op)
+  {
+    if(!op->inFlight)
+      return false;
+
+    op->inFlight = false;
+    op->prev->next = op->next;
+    op->next->prev = op->prev;
+    return true;
+  }
+
+  void reap()
+  {
+    while(1)
+    {
+      int ret = sysEnter(fd, 0, 1, IORING_ENTER_GETEVENTS);
+
+      if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      {
+        auto const err = errno;
+        perror("io_uring_enter");
+        failInFlight(-err);
+        return;
+      }
+
+      auto head = *cqHead;
+      auto const tail = loadAcquire(cqTail);
+
+      while(head != tail)
+      {
+        auto const cqe = &cqes[head & cqMask];
+        auto const op = (Op*)(uintptr_t)cqe->user_data;
+        auto const res = cqe->res;
+        auto const flags = cqe->flags;
+        storeRelease(cqHead, ++head);
+
+        // a multishot accept stays armed
+        if(!(flags & IORING_CQE_F_MORE))
+          untrack(op);
+
+        op->complete(res, flags);
+      }
+    }
+  }
+
+  // The completions can't be reaped anymore: the waiters would block
+  // forever. Completes them with 'res', and makes the next submissions throw.
+  void failInFlight(int res)
+  {
+    std::vector<Op*> failed;
+
+    {
+      std::unique_lock<std::mutex> lock(inFlightMutex);
+      failure = res;
+
+      while(inFlight.next != &inFlight)
+      {
+        auto op = static_cast<Op*>(inFlight.next);
+        unlink(op);
+        failed.push_back(op);
+      }
+    }
+
+    for(auto op : failed)
+      op->complete(res, 0);
+  }
+
+  bool setupProvidedBuffers()
+  {
+    auto const ringSize = BufferCount * sizeof(io_uring_buf);
+    auto ringMem = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if(ringMem == MAP_FAILED)
+      return false;
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)ringMem;
+    reg.ring_entries = BufferCount;
+    reg.bgid = BufferGroup;
+
+    if(sysRegister(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+      // kernel < 5.19
+      munmap(ringMem, ringSize);
+      return false;
+    }
+
+    bufRing = (io_uring_buf_ring*)ringMem;
+    bufBase = new uint8_t[BufferCount * BufferSize];
+
+    for(unsigned i = 0; i < BufferCount; ++i)
+      recycle(i);
+
+    return true;
+  }
+
+  void recycle(unsigned bufferId)
+  {
+    std::unique_lock<std::mutex> lock(bufMutex);
+    // The entries overlay the ring header (the tail lives in the first
+    // one). Not using 'bufRing->bufs': in C++, __DECLARE_FLEX_ARRAY places it
+    // after an empty struct, 8 bytes off.
+    auto buf = (io_uring_buf*)bufRing + (bufTail & (BufferCount - 1));
+    buf->addr = (uint64_t)(uintptr_t)(bufBase + bufferId * BufferSize);
+    buf->len = BufferSize;
+    buf->bid = bufferId;
+    storeRelease(&bufRing->tail, ++bufTail);
+  }
+
+  void arm()
+  {
+    bool multishot;
+
+    {
+      std::unique_lock<std::mutex> lock(acceptOp.mutex);
+      multishot = acceptOp.multishot;
+      acceptOp.armed = true;
+    }
+
+    auto const listenFd = acceptOp.listenFd;
+    auto ok = submit(&acceptOp, [&] (io_uring_sqe* sqe) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listenFd;
+
+        if(multishot)
+          sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+      });
+
+    if(!ok)
+    {
+      std::unique_lock<std::mutex> lock(acceptOp.mutex);
+      acceptOp.armed = false;
+    }
+  }
+};
+
+IoRing* IoRing::create(unsigned entries)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof params);
+  params.flags = IORING_SETUP_CLAMP;
+
+  int fd = sysSetup(entries, &params);
+
+  if(fd < 0)
+    return nullptr;
+
+  // we rely on completions never being dropped (kernel >= 5.5)
+  if(!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_SINGLE_MMAP))
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  auto const sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  auto const cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  auto const ringSize = sqSize > cqSize ? sqSize : cqSize;
+
+  auto ringMem = (uint8_t*)mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+  if(ringMem == MAP_FAILED)
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  auto sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if(sqes == MAP_FAILED)
+  {
+    munmap(ringMem, ringSize);
+    close(fd);
+    return nullptr;
+  }
+
+  // The ring lives as long as the process: detached client threads
+  // may be using it until the very end.
+  auto impl = new Impl;
+  impl->fd = fd;
+
+  impl->sqHead = (unsigned*)(ringMem + params.sq_off.head);
+  impl->sqTail = (unsigned*)(ringMem + params.sq_off.tail);
+  impl->sqArray = (unsigned*)(ringMem + params.sq_off.array);
+  impl->sqMask = *(unsigned*)(ringMem + params.sq_off.ring_mask);
+  impl->sqEntries = *(unsigned*)(ringMem + params.sq_off.ring_entries);
+  impl->sqes = (io_uring_sqe*)sqes;
+
+  impl->cqHead = (unsigned*)(ringMem + params.cq_off.head);
+  impl->cqTail = (unsigned*)(ringMem + params.cq_off.tail);
+  impl->cqMask = *(unsigned*)(ringMem + params.cq_off.ring_mask);
+  impl->cqes = (io_uring_cqe*)(ringMem + params.cq_off.cqes);
+
+  impl->setupProvidedBuffers();
+
+  std::thread([impl] () { impl->reap(); }).detach();
+
+  return new IoRing(impl);
+}
+
+int IoRing::send(int fd, const uint8_t* data, size_t len, int flags)
+{
+  if(len > (1u << 30))
+    len = 1u << 30;
+
+  BlockingOp op;
+  auto ok = impl->submit(&op, [&] (io_uring_sqe* sqe) {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t)(uintptr_t)data;
+      sqe->len = (uint32_t)len;
+      sqe->msg_flags = flags;
+    });
+
+  if(!ok)
+  {
+    // submission queue is full: do it synchronously
+    auto ret = ::send(fd, data, len, flags);
+    return ret < 0 ? -errno : (int)ret;
+  }
+
+  return op.wait();
+}
+
+int IoRing::recv(int fd, uint8_t* data, size_t len, int flags)
+{
+  if(len > (1u << 30))
+    len = 1u << 30;
+
+  BlockingOp op;
+  auto ok = impl->submit(&op, [&] (io_uring_sqe* sqe) {
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t)(uintptr_t)data;
+      sqe->len = (uint32_t)len;
+      sqe->msg_flags = flags;
+    });
+
+  if(!ok)
+  {
+    auto ret = ::recv(fd, data, len, flags);
+    return ret < 0 ? -errno : (int)ret;
+  }
+
+  return op.wait();
+}
+
+int IoRing::recvProvided(int fd, std::function<void(const uint8_t* data, size_t len)> consume)
+{
+  BlockingOp op;
+  auto ok = impl->submit(&op, [&] (io_uring_sqe* sqe) {
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = fd;
+      sqe->len = BufferSize;
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BufferGroup;
+    });
+
+  int ret = ok ? op.wait() : -ENOBUFS;
+
+  if(ret == -ENOBUFS)
+  {
+    // all the provided buffers are in use: fall back to a private one
+    uint8_t buffer[BufferSize];
+    ret = recv(fd, buffer, sizeof buffer, 0);
+
+    if(ret > 0)
+      consume(buffer, ret);
+
+    return ret;
+  }
+
+  if(op.cqeFlags & IORING_CQE_F_BUFFER)
+  {
+    auto const bufferId = op.cqeFlags >> IORING_CQE_BUFFER_SHIFT;
+
+    if(ret > 0)
+      consume(impl->bufBase + bufferId * BufferSize, ret);
+
+    impl->recycle(bufferId);
+  }
+
+  return ret;
+}
+
+bool IoRing::hasProvidedBuffers() const
+{
+  return impl->bufRing != nullptr;
+}
+
+void IoRing::startAccept(int listenFd)
+{
+  {
+    std::unique_lock<std::mutex> lock(impl->acceptOp.mutex);
+    impl->acceptOp.listenFd = listenFd;
+    impl->acceptOp.stopped = false;
+  }
+
+  impl->arm();
+}
+
+int IoRing::nextAccepted(int timeout_ms)
+{
+  auto& op = impl->acceptOp;
+  std::unique_lock<std::mutex> lock(op.mutex);
+
+  while(op.accepted.empty())
+  {
+    if(!op.armed)
+    {
+      if(op.stopped)
+        return -ECANCELED;
+
+      lock.unlock();
+      impl->arm();
+      lock.lock();
+
+      if(!op.armed && op.accepted.empty())
+        return -EAGAIN; // submission queue is full
+
+      continue;
+    }
+
+    if(op.cond.wait_for(lock, std::chrono::milliseconds(timeout_ms)) == std::cv_status::timeout && op.accepted.empty())
+      return -ETIMEDOUT;
+  }
+
+  auto fd = op.accepted.front();
+  op.accepted.pop_front();
+  return fd;
+}
+
+void IoRing::stopAccept()
+{
+  auto& op = impl->acceptOp;
+
+  {
+    std::unique_lock<std::mutex> lock(op.mutex);
+    op.stopped = true;
+
+    if(!op.armed)
+      return;
+  }
+
+  BlockingOp cancel;
+  auto const target = (uint64_t)(uintptr_t)&op;
+
+  auto ok = impl->submit(&cancel, [&] (io_uring_sqe* sqe) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = target;
+    });
+
+  if(!ok)
+    return;
+
+  cancel.wait();
+
+  // the accept may complete after the cancellation
+  std::unique_lock<std::mutex> lock(op.mutex);
+
+  while(op.armed)
+    op.cond.wait(lock);
+}
+
+#else
+
+IoRing* IoRing::create(unsigned)
+{
+  return nullptr;
+}
+
+// unreachable: no IoRing can be created
+int IoRing::send(int, const uint8_t*, size_t, int) { return -ENOSYS; }
+int IoRing::recv(int, uint8_t*, size_t, int) { return -ENOSYS; }
+int IoRing::recvProvided(int, std::function<void(const uint8_t* data, size_t len)>) { return -ENOSYS; }
+bool IoRing::hasProvidedBuffers() const { return false; }
+void IoRing::startAccept(int) {}
+int IoRing::nextAccepted(int) { return -ENOSYS; }
+void IoRing::stopAccept() {}
+
+#endif
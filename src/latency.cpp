@@ -0,0 +1,111 @@
+#include "latency.h"
+#include "tcp_server.h" // DbgTrace
+
+#include <algorithm> // min
+#include <chrono>
+#include <cstdio> // snprintf
+
+namespace
+{
+std::atomic<int> g_traceEvery { 0 };
+std::atomic<uint64_t> g_deliveries { 0 };
+
+int bucketOf(int64_t us)
+{
+  int i = 0;
+
+  while(us > 0 && i < LatencyHistogram::NumBuckets - 1)
+  {
+    us >>= 1;
+    i++;
+  }
+
+  return i;
+}
+}
+
+int64_t monotonicMicros()
+{
+  auto const now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+void LatencyHistogram::record(int64_t us)
+{
+  if(us < 0)
+    us = 0;
+
+  m_buckets[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+  m_count.fetch_add(1, std::memory_order_relaxed);
+
+  auto max = m_max.load(std::memory_order_relaxed);
+
+  while(us > max && !m_max.compare_exchange_weak(max, us, std::memory_order_relaxed))
+  {
+  }
+}
+
+uint64_t LatencyHistogram::count() const
+{
+  return m_count.load(std::memory_order_relaxed);
+}
+
+int64_t LatencyHistogram::percentile(double p) const
+{
+  uint64_t total = 0;
+
+  for(auto& bucket : m_buckets)
+    total += bucket.load(std::memory_order_relaxed);
+
+  if(total == 0)
+    return 0;
+
+  auto const max = m_max.load(std::memory_order_relaxed);
+
+  auto const rank = (uint64_t)(total * p / 100.0);
+  uint64_t seen = 0;
+
+  for(int i = 0; i < NumBuckets; ++i)
+  {
+    seen += m_buckets[i].load(std::memory_order_relaxed);
+
+    if(seen > rank)
+      return i == 0 ? 0 : std::min(((int64_t)1 << i) - 1, max);
+  }
+
+  return max;
+}
+
+std::string LatencyHistogram::summary() const
+{
+  char buffer[256];
+  snprintf(buffer, sizeof buffer, "count=%llu p50_us=%lld p90_us=%lld p99_us=%lld max_us=%lld",
+           (unsigned long long)count(),
+           (long long)percentile(50),
+           (long long)percentile(90),
+           (long long)percentile(99),
+           (long long)m_max.load(std::memory_order_relaxed));
+  return buffer;
+}
+
+LatencyHistogram& globalPropagationDelay()
+{
+  static LatencyHistogram histogram;
+  return histogram;
+}
+
+void setPropagationTraceSampling(int everyN)
+{
+  g_traceEvery = everyN;
+}
+
+void recordPropagation(LatencyHistogram& perResource, const std::string& url, size_t offset, size_t size, int64_t delay_us)
+{
+  perResource.record(delay_us);
+  globalPropagationDelay().record(delay_us);
+
+  auto const every = g_traceEvery.load(std::memory_order_relaxed);
+
+  if(every > 0 && g_deliveries.fetch_add(1, std::memory_order_relaxed) % every == 0)
+    DbgTrace("event=chunk_propagation url=%s offset=%zu size=%zu delay_us=%lld\n", url.c_str(), offset, size, (long long)delay_us);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+// Propagation latency: how long a chunk takes from being appended to a
+// resource by the producer, to being written to a reader.
+//
+// Every append is stamped with a monotonic timestamp. Each time a reader
+// writes appended data out, the delay of every append it covers is recorded,
+// in the histogram of the resource and in the global one.
+
+#include <atomic>
+#include <cstddef> // size_t
+#include <cstdint>
+#include <string>
+
+// microseconds, from a monotonic clock
+int64_t monotonicMicros();
+
+// Log-scale histogram of delays, in microseconds.
+// Bucket 'i' counts the values in [2^(i-1), 2^i), bucket 0 counts zero.
+// Recording is lock-free, so the readers of a resource can share one.
+struct LatencyHistogram
+{
+  enum { NumBuckets = 40 };
+
+  void record(int64_t us);
+
+  uint64_t count() const;
+
+  // upper bound of the bucket containing the 'p'-th percentile (0 to 100),
+  // capped by the maximum
+  int64_t percentile(double p) const;
+
+  // formats "count=... p50_us=... p90_us=... p99_us=... max_us=..."
+  std::string summary() const;
+
+private:
+  std::atomic<uint64_t> m_buckets[NumBuckets] {};
+  std::atomic<uint64_t> m_count { 0 };
+  std::atomic<int64_t> m_max { 0 };
+};
+
+// All deliveries, on all resources, since startup.
+LatencyHistogram& globalPropagationDelay();
+
+// Traces one delivery out of 'everyN' (0 disables the per-chunk trace).
+void setPropagationTraceSampling(int everyN);
+
+// Records the delivery of the appended range [offset, offset + size) of 'url'
+// to one reader, 'delay_us' after it was appended.
+void recordPropagation(LatencyHistogram& perResource, const std::string& url, size_t offset, size_t size, int64_t delay_us);
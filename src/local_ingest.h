@@ -0,0 +1,46 @@
+#pragma once
+
+// Local ingest: lets a producer running on the same host publish resources
+// without going through HTTP and the TCP stack.
+//
+// The producer connects to a unix-domain SOCK_SEQPACKET socket, and sends one
+// message per operation: a LocalIngestHeader, followed by the URL, followed
+// (for inline appends only) by the payload.
+// Any message can carry a file descriptor (SCM_RIGHTS) to a shared memory
+// object. It must be a memfd sealed with F_SEAL_SHRINK and F_SEAL_GROW,
+// otherwise the message is rejected with -EPERM.
+// It becomes the shared region of this URL until the upload ends: the
+// following appends reference byte ranges of it instead of carrying the data,
+// and the relay copies them straight from the mapping into the resource.
+// The producer may reuse a range once the append has been acknowledged.
+//
+// Each message is acknowledged with a LocalIngestAck, in order.
+// Uploads still open when the connection closes are discarded.
+
+#include <cstdint>
+
+enum LocalIngestOp : uint32_t
+{
+  LocalIngest_Begin = 1, // (re)creates the resource, like a PUT
+  LocalIngest_Append = 2, // appends [offset, offset + length)
+  LocalIngest_End = 3, // marks the resource as complete
+  LocalIngest_Delete = 4, // deletes the resource, like a DELETE
+};
+
+struct LocalIngestHeader
+{
+  uint32_t op; // LocalIngestOp
+  uint32_t urlLength;
+  uint64_t offset; // Append: offset in the shared region
+  uint64_t length; // Append: number of bytes
+};
+
+struct LocalIngestAck
+{
+  int32_t status; // 0, or a negative errno value
+};
+
+// Starts listening on the unix socket 'path' (replacing any stale socket
+// file), and serves producers from a background thread.
+// Throws if the socket can't be set up.
+void startLocalIngestServer(const char* path);
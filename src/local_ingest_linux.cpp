@@ -0,0 +1,354 @@
+#include "local_ingest.h"
+#include "replication.h"
+#include "resource.h"
+#include "tcp_server.h" // DbgTrace
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio> // perror
+#include <cstring> // memcpy
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+// OS-specific
+#include <fcntl.h> // F_GET_SEALS
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h> // close, unlink
+
+namespace
+{
+// Messages bigger than this are rejected.
+// Big payloads are expected to go through a shared region anyway.
+const size_t MaxMessageSize = 256 * 1024;
+
+// A read-only mapping of the shared memory object attached by the producer.
+// Its size is sealed (see 'isSealed'), so it can be mapped once and for all.
+struct SharedRegion
+{
+  SharedRegion(int fd_) : fd(fd_)
+  {
+    struct stat st;
+
+    if(fstat(fd, &st) < 0 || st.st_size == 0)
+      return;
+
+    auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if(p == MAP_FAILED)
+      return;
+
+    base = (const uint8_t*)p;
+    size = st.st_size;
+  }
+
+  ~SharedRegion()
+  {
+    if(base)
+      munmap((void*)base, size);
+
+    close(fd);
+  }
+
+  SharedRegion(SharedRegion const &) = delete;
+  SharedRegion & operator = (SharedRegion const &) = delete;
+
+  // A producer truncating the object under our mapping would make our reads
+  // fault (SIGBUS), and take the whole relay down: only accept objects whose
+  // size can't change anymore.
+  static bool isSealed(int fd)
+  {
+    auto const required = F_SEAL_SHRINK | F_SEAL_GROW;
+    auto const seals = fcntl(fd, F_GET_SEALS);
+
+    return seals >= 0 && (seals & required) == required;
+  }
+
+  // returns nullptr if the range is out of the region
+  const uint8_t* range(uint64_t offset, uint64_t length)
+  {
+    if(offset + length > size || offset + length < offset)
+      return nullptr;
+
+    return base + offset;
+  }
+
+private:
+  const int fd;
+  const uint8_t* base = nullptr;
+  uint64_t size = 0;
+};
+
+struct Upload
+{
+  std::shared_ptr<Resource> res;
+  std::unique_ptr<SharedRegion> region;
+};
+
+// One producer connection. Several uploads can be in progress at once
+// (e.g. audio and video segments).
+struct Session
+{
+  Session(int fd_) : fd(fd_) {}
+
+  ~Session()
+  {
+    // don't leave readers blocked on a producer that went away,
+    // nor publish what it didn't finish
+    for(auto& upload : uploads)
+    {
+      if(upload.second.res)
+      {
+        upload.second.res->resAbort();
+        discardResource(upload.first, upload.second.res);
+        DbgTrace("event=local_ingest_discarded url=%s\n", upload.first.c_str());
+      }
+    }
+
+    close(fd);
+  }
+
+  void run()
+  {
+    PooledBuffer msg;
+    msg.resize(MaxMessageSize);
+
+    while(1)
+    {
+      iovec iov;
+      iov.iov_base = msg.data();
+      iov.iov_len = msg.size();
+
+      char control[CMSG_SPACE(sizeof(int))];
+
+      msghdr mh {};
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = control;
+      mh.msg_controllen = sizeof control;
+
+      auto n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+
+      if(n <= 0)
+        break;
+
+      int attachedFd = -1;
+
+      for(auto cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+      {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+          memcpy(&attachedFd, CMSG_DATA(cmsg), sizeof attachedFd);
+      }
+
+      LocalIngestAck ack;
+
+      if(mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+      {
+        if(attachedFd >= 0)
+          close(attachedFd);
+
+        ack.status = -EMSGSIZE;
+      }
+      else
+      {
+        ack.status = process(msg.data(), n, attachedFd);
+      }
+
+      if(::send(fd, &ack, sizeof ack, MSG_NOSIGNAL) != sizeof ack)
+        break;
+    }
+  }
+
+private:
+  int process(const uint8_t* msg, size_t len, int attachedFd)
+  {
+    std::unique_ptr<SharedRegion> region;
+
+    if(attachedFd >= 0)
+    {
+      if(!SharedRegion::isSealed(attachedFd))
+      {
+        close(attachedFd);
+        return -EPERM;
+      }
+
+      region.reset(new SharedRegion(attachedFd));
+    }
+
+    LocalIngestHeader hdr;
+
+    if(len < sizeof hdr)
+      return -EINVAL;
+
+    memcpy(&hdr, msg, sizeof hdr);
+
+    if(hdr.urlLength > len - sizeof hdr)
+      return -EINVAL;
+
+    string url((const char*)msg + sizeof hdr, hdr.urlLength);
+    auto const payload = msg + sizeof hdr + hdr.urlLength;
+    auto const payloadLength = len - sizeof hdr - hdr.urlLength;
+
+    if(hdr.op == LocalIngest_Delete)
+    {
+      DbgTrace("event=local_ingest_delete url=%s\n", url.c_str());
+      auto i_upload = uploads.find(url);
+
+      if(i_upload != uploads.end())
+      {
+        i_upload->second.res->resAbort();
+        uploads.erase(i_upload);
+      }
+
+      replicateDelete(url);
+      return deleteResource(url) ? 0 : -ENOENT;
+    }
+
+    if(hdr.op == LocalIngest_Begin)
+    {
+      DbgTrace("event=local_ingest_begin url=%s\n", url.c_str());
+      auto& upload = uploads[url];
+
+      // replaced before completion
+      if(upload.res)
+        upload.res->resAbort();
+
+      upload.res = createResource(url);
+      replicateUploads(url, *upload.res);
+      upload.res->resBegin();
+    }
+
+    auto i_upload = uploads.find(url);
+
+    if(i_upload == uploads.end())
+      return -ENOENT; // no 'Begin' for this URL
+
+    auto& upload = i_upload->second;
+
+    if(region)
+      upload.region = std::move(region);
+
+    switch(hdr.op)
+    {
+    case LocalIngest_Begin:
+      break;
+
+    case LocalIngest_Append:
+      {
+        if(upload.region)
+        {
+          auto src = upload.region->range(hdr.offset, hdr.length);
+
+          if(!src)
+            return -ERANGE;
+
+          upload.res->resAppend(src, hdr.length);
+        }
+        else
+        {
+          upload.res->resAppend(payload, payloadLength);
+        }
+
+        DbgTrace("event=resource_chunk_received url=%s chunk_size=%d\n", url.c_str(), upload.region ? (int)hdr.length : (int)payloadLength);
+        break;
+      }
+
+    case LocalIngest_End:
+      upload.res->resEnd();
+      uploads.erase(i_upload);
+      DbgTrace("event=resource_created url=%s\n", url.c_str());
+      break;
+
+    default:
+      return -EINVAL;
+    }
+
+    return 0;
+  }
+
+  const int fd;
+  std::map<std::string, Upload> uploads;
+};
+}
+
+void startLocalIngestServer(const char* path)
+{
+  const int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+  if(sock < 0)
+  {
+    perror("socket");
+    throw runtime_error("can't create local ingest socket");
+  }
+
+  sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+
+  if(strlen(path) >= sizeof address.sun_path)
+    throw runtime_error("local ingest socket path is too long");
+
+  strcpy(address.sun_path, path);
+
+  unlink(path);
+
+  if(::bind(sock, (sockaddr*)&address, sizeof address) < 0)
+  {
+    perror("bind");
+    throw runtime_error("Can't bind local ingest socket");
+  }
+
+  if(listen(sock, 64) < 0)
+  {
+    perror("listen");
+    throw runtime_error("Can't listen on local ingest socket");
+  }
+
+  DbgTrace("event=local_ingest_listening path=%s\n", path);
+
+  auto acceptThread = [sock] ()
+    {
+      while(1)
+      {
+        int clientSocket = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+
+        if(clientSocket < 0)
+        {
+          auto const err = errno;
+
+          if(err == EINTR || err == ECONNABORTED)
+            continue;
+
+          perror("accept");
+
+          // out of file descriptors or memory: wait for some to be released
+          if(err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+          {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
+          }
+
+          DbgTrace("event=local_ingest_stopped\n");
+          close(sock);
+          break;
+        }
+
+        auto sessionThread = [clientSocket] ()
+          {
+            Session session(clientSocket);
+            session.run();
+            DbgTrace("event=local_ingest_closed\n");
+          };
+
+        thread(sessionThread).detach();
+      }
+    };
+
+  thread(acceptThread).detach();
+}
@@ -5,15 +5,31 @@
 #include <map>
 #include <string>
 #include <cstring> // memcpy
-#include <sstream>
+#include <cctype> // isspace
 #include <memory>
 #include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <thread> // std::this_thread
 #include <chrono> // std::chrono::milliseconds
+#include <atomic>
+#include <algorithm> // max
 
 #include "tcp_server.h"
+#include "resource.h"
+#include "http.h"
+#include "http2.h"
+#include "upstream.h"
+#include "replication.h"
+#include "local_ingest.h"
+#include "spill.h"
+#include "upgrade.h"
+#include "latency.h"
+#include "probes.h"
+#include "compression.h"
+#include "egress.h"
+#include "subscriptions.h"
+#include "timer_wheel.h"
 
 using namespace std;
 
@@ -30,18 +46,10 @@ const char *get_version() {
 ///////////////////////////////////////////////////////////////////////////////
 // http_client.cpp
 
-struct HttpRequest
+// Reads a line into 'r', reusing its storage.
+void readLine(IStream* s, string& r)
 {
-  string method; // e.g: PUT, POST, GET
-  string url; // e.g: /toto/dash.mp4
-  string version; // e.g: HTTP/1.1
-
-  map<string, string> headers;
-};
-
-string readLine(IStream* s)
-{
-  string r;
+  r.clear();
 
   while(1)
   {
@@ -59,134 +67,189 @@ string readLine(IStream* s)
 
   if(!r.empty() && r.back() == '\r')
     r.pop_back();
+}
 
+string readLine(IStream* s)
+{
+  string r;
+  readLine(s, r);
   return r;
 };
 
 void writeLine(IStream* s, const char* l)
 {
+  auto const len = strlen(l);
+
+  // status lines, headers and chunk sizes fit on the stack
+  char buffer[256];
+
+  if(len + 2 <= sizeof buffer)
+  {
+    memcpy(buffer, l, len);
+    memcpy(buffer + len, "\r\n", 2);
+    s->write((const uint8_t*)buffer, len + 2);
+    return;
+  }
+
   string line = l;
   line += "\r\n";
   s->write((const uint8_t*)line.c_str(), line.size());
 }
 
-HttpRequest parseRequest(IStream* s)
+// Extracts the next space-delimited word of 'line', starting at 'pos'.
+void nextWord(const string& line, size_t& pos, string& word)
 {
-  HttpRequest r;
+  while(pos < line.size() && isspace((unsigned char)line[pos]))
+    pos++;
+
+  auto const start = pos;
+
+  while(pos < line.size() && !isspace((unsigned char)line[pos]))
+    pos++;
 
-  string req = readLine(s);
+  word.assign(line, start, pos - start);
+}
 
-  stringstream ss(req);
-  ss >> r.method;
-  ss >> std::ws;
-  ss >> r.url;
-  ss >> std::ws;
-  ss >> r.version;
+void parseHeaders(IStream* s, map<string, string>& headers)
+{
+  // The line buffer is reused for every line of every request handled by
+  // this connection thread, so header parsing doesn't allocate once warm.
+  thread_local string line;
 
   while(1)
   {
-    auto line = readLine(s);
+    readLine(s, line);
 
     if(line.empty())
       break;
 
-    string name, value;
-    stringstream ss(line);
-    ss >> name;
+    auto const colon = line.find(':');
 
-    if(!name.empty() && name.back() == ':')
-      name.pop_back();
+    if(colon == string::npos)
+      continue;
 
-    ss >> std::ws;
-    ss >> value;
+    auto nameEnd = colon;
 
-    r.headers[name] = value;
-  }
+    while(nameEnd > 0 && isspace((unsigned char)line[nameEnd - 1]))
+      nameEnd--;
 
-  return r;
+    auto valueBegin = colon + 1;
+
+    while(valueBegin < line.size() && isspace((unsigned char)line[valueBegin]))
+      valueBegin++;
+
+    auto valueEnd = line.size();
+
+    while(valueEnd > valueBegin && isspace((unsigned char)line[valueEnd - 1]))
+      valueEnd--;
+
+    headers[line.substr(0, nameEnd)].assign(line, valueBegin, valueEnd - valueBegin);
+  }
 }
 
-// A growing in-memory file, concurrently writeable and readable.
-// Read operations that go beyond the currently available data will block,
-// until more data becomes available or the end of file is signaled
-// by the producer.
-struct Resource
+HttpRequest parseRequest(IStream* s)
 {
-  Resource() = default;
+  HttpRequest r;
 
-  Resource(Resource const &) = delete;
-  Resource & operator = (Resource const &) = delete;
+  thread_local string line;
 
-  /////////////////////////////////////////////////////////////////////////////
-  // producer side
-  /////////////////////////////////////////////////////////////////////////////
-  void resBegin()
-  {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    m_complete = false;
-    m_data.clear();
-  }
+  readLine(s, line);
 
-  void resAppend(const uint8_t* src, size_t len)
-  {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    auto offset = m_data.size();
-    m_data.resize(offset + len);
-    memcpy(&m_data[offset], src, len);
-    m_dataAvailable.notify_all();
-  }
+  size_t pos = 0;
+  nextWord(line, pos, r.method);
+  nextWord(line, pos, r.url);
+  nextWord(line, pos, r.version);
 
-  void resEnd()
-  {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    m_complete = true;
-    m_dataAvailable.notify_all();
-  }
+  parseHeaders(s, r.headers);
 
-  /////////////////////////////////////////////////////////////////////////////
-  // consumer side
-  /////////////////////////////////////////////////////////////////////////////
+  return r;
+}
 
-  // pushes the whole resource data to 'sendingFunc', possibly in chunks,
-  // and possibly blocking until the resource is completely uploaded.
-  void sendWhole(std::function<void(const uint8_t* dst, size_t len)> sendingFunc)
-  {
-    size_t sentBytes = 0;
+std::mutex g_mutex;
+std::map<std::string, std::shared_ptr<Resource>> resources;
 
-    while(1)
-    {
-      std::vector<uint8_t> toSend;
+// Where the time of a request went, in microseconds (see --request-timing).
+struct RequestTiming
+{
+  int64_t start = 0; // from monotonicMicros()
+  int64_t first_byte_us = 0; // first request of a connection: from the connection start to its first byte
+  int64_t headers_us = 0; // from the first byte to the parsed headers
+  int64_t lookup_us = 0; // finding the resource, including long polling and upstream pulls
+  int64_t store_lock_us = 0; // waiting for g_mutex
+  int64_t data_wait_us = 0; // in Resource::sendWhole() between the writes: waiting for the producer to append data, copying it
+  int64_t egress_wait_us = 0; // waiting for the egress scheduler
+  int64_t send_us = 0; // blocked writing to the client
+};
 
-      {
-        std::unique_lock<std::mutex> lock(m_mutex);
+static bool g_requestTiming;
 
-        while(sentBytes == m_data.size() && !m_complete)
-          m_dataAvailable.wait(lock);
+// The timing of the request being served by this thread, if enabled.
+static thread_local RequestTiming* t_timing;
 
-        if(m_complete && sentBytes == m_data.size())
-          break;
+// Adds the time spent in its scope to a field of the current request timing.
+struct PhaseTimer
+{
+  explicit PhaseTimer(int64_t RequestTiming::* field) : m_field(t_timing ? field : nullptr), m_start(m_field ? monotonicMicros() : 0) {}
 
-        toSend.assign(m_data.data() + sentBytes, m_data.data() + m_data.size());
-      }
+  ~PhaseTimer()
+  {
+    if(m_field)
+      t_timing->*m_field += monotonicMicros() - m_start;
+  }
 
-      sendingFunc((const uint8_t*)toSend.data(), (int)toSend.size());
-      sentBytes += toSend.size();
-    }
+  int64_t RequestTiming::* const m_field;
+  const int64_t m_start;
+};
+
+// Locks the resource store. Contention is probed and timed.
+static std::unique_lock<std::mutex> lockStore()
+{
+  std::unique_lock<std::mutex> lock(g_mutex, std::try_to_lock);
+
+  if(!lock.owns_lock())
+  {
+    PROBE(store_lock_wait);
+    PhaseTimer timer(&RequestTiming::store_lock_us);
+    lock.lock();
+    PROBE(store_lock_acquired);
   }
 
-private:
-  std::string m_data;
-  std::mutex m_mutex;
-  std::condition_variable m_dataAvailable;
-  bool m_complete = false;
+  return lock;
+}
+
+// A GET waiting for its resource to be created (long polling).
+struct LongPollWaiter
+{
+  std::condition_variable changed; // the resource was created, or the wait expired
+  bool expired = false;
 };
 
-std::mutex g_mutex;
-std::map<std::string, std::shared_ptr<Resource>> resources;
+// Guarded by g_mutex.
+static std::multimap<std::string, LongPollWaiter*> g_longPollWaiters;
+
+// the spilled copy of a resource goes away with it
+static void forgetResource(string const& url)
+{
+#ifdef __linux__
+  forgetSpilled(url);
+#else
+  (void)url;
+#endif
+}
+
+// during an upgrade, the successor must forget it too
+static void forwardDeletion(string const& url)
+{
+#ifdef __linux__
+  handOverDeletion(url);
+#else
+  (void)url;
+#endif
+}
 
 std::shared_ptr<Resource> getResource(string url)
 {
-  std::unique_lock<std::mutex> lock(g_mutex);
+  auto lock = lockStore();
   auto i_res = resources.find(url);
 
   if(i_res == resources.end())
@@ -201,33 +264,52 @@ bool deleteResource(string url)
 
   if(wildcardPos == string::npos)
   {
-    std::unique_lock<std::mutex> lock(g_mutex);
-    auto i_res = resources.find(url);
+    {
+      auto lock = lockStore();
+      auto i_res = resources.find(url);
 
-    if(i_res == resources.end())
-      return false;
+      if(i_res == resources.end())
+        return false;
 
-    resources.erase(i_res);
+      resources.erase(i_res);
+    }
+
+    forgetResource(url);
+    forwardDeletion(url);
+    publishResourceEvent(ResourceEvent::Deleted, url);
     return true;
   }
   else
   {
     DbgTrace("Found wildcard '*' in '%s'\n", url.c_str());
-    std::unique_lock<std::mutex> lock(g_mutex);
-
+    vector<string> deleted;
     bool res = false;
 
-    auto r = resources.begin();
-
-    while (r != resources.end())
     {
-      auto start = r->first.find(url.substr(0, wildcardPos));
-      auto end = r->first.find(url.substr(wildcardPos + 1));
+      auto lock = lockStore();
 
-      if(start != string::npos && end != string::npos)
-        r = resources.erase(r);
-      else
-        r++;
+      auto r = resources.begin();
+
+      while (r != resources.end())
+      {
+        auto start = r->first.find(url.substr(0, wildcardPos));
+        auto end = r->first.find(url.substr(wildcardPos + 1));
+
+        if(start != string::npos && end != string::npos)
+        {
+          deleted.push_back(r->first);
+          r = resources.erase(r);
+        }
+        else
+          r++;
+      }
+    }
+
+    for(auto& deletedUrl : deleted)
+    {
+      forgetResource(deletedUrl);
+      forwardDeletion(deletedUrl);
+      publishResourceEvent(ResourceEvent::Deleted, deletedUrl);
     }
 
     return res;
@@ -236,9 +318,45 @@ bool deleteResource(string url)
 
 std::shared_ptr<Resource> createResource(string url)
 {
-  std::unique_lock<std::mutex> lock(g_mutex);
-  resources[url] = make_shared<Resource>();
-  return resources[url];
+  auto res = make_shared<Resource>(url);
+  res->setOnComplete([url] () { publishResourceEvent(ResourceEvent::Completed, url); });
+
+  {
+    auto lock = lockStore();
+    resources[url] = res;
+
+    auto const waiters = g_longPollWaiters.equal_range(url);
+
+    for(auto i = waiters.first; i != waiters.second; ++i)
+      i->second->changed.notify_one();
+  }
+
+  forgetResource(url);
+  publishResourceEvent(ResourceEvent::Created, url);
+  return res;
+}
+
+void discardResource(string const& url, std::shared_ptr<Resource> const& res)
+{
+  {
+    auto lock = lockStore();
+    auto i_res = resources.find(url);
+
+    if(i_res == resources.end() || i_res->second != res)
+      return;
+
+    resources.erase(i_res);
+  }
+
+  forgetResource(url);
+  forwardDeletion(url);
+  publishResourceEvent(ResourceEvent::Deleted, url);
+}
+
+vector<pair<string, std::shared_ptr<Resource>>> listResources()
+{
+  auto lock = lockStore();
+  return vector<pair<string, std::shared_ptr<Resource>>>(resources.begin(), resources.end());
 }
 
 struct Config
@@ -248,54 +366,202 @@ struct Config
   int port = 9000;
   bool tls = false;
   int long_poll_timeout_ms = 2000;
+  bool io_uring = false;
+  string local_ingest_path;
+  string upstream;
+  int upstream_ttl_ms = 0;
+  int upstream_timeout_ms = 10000;
+  vector<string> push_to;
+  int trace_sample = 0;
+  int latency_report_s = 0;
+  string spill_dir;
+  int spill_after_ms = 10000;
+  string upgrade_socket;
+  SocketProfile ingest_socket;
+  SocketProfile egress_socket;
+  int header_timeout_ms = 10000;
+  int idle_timeout_ms = 60000;
+  int write_timeout_ms = 30000;
+  int tls_handshake_concurrency = std::max(1, (int)std::thread::hardware_concurrency() / 2);
+  bool request_timing = false;
+  uint64_t egress_rate = 0;
+  uint64_t egress_class_rates[(int)EgressClass::Count] = {};
 };
 
-void httpClientThread_GET(HttpRequest req, IStream* s)
+// The resource to serve to a GET, pulled from the upstream relay if any.
+// Waits at most 'long_poll_timeout_ms' for it to appear.
+static std::shared_ptr<Resource> findResource(string const& url, int long_poll_timeout_ms)
 {
-  DbgTrace("event=request_received method=GET url=%s version=%s\n", req.url.c_str(), req.version.c_str());
-  auto res = getResource(req.url);
-
-  // Long polling
-  if (s->long_poll_timeout_ms && !res)
-  {
-    const int interval_ms = 100;
-    int waited = 0;
-    while (waited < s->long_poll_timeout_ms) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
-      waited += interval_ms;
-      res = getResource(req.url);
-      if (res) {
-        DbgTrace("event=resource_appeared url=%s waited_ms=%d\n", req.url.c_str(), waited);
-        break;
+  PhaseTimer timer(&RequestTiming::lookup_us);
+  auto res = getResource(url);
+
+  if(hasUpstream())
+    res = pullFromUpstream(url, res);
+
+  // Long polling: woken up by createResource(), or by the timer
+  if (long_poll_timeout_ms && !res)
+  {
+    PROBE1(long_poll_begin, url.c_str());
+    auto const start = std::chrono::steady_clock::now();
+    LongPollWaiter waiter;
+
+    // armed outside of g_mutex, which the expiry takes
+    Timer timeout;
+    timeout.arm(long_poll_timeout_ms, [&waiter] ()
+      {
+        std::unique_lock<std::mutex> lock(g_mutex);
+        waiter.expired = true;
+        waiter.changed.notify_one();
+      });
+
+    {
+      auto lock = lockStore();
+      auto const i_waiter = g_longPollWaiters.emplace(url, &waiter);
+
+      while(!waiter.expired)
+      {
+        auto const i_res = resources.find(url);
+
+        if(i_res != resources.end())
+        {
+          res = i_res->second;
+          break;
+        }
+
+        waiter.changed.wait(lock);
       }
+
+      g_longPollWaiters.erase(i_waiter);
+    }
+
+    timeout.cancel();
+    PROBE2(long_poll_end, url.c_str(), res != nullptr);
+
+    if (res) {
+      auto const waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+      DbgTrace("event=resource_appeared url=%s waited_ms=%d\n", url.c_str(), (int)waited.count());
+    }
+  }
+
+  return res;
+}
+
+// The class of a GET for the egress scheduler, once its resource is known.
+static EgressClass egressClass(string const& url, Resource& res)
+{
+  if(isCompressible(url))
+    return EgressClass::Manifest;
+
+  return res.completedAt() ? EgressClass::Historical : EgressClass::LiveEdge;
+}
+
+// Passes 'data' to 'write' in the pieces granted by the egress scheduler.
+static void writeScheduled(EgressClass c, const uint8_t* data, size_t len, std::function<void(const uint8_t* data, size_t len)> const& write)
+{
+  if(!isEgressScheduled())
+  {
+    PhaseTimer timer(&RequestTiming::send_us);
+    write(data, len);
+    return;
+  }
+
+  while(len > 0)
+  {
+    auto const size = std::min(len, MaxEgressGrant);
+
+    {
+      PhaseTimer timer(&RequestTiming::egress_wait_us);
+      acquireEgress(c, size);
+    }
+
+    {
+      PhaseTimer timer(&RequestTiming::send_us);
+      write(data, size);
     }
+
+    data += size;
+    len -= size;
+  }
+}
+
+// Resource::sendWhole(), timing the waits for the producer between the
+// chunks.
+static void sendWholeTimed(Resource& res, std::function<void(const uint8_t* buf, size_t len)> onSend, int64_t arrival)
+{
+  if(!t_timing)
+  {
+    res.sendWhole(onSend, arrival);
+    return;
   }
 
+  auto resumed = monotonicMicros();
+
+  auto timedSend = [&] (const uint8_t* buf, size_t len)
+    {
+      t_timing->data_wait_us += monotonicMicros() - resumed;
+      onSend(buf, len);
+      resumed = monotonicMicros();
+    };
+
+  res.sendWhole(timedSend, arrival);
+  t_timing->data_wait_us += monotonicMicros() - resumed;
+}
+
+void httpClientThread_GET(HttpRequest req, IStream* s)
+{
+  auto const arrival = monotonicMicros();
+  DbgTrace("event=request_received method=GET url=%s version=%s\n", req.url.c_str(), req.version.c_str());
+  auto res = findResource(req.url, s->long_poll_timeout_ms);
+
   if (!res)
   {
     DbgTrace("event=error_reply method=GET url=%s status=404 reason=not_found\n", req.url.c_str());
     writeLine(s, "HTTP/1.1 404 Not Found");
+    writeLine(s, "Content-Length: 0");
+    writeLine(s, "");
+    return;
+  }
+
+  auto const priority = egressClass(req.url, *res);
+  auto const gzipped = acceptsEncoding(req.headers["Accept-Encoding"], "gzip") ? res->gzipped() : nullptr;
+  auto const write = [s] (const uint8_t* data, size_t len) { s->write(data, len); };
+
+  if(gzipped)
+  {
+    DbgTrace("event=resource_served url=%s encoding=gzip size=%zu\n", req.url.c_str(), gzipped->size());
+    char lengthLine[64];
+    snprintf(lengthLine, sizeof lengthLine, "Content-Length: %zu", gzipped->size());
+    writeLine(s, "HTTP/1.1 200 OK");
+    writeLine(s, "Content-Encoding: gzip");
+    writeLine(s, "Vary: Accept-Encoding");
+    writeLine(s, lengthLine);
     writeLine(s, "");
+    writeScheduled(priority, gzipped->data(), gzipped->size(), write);
+    DbgTrace("event=request_completed method=GET url=%s status=200\n", req.url.c_str());
     return;
   }
 
   DbgTrace("event=resource_served url=%s\n", req.url.c_str());
   writeLine(s, "HTTP/1.1 200 OK");
+
+  if(isCompressible(req.url))
+    writeLine(s, "Vary: Accept-Encoding");
+
   writeLine(s, "Transfer-Encoding: chunked");
   writeLine(s, "");
 
-  auto onSend = [s, req](const uint8_t* buf, int len)
+  auto onSend = [s, req, priority, &write](const uint8_t* buf, int len)
   {
     char sizeLine[256];
     snprintf(sizeLine, sizeof sizeLine, "%X", len);
     writeLine(s, sizeLine);
 
-    s->write(buf, len);
+    writeScheduled(priority, buf, len, write);
     writeLine(s, "");
     DbgTrace("event=chunk_sent url=%s chunk_size=%d\n", req.url.c_str(), len);
   };
 
-  res->sendWhole(onSend);
+  sendWholeTimed(*res, onSend, arrival);
 
   // last chunk
   writeLine(s, "0");
@@ -309,27 +575,30 @@ void httpClientThread_DELETE(HttpRequest req, IStream* s)
 
   auto const res = deleteResource(req.url);
 
+  // not if it was itself replicated (see replication.h)
+  if(!req.headers.count("X-Replicated"))
+    replicateDelete(req.url);
+
   if(!res)
   {
     DbgTrace("event=error_reply method=DELETE url=%s status=404 reason=not_found\n", req.url.c_str());
     writeLine(s, "HTTP/1.1 404 Not Found");
+    writeLine(s, "Content-Length: 0");
     writeLine(s, "");
     return;
   }
 
   DbgTrace("event=resource_deleted url=%s\n", req.url.c_str());
   writeLine(s, "HTTP/1.1 200 OK");
+  writeLine(s, "Content-Length: 0");
   writeLine(s, "");
   DbgTrace("event=request_completed method=DELETE url=%s status=200\n", req.url.c_str());
 }
 
-void httpClientThread_PUT(HttpRequest req, IStream* s)
+// Receives the body of a PUT, passing the data to 'append' as it arrives.
+// Returns false if the body was cut short (e.g. the client went away).
+static bool receiveBody(HttpRequest& req, IStream* s, std::function<void(const uint8_t* data, size_t len)> append)
 {
-  DbgTrace("event=request_received method=PUT url=%s\n", req.url.c_str());
-  auto const res = createResource(req.url);
-
-  res->resBegin();
-
   bool needsContinue = false;
 
   if(req.headers["Transfer-Encoding"] == "chunked")
@@ -344,47 +613,92 @@ void httpClientThread_PUT(HttpRequest req, IStream* s)
     writeLine(s, "");
   }
 
+  // one receive buffer for the whole upload, recycled through the pool
+  PooledBuffer buffer;
+
   if(req.headers["Transfer-Encoding"] == "chunked")
   {
+    string sizeLine;
+
     while(1)
     {
-      auto sizeLine = readLine(s);
-
-      if(sizeLine.empty())
-        break;
+      readLine(s, sizeLine);
 
       int size = 0;
       int ret = sscanf(sizeLine.c_str(), "%x", &size);
 
       if(ret != 1)
-        break;
+        return false;
 
       if(size > 0)
       {
-        std::vector<uint8_t> buffer(size);
-        s->read(buffer.data(), buffer.size());
+        buffer.resize(size);
+
+        if(s->read(buffer.data(), buffer.size()) != buffer.size())
+          return false;
+
         DbgTrace("event=resource_chunk_received url=%s chunk_size=%d\n", req.url.c_str(), size);
-        res->resAppend(buffer.data(), buffer.size());
+        append(buffer.data(), buffer.size());
       }
 
       uint8_t eol[2];
       s->read(eol, sizeof eol);
 
       if(size == 0)
-        break;
+        return true;
     }
   }
-  else
+
+  auto size = atoi(req.headers["Content-Length"].c_str());
+
+  if(size > 0)
   {
-    auto size = atoi(req.headers["Content-Length"].c_str());
+    buffer.resize(size);
+
+    if(s->read(buffer.data(), buffer.size()) != buffer.size())
+      return false;
+
+    DbgTrace("event=resource_chunk_received url=%s chunk_size=%d\n", req.url.c_str(), size);
+    append(buffer.data(), buffer.size());
+  }
+
+  return true;
+}
+
+void httpClientThread_PUT(HttpRequest req, IStream* s)
+{
+  DbgTrace("event=request_received method=PUT url=%s\n", req.url.c_str());
+  auto const res = createResource(req.url);
+
+  // not if it was itself replicated (see replication.h)
+  if(!req.headers.count("X-Replicated"))
+    replicateUploads(req.url, *res);
 
-    if(size > 0)
+  res->resBegin();
+
+  auto append = [&] (const uint8_t* data, size_t len)
     {
-      std::vector<uint8_t> buffer(size);
-      s->read(buffer.data(), buffer.size());
-      DbgTrace("event=resource_chunk_received url=%s chunk_size=%d\n", req.url.c_str(), size);
-      res->resAppend(buffer.data(), buffer.size());
-    }
+      res->resAppend(data, len);
+    };
+
+  bool complete = false;
+
+  try
+  {
+    complete = receiveBody(req, s, append);
+  }
+  catch(std::exception const&)
+  {
+  }
+
+  if(!complete)
+  {
+    // e.g. a peer relay gave up replicating this upload: don't serve (or
+    // replicate further) a truncated copy.
+    DbgTrace("event=upload_truncated url=%s\n", req.url.c_str());
+    res->resAbort(); // also wakes up the readers
+    discardResource(req.url, res);
+    throw runtime_error("incomplete request body");
   }
 
   res->resEnd();
@@ -404,66 +718,663 @@ void httpClientThread_NotImplemented(IStream* s, const std::string& method)
   writeLine(s, "");
 }
 
-void httpMain(IStream* s)
+// Whether the connection can carry another request after 'req'.
+static bool keepAlive(HttpRequest& req)
 {
-  auto req = parseRequest(s);
-
-  if(0)
-  {
-    DbgTrace("[Request] '%s' '%s' '%s'\n", req.method.c_str(), req.url.c_str(), req.version.c_str());
+  auto const& connection = req.headers["Connection"];
 
-    for(auto& hdr : req.headers)
-      DbgTrace("[Header] '%s' '%s'\n", hdr.first.c_str(), hdr.second.c_str());
-  }
+  if(req.version == "HTTP/1.1")
+    return connection != "close";
 
-  if(req.method == "GET")
-    httpClientThread_GET(req, s);
-  else if(req.method == "DELETE")
-    httpClientThread_DELETE(req, s);
-  else if(req.method == "PUT" || req.method == "POST")
-    httpClientThread_PUT(req, s);
-  else
-  {
-    httpClientThread_NotImplemented(s, req.method);
-  }
+  return connection == "keep-alive";
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// main.cpp
+// How long an upgraded relay waits for its requests in flight to complete.
+static const int MaxDrainTime_ms = 60 * 1000;
 
-extern void tlsMain(IStream* tcpStream);
+// Set once the listening socket has been handed over to a new relay:
+// the requests in flight are completed, then the process exits.
+static std::atomic<bool> g_draining;
+static std::atomic<int> g_requestsInFlight;
 
+// Socket options for the uploads (PUT, POST), and for the readers (GET).
+static SocketProfile g_ingestProfile;
+static SocketProfile g_egressProfile;
 
-Config parseCommandLine(int argc, char const* argv[])
-{
-  Config cfg {};
+// Deadlines of the connections (0: none). A client that doesn't send its
+// request in time, or doesn't read the response, is disconnected: it can't
+// hold a thread forever.
+int g_headerTimeout_ms; // the TLS handshake, then the first request headers
+static int g_idleTimeout_ms; // between the requests of a persistent connection, and in a request body
+static int g_writeTimeout_ms; // each write
 
-  auto pop = [&] () -> string
-    {
-      if(argc <= 0)
-        throw runtime_error("unexpected end of command line");
+// How many TLS handshakes can run at once (see tls.cpp).
+int g_tlsHandshakeConcurrency;
 
-      string word = argv[0];
-      argc--;
-      argv++;
+struct InFlight
+{
+  InFlight() { g_requestsInFlight++; }
+  ~InFlight() { g_requestsInFlight--; }
+};
 
-      return word;
-    };
+// Probes a request, from its parsed headers until it's served, and logs its
+// timing if enabled.
+struct RequestScope
+{
+  RequestScope(HttpRequest const& req_, RequestTiming const& timing_) : req(req_), timing(timing_)
+  {
+    PROBE2(request_start, req.method.c_str(), req.url.c_str());
 
-  pop();
+    if(g_requestTiming)
+      t_timing = &timing;
+  }
 
-  while(argc > 0)
+  ~RequestScope()
   {
-    auto word = pop();
+    auto const total_us = monotonicMicros() - timing.start;
+    PROBE3(request_done, req.method.c_str(), req.url.c_str(), total_us);
 
-    if(word == "--help")
-      cfg.usage_only = true;
-    else if(word == "--port")
-      cfg.port = atoi(pop().c_str());
-    else if(word == "--tls")
+    if(!t_timing)
+      return;
+
+    t_timing = nullptr;
+    DbgTrace("event=request_timing method=%s url=%s total_us=%lld first_byte_us=%lld headers_us=%lld lookup_us=%lld store_lock_us=%lld data_wait_us=%lld egress_wait_us=%lld send_us=%lld\n",
+             req.method.c_str(), req.url.c_str(), (long long)total_us, (long long)timing.first_byte_us, (long long)timing.headers_us,
+             (long long)timing.lookup_us, (long long)timing.store_lock_us, (long long)timing.data_wait_us,
+             (long long)timing.egress_wait_us, (long long)timing.send_us);
+  }
+
+  HttpRequest const& req;
+  RequestTiming timing;
+};
+
+// Aborts a stream when an operation on it (a write, a read) doesn't complete
+// within 'timeout_ms'.
+// An operation only stamps its start: the timer is armed once, and on
+// expiry, re-arms itself for the remaining time while an operation is
+// pending. The timer wheel isn't touched on each write.
+struct ProgressDeadline
+{
+  ProgressDeadline(IStream* s_, int timeout_ms_, const char* phase_) : s(s_), timeout_ms(timeout_ms_), phase(phase_) {}
+
+  // Marks an operation as pending, for its lifetime.
+  struct Pending
+  {
+    Pending(ProgressDeadline& d_) : d(d_) { d.begin(); }
+    ~Pending() { d.m_pending = false; }
+
+    ProgressDeadline& d;
+  };
+
+private:
+  void begin()
+  {
+    m_start = monotonicMicros();
+    m_pending = true;
+
+    if(!m_armed.exchange(true))
+      arm(timeout_ms);
+  }
+
+  void arm(int delay_ms)
+  {
+    m_timer.arm(delay_ms, [this] () { onExpiry(); });
+  }
+
+  void onExpiry()
+  {
+    // cleared first: a concurrent 'begin' either re-arms, or is seen pending
+    m_armed = false;
+
+    if(!m_pending)
+      return;
+
+    auto const elapsed_ms = (monotonicMicros() - m_start) / 1000;
+
+    if(elapsed_ms >= timeout_ms)
+    {
+      DbgTrace("event=connection_timeout phase=%s\n", phase);
+      s->abort();
+      return;
+    }
+
+    if(!m_armed.exchange(true))
+      arm(timeout_ms - elapsed_ms);
+  }
+
+  IStream* const s;
+  const int timeout_ms;
+  const char* const phase;
+
+  std::atomic<int64_t> m_start { 0 }; // from monotonicMicros()
+  std::atomic<bool> m_pending { false };
+  std::atomic<bool> m_armed { false };
+  Timer m_timer; // last: destroyed first, waits for a running expiry
+};
+
+// Aborts the stream when a write stays blocked for too long, e.g. because
+// the client stopped reading.
+struct WriteDeadlineStream : IStream
+{
+  WriteDeadlineStream(IStream* s_) : IStream(s_->long_poll_timeout_ms), s(s_), deadline(s_, g_writeTimeout_ms, "write") {}
+
+  void write(const uint8_t* data, size_t len) override
+  {
+    ProgressDeadline::Pending pending(deadline);
+    s->write(data, len);
+  }
+
+  size_t read(uint8_t* data, size_t len) override { return s->read(data, len); }
+  void abort() override { s->abort(); }
+  void applyProfile(SocketProfile const& profile) override { s->applyProfile(profile); }
+  bool waitReadable(int timeout_ms) override { return s->waitReadable(timeout_ms); }
+  void wakeUp() override { s->wakeUp(); }
+
+  IStream* const s;
+  ProgressDeadline deadline;
+};
+
+static const size_t BodySliceSize = 64 * 1024;
+
+// Aborts the stream when a request body stops arriving.
+// Reads block until complete: the big ones (e.g. a whole Content-Length
+// body) are split in slices, each of which must arrive within the idle
+// timeout. A slow but steady upload isn't cut.
+struct BodyDeadlineStream : IStream
+{
+  BodyDeadlineStream(IStream* s_) : IStream(s_->long_poll_timeout_ms), s(s_), deadline(s_, g_idleTimeout_ms, "body") {}
+
+  size_t read(uint8_t* data, size_t len) override
+  {
+    size_t done = 0;
+
+    while(done < len)
+    {
+      ProgressDeadline::Pending pending(deadline);
+      auto const n = s->read(data + done, std::min(len - done, BodySliceSize));
+
+      if(n == 0)
+        break;
+
+      done += n;
+    }
+
+    return done;
+  }
+
+  void write(const uint8_t* data, size_t len) override { s->write(data, len); }
+  void abort() override { s->abort(); }
+  void applyProfile(SocketProfile const& profile) override { s->applyProfile(profile); }
+  bool waitReadable(int timeout_ms) override { return s->waitReadable(timeout_ms); }
+  void wakeUp() override { s->wakeUp(); }
+
+  IStream* const s;
+  ProgressDeadline deadline;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Resource change notifications, as server-sent events (see subscriptions.h)
+
+// An idle event stream gets a comment this often, so that the players that
+// went away are noticed (the write fails).
+static const int EventStreamHeartbeat_ms = 15 * 1000;
+
+static bool wantsEventStream(string const& accept)
+{
+  return accept.find("text/event-stream") != string::npos;
+}
+
+// Sends the changes under the prefix 'url' (without its trailing '*', if
+// any) to 'send', one "event: <created|completed|deleted>" per resource URL.
+// Returns when the relay drains, when the subscriber falls too far behind,
+// or throws when the client goes away.
+static void streamResourceEvents(string const& url, std::function<void(string const& message)> send)
+{
+  auto prefix = url;
+
+  if(!prefix.empty() && prefix.back() == '*')
+    prefix.pop_back();
+
+  Subscription subscription(prefix);
+  DbgTrace("event=subscription_started prefix=%s\n", prefix.c_str());
+
+  vector<ResourceChange> changes;
+  string message;
+
+  while(!g_draining)
+  {
+    changes.clear();
+    auto const complete = subscription.wait(EventStreamHeartbeat_ms, changes);
+
+    message.clear();
+
+    for(auto& change : changes)
+    {
+      message += "event: ";
+      message += eventName(change.event);
+      message += "\ndata: ";
+      message += change.url;
+      message += "\n\n";
+    }
+
+    send(message.empty() ? ":\n\n" : message);
+
+    if(!complete)
+    {
+      DbgTrace("event=subscription_overflow prefix=%s\n", prefix.c_str());
+      break;
+    }
+  }
+
+  DbgTrace("event=subscription_ended prefix=%s\n", prefix.c_str());
+}
+
+void httpClientThread_Subscribe(HttpRequest req, IStream* s)
+{
+  DbgTrace("event=request_received method=GET url=%s version=%s accept=text/event-stream\n", req.url.c_str(), req.version.c_str());
+  writeLine(s, "HTTP/1.1 200 OK");
+  writeLine(s, "Content-Type: text/event-stream");
+  writeLine(s, "Cache-Control: no-cache");
+  writeLine(s, "Transfer-Encoding: chunked");
+  writeLine(s, "");
+
+  auto send = [s] (string const& message)
+    {
+      char sizeLine[32];
+      snprintf(sizeLine, sizeof sizeLine, "%zX", message.size());
+      writeLine(s, sizeLine);
+      s->write((const uint8_t*)message.data(), message.size());
+      writeLine(s, "");
+    };
+
+  streamResourceEvents(req.url, send);
+
+  // last chunk
+  writeLine(s, "0");
+  writeLine(s, "");
+  DbgTrace("event=request_completed method=GET url=%s status=200\n", req.url.c_str());
+}
+
+void httpMain(IStream* s)
+{
+  const SocketProfile* applied = nullptr;
+  bool first = true;
+  Timer deadline;
+  auto const connectionStart = monotonicMicros();
+
+  // persistent connections: serve requests until the client closes
+  while(1)
+  {
+    auto const timeout_ms = first ? g_headerTimeout_ms : g_idleTimeout_ms;
+    auto const phase = first ? "headers" : "idle";
+
+    if(timeout_ms)
+    {
+      auto onExpiry = [s, phase] ()
+        {
+          DbgTrace("event=connection_timeout phase=%s\n", phase);
+          s->abort();
+        };
+
+      deadline.arm(timeout_ms, onExpiry);
+    }
+
+    RequestTiming timing;
+
+    // the headers are timed from their first byte
+    if(g_requestTiming)
+    {
+      s->waitReadable(-1);
+      timing.first_byte_us = first ? monotonicMicros() - connectionStart : 0;
+    }
+
+    timing.start = monotonicMicros();
+    auto req = parseRequest(s);
+    timing.headers_us = monotonicMicros() - timing.start;
+
+    // expired: the request is incomplete
+    if(timeout_ms && !deadline.cancel())
+      break;
+
+    first = false;
+
+    if(req.method.empty())
+      break; // connection closed
+
+    InFlight inFlight;
+    RequestScope scope(req, timing);
+
+    if(0)
+    {
+      DbgTrace("[Request] '%s' '%s' '%s'\n", req.method.c_str(), req.url.c_str(), req.version.c_str());
+
+      for(auto& hdr : req.headers)
+        DbgTrace("[Header] '%s' '%s'\n", hdr.first.c_str(), hdr.second.c_str());
+    }
+
+    auto const profile = req.method == "GET" ? &g_egressProfile : &g_ingestProfile;
+
+    if(profile != applied && !profile->isDefault())
+    {
+      s->applyProfile(*profile);
+      applied = profile;
+    }
+
+    if(req.method == "GET" && wantsEventStream(req.headers["Accept"]))
+      httpClientThread_Subscribe(req, s);
+    else if(req.method == "GET")
+      httpClientThread_GET(req, s);
+    else if(req.method == "DELETE")
+      httpClientThread_DELETE(req, s);
+    else if(req.method == "PUT" || req.method == "POST")
+    {
+      if(g_idleTimeout_ms)
+      {
+        BodyDeadlineStream body(s);
+        httpClientThread_PUT(req, &body);
+      }
+      else
+        httpClientThread_PUT(req, s);
+    }
+    else
+    {
+      // the request body (if any) wasn't read: the connection can't be reused
+      httpClientThread_NotImplemented(s, req.method);
+      break;
+    }
+
+    if(!keepAlive(req) || g_draining)
+      break;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HTTP/2: each request is served on a thread of its own (see http2.h)
+
+static void http2Stream_GET(HttpRequest& req, Http2Stream* stream, int long_poll_timeout_ms)
+{
+  auto const arrival = monotonicMicros();
+  DbgTrace("event=request_received method=GET url=%s version=%s\n", req.url.c_str(), req.version.c_str());
+  auto res = findResource(req.url, long_poll_timeout_ms);
+
+  if(!res)
+  {
+    DbgTrace("event=error_reply method=GET url=%s status=404 reason=not_found\n", req.url.c_str());
+    stream->writeHeaders(404, {}, true);
+    return;
+  }
+
+  auto const priority = egressClass(req.url, *res);
+  auto const gzipped = acceptsEncoding(req.headers["accept-encoding"], "gzip") ? res->gzipped() : nullptr;
+  auto const write = [stream] (const uint8_t* data, size_t len) { stream->writeData(data, len); };
+
+  if(gzipped)
+  {
+    DbgTrace("event=resource_served url=%s encoding=gzip size=%zu\n", req.url.c_str(), gzipped->size());
+    stream->writeHeaders(200, { { "content-encoding", "gzip" }, { "vary", "accept-encoding" }, { "content-length", to_string(gzipped->size()) } }, false);
+    writeScheduled(priority, gzipped->data(), gzipped->size(), write);
+    stream->end();
+    DbgTrace("event=request_completed method=GET url=%s status=200\n", req.url.c_str());
+    return;
+  }
+
+  DbgTrace("event=resource_served url=%s\n", req.url.c_str());
+
+  HeaderList headers;
+
+  if(isCompressible(req.url))
+    headers.push_back({ "vary", "accept-encoding" });
+
+  stream->writeHeaders(200, headers, false);
+
+  auto onSend = [&req, priority, &write] (const uint8_t* buf, size_t len)
+    {
+      writeScheduled(priority, buf, len, write);
+      DbgTrace("event=chunk_sent url=%s chunk_size=%zu\n", req.url.c_str(), len);
+    };
+
+  sendWholeTimed(*res, onSend, arrival);
+  stream->end();
+  DbgTrace("event=request_completed method=GET url=%s status=200\n", req.url.c_str());
+}
+
+static void http2Stream_Subscribe(HttpRequest& req, Http2Stream* stream)
+{
+  DbgTrace("event=request_received method=GET url=%s version=%s accept=text/event-stream\n", req.url.c_str(), req.version.c_str());
+  stream->writeHeaders(200, { { "content-type", "text/event-stream" }, { "cache-control", "no-cache" } }, false);
+
+  auto send = [stream] (string const& message)
+    {
+      stream->writeData((const uint8_t*)message.data(), message.size());
+    };
+
+  streamResourceEvents(req.url, send);
+  stream->end();
+  DbgTrace("event=request_completed method=GET url=%s status=200\n", req.url.c_str());
+}
+
+static void http2Stream_PUT(HttpRequest& req, Http2Stream* stream)
+{
+  DbgTrace("event=request_received method=%s url=%s version=%s\n", req.method.c_str(), req.url.c_str(), req.version.c_str());
+  auto const res = createResource(req.url);
+
+  // not if it was itself replicated (see replication.h)
+  if(!req.headers.count("x-replicated"))
+    replicateUploads(req.url, *res);
+
+  res->resBegin();
+
+  // one receive buffer for the whole upload, recycled through the pool
+  PooledBuffer buffer;
+  buffer.resize(64 * 1024);
+
+  bool complete = false;
+
+  while(auto const size = stream->readBody(buffer.data(), buffer.size(), complete))
+  {
+    DbgTrace("event=resource_chunk_received url=%s chunk_size=%zu\n", req.url.c_str(), size);
+    res->resAppend(buffer.data(), size);
+  }
+
+  if(!complete)
+  {
+    // reset, timed out, or the connection closed: don't serve (or
+    // replicate further) a truncated copy.
+    DbgTrace("event=upload_truncated url=%s\n", req.url.c_str());
+    res->resAbort(); // also wakes up the readers
+    discardResource(req.url, res);
+    throw runtime_error("incomplete request body");
+  }
+
+  res->resEnd();
+
+  DbgTrace("event=resource_created url=%s\n", req.url.c_str());
+  stream->writeHeaders(200, {}, true);
+  DbgTrace("event=request_completed method=%s url=%s status=200\n", req.method.c_str(), req.url.c_str());
+}
+
+static void http2Stream_DELETE(HttpRequest& req, Http2Stream* stream)
+{
+  DbgTrace("event=request_received method=DELETE url=%s version=%s\n", req.url.c_str(), req.version.c_str());
+
+  auto const res = deleteResource(req.url);
+
+  // not if it was itself replicated (see replication.h)
+  if(!req.headers.count("x-replicated"))
+    replicateDelete(req.url);
+
+  if(!res)
+  {
+    DbgTrace("event=error_reply method=DELETE url=%s status=404 reason=not_found\n", req.url.c_str());
+    stream->writeHeaders(404, {}, true);
+    return;
+  }
+
+  DbgTrace("event=resource_deleted url=%s\n", req.url.c_str());
+  stream->writeHeaders(200, {}, true);
+  DbgTrace("event=request_completed method=DELETE url=%s status=200\n", req.url.c_str());
+}
+
+void http2Main(IStream* s)
+{
+  DbgTrace("event=http2_connection\n");
+  auto const long_poll_timeout_ms = s->long_poll_timeout_ms;
+
+  auto onRequest = [long_poll_timeout_ms] (HttpRequest& req, Http2Stream* stream)
+    {
+      InFlight inFlight;
+
+      // the frames are parsed by the connection thread: only the serving is timed
+      RequestTiming timing;
+      timing.start = monotonicMicros();
+      RequestScope scope(req, timing);
+
+      if(req.method == "GET" && wantsEventStream(req.headers["accept"]))
+        http2Stream_Subscribe(req, stream);
+      else if(req.method == "GET")
+        http2Stream_GET(req, stream, long_poll_timeout_ms);
+      else if(req.method == "DELETE")
+        http2Stream_DELETE(req, stream);
+      else if(req.method == "PUT" || req.method == "POST")
+        http2Stream_PUT(req, stream);
+      else
+      {
+        DbgTrace("event=error_reply method=%s status=500 reason=not_implemented\n", req.method.c_str());
+        stream->writeHeaders(500, {}, true);
+      }
+    };
+
+  serveHttp2(s, onRequest, g_idleTimeout_ms);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// main.cpp
+
+extern void tlsMain(IStream* tcpStream);
+
+// Parses a comma-separated list of socket options, e.g.
+// "nodelay,lowat=16384,sndbuf=262144,rcvbuf=262144,pacing=1250000".
+// "live" is a shorthand for "nodelay,lowat=16384".
+SocketProfile parseSocketProfile(string const& spec)
+{
+  SocketProfile profile {};
+  size_t pos = 0;
+
+  while(pos <= spec.size())
+  {
+    auto end = spec.find(',', pos);
+
+    if(end == string::npos)
+      end = spec.size();
+
+    auto const option = spec.substr(pos, end - pos);
+    pos = end + 1;
+
+    auto const equal = option.find('=');
+    auto const name = option.substr(0, equal);
+    auto const value = equal == string::npos ? 0 : atoll(option.substr(equal + 1).c_str());
+
+    if(name == "nodelay")
+      profile.no_delay = true;
+    else if(name == "live")
+    {
+      profile.no_delay = true;
+      profile.not_sent_lowat = 16 * 1024;
+    }
+    else if(name == "lowat" && value > 0)
+      profile.not_sent_lowat = value;
+    else if(name == "sndbuf" && value > 0)
+      profile.send_buffer = value;
+    else if(name == "rcvbuf" && value > 0)
+      profile.receive_buffer = value;
+    else if(name == "pacing" && value > 0)
+      profile.max_pacing_rate = value;
+    else
+      throw runtime_error("Invalid socket option '" + option + "'");
+  }
+
+  return profile;
+}
+
+
+Config parseCommandLine(int argc, char const* argv[])
+{
+  Config cfg {};
+
+  auto pop = [&] () -> string
+    {
+      if(argc <= 0)
+        throw runtime_error("unexpected end of command line");
+
+      string word = argv[0];
+      argc--;
+      argv++;
+
+      return word;
+    };
+
+  pop();
+
+  while(argc > 0)
+  {
+    auto word = pop();
+
+    if(word == "--help")
+      cfg.usage_only = true;
+    else if(word == "--port")
+      cfg.port = atoi(pop().c_str());
+    else if(word == "--tls")
       cfg.tls = true;
     else if(word == "--long-poll")
       cfg.long_poll_timeout_ms = atoi(pop().c_str());
+    else if(word == "--io-uring")
+      cfg.io_uring = true;
+    else if(word == "--local-ingest")
+      cfg.local_ingest_path = pop();
+    else if(word == "--upstream")
+      cfg.upstream = pop();
+    else if(word == "--upstream-ttl")
+      cfg.upstream_ttl_ms = atoi(pop().c_str());
+    else if(word == "--upstream-timeout")
+      cfg.upstream_timeout_ms = atoi(pop().c_str());
+    else if(word == "--push-to")
+      cfg.push_to.push_back(pop());
+    else if(word == "--trace-sample")
+      cfg.trace_sample = atoi(pop().c_str());
+    else if(word == "--latency-report")
+      cfg.latency_report_s = atoi(pop().c_str());
+    else if(word == "--spill-dir")
+      cfg.spill_dir = pop();
+    else if(word == "--spill-after")
+      cfg.spill_after_ms = atoi(pop().c_str());
+    else if(word == "--upgrade-socket")
+      cfg.upgrade_socket = pop();
+    else if(word == "--ingest-socket")
+      cfg.ingest_socket = parseSocketProfile(pop());
+    else if(word == "--egress-socket")
+      cfg.egress_socket = parseSocketProfile(pop());
+    else if(word == "--header-timeout")
+      cfg.header_timeout_ms = atoi(pop().c_str());
+    else if(word == "--idle-timeout")
+      cfg.idle_timeout_ms = atoi(pop().c_str());
+    else if(word == "--write-timeout")
+      cfg.write_timeout_ms = atoi(pop().c_str());
+    else if(word == "--tls-handshake-concurrency")
+      cfg.tls_handshake_concurrency = atoi(pop().c_str());
+    else if(word == "--request-timing")
+      cfg.request_timing = true;
+    else if(word == "--egress-rate")
+      cfg.egress_rate = atoll(pop().c_str());
+    else if(word == "--egress-class-rate")
+    {
+      auto const spec = pop();
+      auto const equal = spec.find('=');
+
+      if(equal == string::npos)
+        throw runtime_error("Invalid egress class rate '" + spec + "', expected <class>=<bytes/s>");
+
+      cfg.egress_class_rates[(int)parseEgressClass(spec.substr(0, equal))] = atoll(spec.substr(equal + 1).c_str());
+    }
     else
       throw runtime_error("invalid command line");
   }
@@ -471,9 +1382,45 @@ Config parseCommandLine(int argc, char const* argv[])
   if(cfg.port <= 0 || cfg.port >= 65536)
     throw runtime_error("Invalid TCP port");
 
+#ifndef __linux__
+
+  if(!cfg.local_ingest_path.empty())
+    throw runtime_error("Local ingest is only supported on Linux");
+
+  if(!cfg.spill_dir.empty())
+    throw runtime_error("The spill tier is only supported on Linux");
+
+  if(!cfg.upgrade_socket.empty())
+    throw runtime_error("Zero-downtime upgrades are only supported on Linux");
+#endif
+
   return cfg;
 }
 
+void traceSocketProfile(const char* direction, SocketProfile const& profile)
+{
+  if(profile.isDefault())
+    return;
+
+  DbgTrace("event=socket_profile direction=%s no_delay=%s not_sent_lowat=%d send_buffer=%d receive_buffer=%d max_pacing_rate=%llu\n",
+           direction, profile.no_delay ? "true" : "false", profile.not_sent_lowat, profile.send_buffer, profile.receive_buffer,
+           (unsigned long long)profile.max_pacing_rate);
+}
+
+void splitHostPort(string const& hostPort, string& host, int& port)
+{
+  auto const colon = hostPort.rfind(':');
+
+  if(colon == string::npos)
+    throw runtime_error("Invalid address '" + hostPort + "', expected <host:port>");
+
+  host = hostPort.substr(0, colon);
+  port = atoi(hostPort.substr(colon + 1).c_str());
+
+  if(port <= 0 || port >= 65536)
+    throw runtime_error("Invalid TCP port in '" + hostPort + "'");
+}
+
 int main(int argc, char const* argv[])
 {
   try
@@ -481,13 +1428,123 @@ int main(int argc, char const* argv[])
     auto cfg = parseCommandLine(argc, argv);
 
     if (cfg.usage_only) {
-      printf("Usage: %s [--port <num>] [--tls] [--long-poll <milliseconds:default=2000,disable=0>]\n", argv[0]);
+      printf("Usage: %s [--port <num>] [--tls] [--long-poll <milliseconds:default=2000,disable=0>] [--io-uring] [--local-ingest <unix socket path>] [--upstream <host:port>] [--upstream-ttl <milliseconds:default=0=forever>] [--upstream-timeout <milliseconds:default=10000,disable=0>] [--push-to <host:port>]... [--trace-sample <N:trace one chunk delivery out of N>] [--latency-report <seconds:default=0=at exit only>] [--spill-dir <path>] [--spill-after <milliseconds:default=10000>] [--upgrade-socket <unix socket path>] [--ingest-socket <options>] [--egress-socket <options>] [--header-timeout <milliseconds:default=10000,disable=0>] [--idle-timeout <milliseconds:default=60000,disable=0>] [--write-timeout <milliseconds:default=30000,disable=0>] [--tls-handshake-concurrency <N:default=half the CPUs,unlimited=0>] [--egress-rate <bytes/s>] [--egress-class-rate <manifest|live|historical>=<bytes/s>]... [--request-timing]\n", argv[0]);
       return 0;
     }
 
     DbgTrace("event=server_start port=%d version=%s long_poll=%s long_poll_timeout_ms=%d\n",
              cfg.port, get_version(), cfg.long_poll_timeout_ms ? "true" : "false", cfg.long_poll_timeout_ms);
 
+    TcpServerConfig serverCfg;
+    serverCfg.port = cfg.port;
+    serverCfg.long_poll_timeout_ms = cfg.long_poll_timeout_ms;
+    serverCfg.io_uring = cfg.io_uring;
+
+    g_ingestProfile = cfg.ingest_socket;
+    g_egressProfile = cfg.egress_socket;
+    traceSocketProfile("ingest", g_ingestProfile);
+    traceSocketProfile("egress", g_egressProfile);
+
+    g_headerTimeout_ms = cfg.header_timeout_ms;
+    g_idleTimeout_ms = cfg.idle_timeout_ms;
+    g_writeTimeout_ms = cfg.write_timeout_ms;
+    g_tlsHandshakeConcurrency = cfg.tls_handshake_concurrency;
+    g_requestTiming = cfg.request_timing;
+
+    setEgressRate(cfg.egress_rate);
+
+    for(int i = 0; i < (int)EgressClass::Count; ++i)
+      setEgressClassRate((EgressClass)i, cfg.egress_class_rates[i]);
+
+    if(isEgressScheduled())
+    {
+      DbgTrace("event=egress_scheduler rate=%llu manifest_rate=%llu live_rate=%llu historical_rate=%llu\n",
+               (unsigned long long)cfg.egress_rate,
+               (unsigned long long)cfg.egress_class_rates[(int)EgressClass::Manifest],
+               (unsigned long long)cfg.egress_class_rates[(int)EgressClass::LiveEdge],
+               (unsigned long long)cfg.egress_class_rates[(int)EgressClass::Historical]);
+    }
+
+#ifdef __linux__
+
+    if(!cfg.local_ingest_path.empty())
+      startLocalIngestServer(cfg.local_ingest_path.c_str());
+
+    // puts back a complete resource from a previous run
+    auto restore = [] (const string& url, std::shared_ptr<Resource> res)
+      {
+        std::unique_lock<std::mutex> lock(g_mutex);
+        resources[url] = res;
+      };
+
+    if(!cfg.spill_dir.empty())
+      startSpill(cfg.spill_dir, cfg.spill_after_ms, restore);
+
+    if(!cfg.upgrade_socket.empty())
+    {
+      auto const path = cfg.upgrade_socket;
+
+      // -1 if there's no running relay to take over from
+      serverCfg.listen_fd = takeOver(path.c_str(), restore);
+
+      serverCfg.onListening = [path] (int listenFd)
+        {
+          auto stopAccepting = [] ()
+            {
+              stopTcpServer();
+            };
+
+          // on failure, the successor didn't take the socket: keep serving
+          auto handedOver = [] (bool ok)
+            {
+              if(ok)
+              {
+                g_draining = true;
+                releaseTcpServer();
+              }
+              else
+              {
+                resumeTcpServer();
+              }
+            };
+
+          startUpgradeListener(path.c_str(), listenFd, stopAccepting, handedOver);
+        };
+    }
+#endif
+
+    if(!cfg.upstream.empty())
+    {
+      string host;
+      int port;
+      splitHostPort(cfg.upstream, host, port);
+      setUpstream(host, port, cfg.upstream_ttl_ms, cfg.upstream_timeout_ms);
+    }
+
+    for(auto& peer : cfg.push_to)
+    {
+      string host;
+      int port;
+      splitHostPort(peer, host, port);
+      addReplicationPeer(host, port);
+    }
+
+    setPropagationTraceSampling(cfg.trace_sample);
+
+    if(cfg.latency_report_s > 0)
+    {
+      auto reporter = [period = cfg.latency_report_s] ()
+        {
+          while(1)
+          {
+            std::this_thread::sleep_for(std::chrono::seconds(period));
+            DbgTrace("event=propagation_report %s\n", globalPropagationDelay().summary().c_str());
+          }
+        };
+
+      thread(reporter).detach();
+    }
+
     auto clientFunction = &httpMain;
 
     if(cfg.tls)
@@ -497,7 +1554,13 @@ int main(int argc, char const* argv[])
       {
         try
         {
-          clientFunction(stream.get());
+          if(g_writeTimeout_ms)
+          {
+            WriteDeadlineStream guarded(stream.get());
+            clientFunction(&guarded);
+          }
+          else
+            clientFunction(stream.get());
         }
         catch(std::exception const& e)
         {
@@ -506,7 +1569,25 @@ int main(int argc, char const* argv[])
         DbgTrace("event=connection_closed reason=client_closed\n");
       };
 
-    runTcpServer(cfg.port, cfg.long_poll_timeout_ms, clientFunctionCatcher);
+    runTcpServer(serverCfg, clientFunctionCatcher);
+
+#ifdef __linux__
+
+    if(g_draining)
+    {
+      // the idle keep-alive connections are simply closed on exit
+      auto const deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(MaxDrainTime_ms);
+
+      while(g_requestsInFlight > 0 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+      auto const remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      finishHandOver(std::max<int>(0, remaining.count()));
+      DbgTrace("event=drain_completed requests_in_flight=%d\n", g_requestsInFlight.load());
+    }
+#endif
+
+    DbgTrace("event=propagation_report %s\n", globalPropagationDelay().summary().c_str());
     DbgTrace("event=server_closed\n");
     return 0;
   }
@@ -0,0 +1,38 @@
+#pragma once
+
+// Static tracepoints (USDT, provider "evanescent"), for perf or bpftrace to
+// attach to in production, without rebuilding or enabling verbose logging:
+//
+//   bpftrace -e 'usdt:./evanescent.exe:evanescent:request_done { @us[str(arg0)] = hist(arg2); }'
+//   perf probe -x ./evanescent.exe sdt_evanescent:send_begin
+//
+// A probe nobody attached to costs a nop instruction. Without <sys/sdt.h>
+// (package systemtap-sdt-dev), the probes compile to nothing.
+//
+// Probes:
+//   connection_accepted(fd)
+//   send_begin(fd, len), send_end(fd, len)
+//   tls_handshake_begin(), tls_handshake_end(duration_us, resumed)
+//   request_start(method, url), request_done(method, url, duration_us)
+//   store_lock_wait(), store_lock_acquired(): g_mutex was contended
+//   long_poll_begin(url), long_poll_end(url, found)
+//   data_wait_begin(url), data_wait_end(url): a reader waits for the producer
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define EVANESCENT_PROBES 1
+#endif
+#endif
+
+#ifdef EVANESCENT_PROBES
+#define PROBE(name) DTRACE_PROBE(evanescent, name)
+#define PROBE1(name, a) DTRACE_PROBE1(evanescent, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(evanescent, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(evanescent, name, a, b, c)
+#else
+#define PROBE(name) ((void)0)
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
@@ -0,0 +1,484 @@
+#include "replication.h"
+#include "buffer_pool.h"
+#include "http.h"
+#include "resource.h"
+#include "tcp_server.h"
+#include "timer_wheel.h"
+
+#include <algorithm> // min
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio> // snprintf
+#include <cstdlib> // atoi
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+typedef std::chrono::steady_clock Clock;
+
+// Beyond this amount of queued data, a peer is considered too slow.
+const size_t MaxQueuedBytes = 64 * 1024 * 1024;
+
+// How long a write to a peer can stay blocked.
+const int SendTimeout_ms = 10 * 1000;
+
+// Reconnection backoff, after a failed connection attempt.
+const auto MinBackoff = std::chrono::milliseconds(100);
+const auto MaxBackoff = std::chrono::milliseconds(5000);
+
+enum class MessageType
+{
+  Begin,
+  Append,
+  End,
+  Abort, // the upload was cut short, or overflowed the queue
+  Delete,
+};
+
+struct Message
+{
+  MessageType type;
+  std::string url;
+  PooledBuffer data;
+};
+
+// A persistent connection to a peer. Requests are pipelined: the next request
+// is sent without waiting for the response to the previous one, and a
+// dedicated thread consumes the responses.
+struct Connection
+{
+  std::unique_ptr<IStream> stream;
+  std::atomic<bool> broken { false };
+};
+
+void drainResponses(std::shared_ptr<Connection> conn, std::string peerName)
+{
+  try
+  {
+    string statusLine;
+    map<string, string> headers;
+    PooledBuffer body;
+
+    while(1)
+    {
+      readLine(conn->stream.get(), statusLine);
+
+      if(statusLine.empty())
+        break; // connection closed
+
+      string version, status;
+      size_t pos = 0;
+      nextWord(statusLine, pos, version);
+      nextWord(statusLine, pos, status);
+
+      headers.clear();
+      parseHeaders(conn->stream.get(), headers);
+
+      if(status.empty() || (status[0] != '1' && status[0] != '2'))
+        DbgTrace("event=replication_error peer=%s status=%s\n", peerName.c_str(), status.c_str());
+
+      auto const length = atoi(headers["Content-Length"].c_str());
+
+      if(length > 0)
+      {
+        body.resize(length);
+
+        if(conn->stream->read(body.data(), body.size()) != body.size())
+          break;
+      }
+    }
+  }
+  catch(std::exception const& e)
+  {
+    DbgTrace("event=replication_error peer=%s error=%s\n", peerName.c_str(), e.what());
+  }
+
+  conn->broken = true;
+}
+
+struct Peer
+{
+  Peer(std::string host_, int port_) : host(host_), port(port_), name(host_ + ":" + to_string(port_))
+  {
+  }
+
+  /////////////////////////////////////////////////////////////////////////////
+  // producer side
+  /////////////////////////////////////////////////////////////////////////////
+  void push(MessageType type, const std::string& url, const uint8_t* data, size_t len)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    switch(type)
+    {
+    case MessageType::Begin:
+      dropped.erase(url);
+      break;
+
+    case MessageType::Append:
+
+      if(dropped.count(url))
+        return;
+
+      if(queuedBytes + len > MaxQueuedBytes)
+      {
+        DbgTrace("event=replication_drop peer=%s url=%s reason=queue_full\n", name.c_str(), url.c_str());
+        dropped.insert(url);
+        type = MessageType::Abort;
+        len = 0;
+      }
+
+      break;
+
+    case MessageType::End:
+    case MessageType::Abort:
+
+      // already given up on
+      if(dropped.erase(url))
+        return;
+
+      break;
+
+    default:
+      break;
+    }
+
+    queue.emplace_back();
+    auto& msg = queue.back();
+    msg.type = type;
+    msg.url = url;
+    msg.data.assign(data, len);
+    queuedBytes += len;
+
+    queueNotEmpty.notify_one();
+  }
+
+  /////////////////////////////////////////////////////////////////////////////
+  // sender thread
+  /////////////////////////////////////////////////////////////////////////////
+  void run()
+  {
+    while(1)
+    {
+      Message msg;
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(queue.empty())
+          queueNotEmpty.wait(lock);
+
+        msg = std::move(queue.front());
+        queue.pop_front();
+        queuedBytes -= msg.data.size();
+      }
+
+      process(msg);
+    }
+  }
+
+private:
+  void process(Message& msg)
+  {
+    auto const& url = msg.url;
+
+    switch(msg.type)
+    {
+    case MessageType::Begin:
+      {
+        finish(url); // previous upload of the same URL, if any
+
+        auto conn = getConnection();
+
+        if(!conn || !send(conn, "PUT", url, true))
+        {
+          drop(url);
+          break;
+        }
+
+        active[url] = conn;
+        break;
+      }
+
+    case MessageType::Append:
+      {
+        auto i_active = active.find(url);
+
+        if(i_active == active.end())
+          break;
+
+        auto conn = i_active->second;
+        char sizeLine[32];
+        snprintf(sizeLine, sizeof sizeLine, "%X", (unsigned)msg.data.size());
+
+        auto ok = write(conn, [&] ()
+          {
+            writeLine(conn->stream.get(), sizeLine);
+            conn->stream->write(msg.data.data(), msg.data.size());
+            writeLine(conn->stream.get(), "");
+          });
+
+        if(!ok)
+        {
+          active.erase(i_active);
+          release(conn);
+          drop(url);
+        }
+
+        break;
+      }
+
+    case MessageType::End:
+      {
+        finish(url);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        dropped.erase(url);
+        break;
+      }
+
+    case MessageType::Abort:
+      // the peer discards the upload, rather than keeping a truncated copy
+      abortUpload(url);
+      break;
+
+    case MessageType::Delete:
+      {
+        abortUpload(url);
+
+        auto conn = getConnection();
+
+        if(conn && send(conn, "DELETE", url, false))
+          release(conn);
+
+        break;
+      }
+    }
+  }
+
+  // Terminates the upload of 'url', and makes its connection available.
+  void finish(const std::string& url)
+  {
+    auto i_active = active.find(url);
+
+    if(i_active == active.end())
+      return;
+
+    auto conn = i_active->second;
+    active.erase(i_active);
+
+    auto ok = write(conn, [&] ()
+      {
+        writeLine(conn->stream.get(), "0");
+        writeLine(conn->stream.get(), "");
+      });
+
+    if(ok)
+      DbgTrace("event=replication_completed peer=%s url=%s\n", name.c_str(), url.c_str());
+
+    release(conn);
+  }
+
+  // Cuts the upload of 'url' in the middle of its body: the peer discards it,
+  // while terminating the body would make it a complete resource. The requests
+  // sent before on the same connection are still delivered.
+  void abortUpload(const std::string& url)
+  {
+    auto i_active = active.find(url);
+
+    if(i_active == active.end())
+      return;
+
+    auto conn = i_active->second;
+    active.erase(i_active);
+
+    DbgTrace("event=replication_aborted peer=%s url=%s\n", name.c_str(), url.c_str());
+    conn->broken = true;
+    release(conn);
+  }
+
+  // Sends a request head.
+  bool send(std::shared_ptr<Connection> conn, const char* method, const std::string& url, bool chunked)
+  {
+    return write(conn, [&] ()
+      {
+        auto s = conn->stream.get();
+        writeLine(s, (method + (" " + url) + " HTTP/1.1").c_str());
+        writeLine(s, ("Host: " + name).c_str());
+        writeLine(s, "X-Replicated: 1");
+
+        if(chunked)
+          writeLine(s, "Transfer-Encoding: chunked");
+        else
+          writeLine(s, "Content-Length: 0");
+
+        writeLine(s, "");
+      });
+  }
+
+  template<typename Func>
+  bool write(std::shared_ptr<Connection> conn, Func func)
+  {
+    if(conn->broken)
+      return false;
+
+    // a peer that stops reading doesn't block this thread forever
+    auto stream = conn->stream.get();
+    auto onExpiry = [stream] () { stream->abort(); };
+    sendDeadline.arm(SendTimeout_ms, onExpiry);
+
+    try
+    {
+      func();
+    }
+    catch(std::exception const& e)
+    {
+      DbgTrace("event=replication_error peer=%s error=%s\n", name.c_str(), e.what());
+      conn->broken = true;
+    }
+
+    if(!sendDeadline.cancel() && !conn->broken)
+    {
+      DbgTrace("event=replication_error peer=%s error=send_timeout\n", name.c_str());
+      conn->broken = true;
+    }
+
+    return !conn->broken;
+  }
+
+  void drop(const std::string& url)
+  {
+    DbgTrace("event=replication_drop peer=%s url=%s reason=connection\n", name.c_str(), url.c_str());
+    std::unique_lock<std::mutex> lock(mutex);
+    dropped.insert(url);
+  }
+
+  std::shared_ptr<Connection> getConnection()
+  {
+    while(!idle.empty())
+    {
+      auto conn = idle.back();
+      idle.pop_back();
+
+      if(!conn->broken)
+        return conn;
+
+      conn->stream->abort();
+    }
+
+    if(Clock::now() < retryAfter)
+      return nullptr;
+
+    try
+    {
+      auto conn = make_shared<Connection>();
+      conn->stream = connectTcp(host.c_str(), port);
+      thread(drainResponses, conn, name).detach();
+      backoff = MinBackoff;
+      DbgTrace("event=replication_connected peer=%s\n", name.c_str());
+      return conn;
+    }
+    catch(std::exception const& e)
+    {
+      DbgTrace("event=replication_error peer=%s error=%s\n", name.c_str(), e.what());
+      retryAfter = Clock::now() + backoff;
+      backoff = std::min<Clock::duration>(backoff * 2, MaxBackoff);
+      return nullptr;
+    }
+  }
+
+  void release(std::shared_ptr<Connection> conn)
+  {
+    if(conn->broken)
+      conn->stream->abort(); // also stops the response thread
+    else
+      idle.push_back(conn);
+  }
+
+  const std::string host;
+  const int port;
+  const std::string name;
+
+  // shared with the producers
+  std::mutex mutex;
+  std::condition_variable queueNotEmpty;
+  std::deque<Message> queue;
+  size_t queuedBytes = 0;
+  std::set<std::string> dropped; // uploads given up on
+
+  // sender thread only
+  std::map<std::string, std::shared_ptr<Connection>> active; // URL => connection carrying its upload
+  std::vector<std::shared_ptr<Connection>> idle;
+  Clock::time_point retryAfter;
+  Clock::duration backoff = MinBackoff;
+  Timer sendDeadline;
+};
+
+// Peers live as long as the process.
+std::vector<Peer*> g_peers;
+
+void pushToAll(MessageType type, const std::string& url, const uint8_t* data, size_t len)
+{
+  for(auto peer : g_peers)
+    peer->push(type, url, data, len);
+}
+
+struct Replicator : ResourceMirror
+{
+  Replicator(std::string url_) : url(std::move(url_)) {}
+
+  void begin() override
+  {
+    pushToAll(MessageType::Begin, url, nullptr, 0);
+  }
+
+  void append(const uint8_t* data, size_t len) override
+  {
+    pushToAll(MessageType::Append, url, data, len);
+  }
+
+  void end() override
+  {
+    pushToAll(MessageType::End, url, nullptr, 0);
+  }
+
+  void abort() override
+  {
+    pushToAll(MessageType::Abort, url, nullptr, 0);
+  }
+
+  const std::string url;
+};
+}
+
+void addReplicationPeer(std::string host, int port)
+{
+  auto peer = new Peer(host, port);
+  g_peers.push_back(peer);
+  thread([peer] () { peer->run(); }).detach();
+}
+
+bool hasReplicationPeers()
+{
+  return !g_peers.empty();
+}
+
+void replicateUploads(const std::string& url, Resource& res)
+{
+  if(!g_peers.empty())
+    res.setMirror(make_shared<Replicator>(url));
+}
+
+void replicateDelete(const std::string& url)
+{
+  pushToAll(MessageType::Delete, url, nullptr, 0);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+// Push replication: uploads are forwarded, chunk by chunk as they arrive,
+// to a list of peer relays, so that segments are already there when players
+// ask the peers for them.
+//
+// Each peer has its own queue and sender thread, so a slow peer never stalls
+// the ingest or the other peers. When a peer falls too far behind, the
+// uploads that overflow its queue are abandoned for this peer (cut short, so
+// the peer discards them rather than keeping a truncated copy).
+
+//
+// The requests sent to the peers carry a "X-Replicated" header: the uploads
+// and deletions received this way aren't replicated again, so peers pushing
+// to each other don't loop.
+
+#include <string>
+
+struct Resource;
+
+void addReplicationPeer(std::string host, int port);
+bool hasReplicationPeers();
+
+// Makes the uploads of 'res' replicated, as the producer writes them (see
+// ResourceMirror). Does nothing without peers.
+// To be called by the ingest paths, before res.resBegin().
+void replicateUploads(const std::string& url, Resource& res);
+void replicateDelete(const std::string& url);
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <cstddef> // size_t
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility> // pair
+#include <vector>
+
+#include "buffer_pool.h"
+#include "compression.h"
+#include "latency.h"
+#include "probes.h"
+#include "tcp_server.h" // DbgTrace
+
+// Read-only storage holding the data of a complete resource, outside of the
+// heap (e.g. a file mapping, see spill.h). Released with the last reference.
+struct SpilledData
+{
+  virtual ~SpilledData() = default;
+
+  // Opens the file holding the data, so another process can map it.
+  // Sets 'offset' to the position of the data in the file.
+  // Returns -1 if the data isn't held by a file.
+  virtual int openFile(uint64_t& offset) const
+  {
+    (void)offset;
+    return -1;
+  }
+
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+};
+
+// Receives a copy of what the producer of a resource writes (e.g. to
+// replicate the upload, see replication.h).
+struct ResourceMirror
+{
+  virtual ~ResourceMirror() = default;
+  virtual void begin() = 0;
+  virtual void append(const uint8_t* data, size_t len) = 0;
+  virtual void end() = 0;
+  virtual void abort() = 0; // the upload was cut short
+};
+
+// A growing in-memory file, concurrently writeable and readable.
+// Read operations that go beyond the currently available data will block,
+// until more data becomes available or the end of file is signaled
+// by the producer.
+struct Resource
+{
+  explicit Resource(std::string url) : m_url(std::move(url)) {}
+
+  ~Resource()
+  {
+    if(m_propagationDelay.count())
+      DbgTrace("event=propagation_summary url=%s %s\n", m_url.c_str(), m_propagationDelay.summary().c_str());
+  }
+
+  Resource(Resource const &) = delete;
+  Resource & operator = (Resource const &) = delete;
+
+  /////////////////////////////////////////////////////////////////////////////
+  // producer side
+  /////////////////////////////////////////////////////////////////////////////
+  // A resource is uploaded once: a new upload of the same URL gets a new
+  // Resource (see createResource).
+  void resBegin()
+  {
+    if(m_mirror)
+      m_mirror->begin();
+  }
+
+  void resAppend(const uint8_t* src, size_t len)
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_data.append(src, len);
+      m_appends.push_back(Append { m_data.size(), monotonicMicros() });
+      m_dataAvailable.notify_all();
+    }
+
+    if(m_mirror)
+      m_mirror->append(src, len);
+  }
+
+  void resEnd()
+  {
+    finishUpload(true);
+  }
+
+  // Ends an upload that was cut short: wakes up the readers like resEnd(),
+  // but the mirror discards the upload. The caller is expected to discard
+  // the resource too (see discardResource).
+  void resAbort()
+  {
+    finishUpload(false);
+  }
+
+  // 'mirror' gets a copy of the uploads. To be set before the first resBegin().
+  void setMirror(std::shared_ptr<ResourceMirror> mirror)
+  {
+    m_mirror = std::move(mirror);
+  }
+
+  // 'onComplete' is called by each resEnd() and resAbort(), once the
+  // resource is complete.
+  void setOnComplete(std::function<void()> onComplete)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_onComplete = std::move(onComplete);
+  }
+
+  // makes the resource complete, with the data from a previous run.
+  void restore(std::shared_ptr<const SpilledData> spilled)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_spilled = spilled;
+    m_complete = true;
+    m_completedAt = monotonicMicros();
+    m_dataAvailable.notify_all();
+  }
+
+  /////////////////////////////////////////////////////////////////////////////
+  // spill tier
+  /////////////////////////////////////////////////////////////////////////////
+
+  // the storage of a spilled resource, or nullptr.
+  std::shared_ptr<const SpilledData> spilled()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_spilled;
+  }
+
+  // when the resource was completed (from monotonicMicros()), or 0.
+  int64_t completedAt()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_completedAt;
+  }
+
+  // Moves the data of a complete resource to the storage returned by
+  // 'store' (called with the data, without the lock: the readers don't wait
+  // for the I/O), and releases the memory.
+  // Only called by the spill thread.
+  // Returns false if the resource isn't complete, already spilled, or if
+  // 'store' failed (returned null).
+  bool spill(std::function<std::shared_ptr<const SpilledData>(const uint8_t* data, size_t len)> store)
+  {
+    const uint8_t* data;
+    size_t size;
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if(!m_complete || m_spilled)
+        return false;
+
+      data = m_data.data();
+      size = m_data.size();
+    }
+
+    // complete: the data doesn't change anymore
+    auto spilled = store(data, size);
+
+    if(!spilled)
+      return false;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    m_spilled = spilled;
+    m_data.release();
+    std::vector<Append>().swap(m_appends);
+    return true;
+  }
+
+  /////////////////////////////////////////////////////////////////////////////
+  // consumer side
+  /////////////////////////////////////////////////////////////////////////////
+
+  // pushes the whole resource data to 'sendingFunc', possibly in chunks,
+  // and possibly blocking until the resource is completely uploaded.
+  // The propagation delay of the data appended after the reader arrived
+  // ('arrival', from monotonicMicros()) is recorded: what was already there
+  // only measures how late the reader joined.
+  void sendWhole(std::function<void(const uint8_t* dst, size_t len)> sendingFunc, int64_t arrival)
+  {
+    size_t sentBytes = 0;
+
+    // reused across wakeups: only grows when a bigger burst arrives
+    PooledBuffer toSend;
+
+    // the appends covered by 'toSend': [firstAppend, nextAppend) of 'm_appends'
+    size_t firstAppend = 0;
+    size_t nextAppend = 0;
+    bool fresh = false; // some were appended after the reader arrived
+
+    std::shared_ptr<const SpilledData> spilled;
+
+    while(1)
+    {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if(sentBytes == m_data.size() && !m_complete)
+        {
+          PROBE1(data_wait_begin, m_url.c_str());
+
+          while(sentBytes == m_data.size() && !m_complete)
+            m_dataAvailable.wait(lock);
+
+          PROBE1(data_wait_end, m_url.c_str());
+        }
+
+        // the rest is sent straight from the spilled storage
+        if(m_spilled)
+        {
+          spilled = m_spilled;
+          break;
+        }
+
+        if(m_complete && sentBytes == m_data.size())
+          break;
+
+        toSend.assign(m_data.data() + sentBytes, m_data.size() - sentBytes);
+
+        firstAppend = nextAppend;
+        nextAppend = m_appends.size();
+        fresh = firstAppend < nextAppend && m_appends[nextAppend - 1].when >= arrival;
+      }
+
+      sendingFunc((const uint8_t*)toSend.data(), (int)toSend.size());
+
+      auto const now = monotonicMicros();
+
+      if(fresh)
+        recordDelivery(firstAppend, nextAppend, sentBytes, now, arrival);
+
+      sentBytes += toSend.size();
+    }
+
+    if(spilled && sentBytes < spilled->size)
+      sendingFunc(spilled->data + sentBytes, spilled->size - sentBytes);
+  }
+
+  // the gzip-encoded data, if the resource is complete and worth compressing.
+  std::shared_ptr<const PooledBuffer> gzipped()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_gzipped;
+  }
+
+private:
+  struct Append
+  {
+    size_t end; // offset of the end of the appended data
+    int64_t when; // monotonicMicros()
+  };
+
+  // Records the delivery of the appends [first, last), starting at 'offset'.
+  void recordDelivery(size_t first, size_t last, size_t offset, int64_t now, int64_t arrival)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // released by spill() meanwhile
+    if(last > m_appends.size())
+      return;
+
+    for(auto i = first; i < last; ++i)
+    {
+      auto const& append = m_appends[i];
+
+      if(append.when >= arrival)
+        recordPropagation(m_propagationDelay, m_url, offset, append.end - offset, now - append.when);
+
+      offset = append.end;
+    }
+  }
+
+  void finishUpload(bool uploadComplete)
+  {
+    std::function<void()> onComplete;
+    PooledBuffer toCompress;
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_complete = true;
+      m_completedAt = monotonicMicros();
+      m_dataAvailable.notify_all();
+
+      // compressed once, here, rather than for every reader
+      if(uploadComplete && isCompressible(m_url) && m_data.size() > 0)
+        toCompress.assign(m_data.data(), m_data.size());
+
+      onComplete = m_onComplete;
+    }
+
+    if(m_mirror)
+    {
+      if(uploadComplete)
+        m_mirror->end();
+      else
+        m_mirror->abort();
+    }
+
+    // outside of the lock: the readers and the next upload don't wait for it
+    if(toCompress.size() > 0)
+    {
+      auto gzipped = std::make_shared<PooledBuffer>();
+
+      if(gzipCompress(toCompress.data(), toCompress.size(), *gzipped) && gzipped->size() < toCompress.size())
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_gzipped = gzipped;
+      }
+    }
+
+    if(onComplete)
+      onComplete();
+  }
+
+  const std::string m_url;
+
+  // storage is recycled through the buffer pool when the resource goes away,
+  // so the next segment of a similar size reuses it.
+  PooledBuffer m_data;
+  std::mutex m_mutex;
+  std::condition_variable m_dataAvailable;
+  bool m_complete = false;
+  int64_t m_completedAt = 0;
+  std::vector<Append> m_appends;
+  LatencyHistogram m_propagationDelay;
+  std::shared_ptr<const PooledBuffer> m_gzipped;
+  std::shared_ptr<const SpilledData> m_spilled; // replaces 'm_data' once spilled
+  std::function<void()> m_onComplete;
+  std::shared_ptr<ResourceMirror> m_mirror; // only used by the producer
+};
+
+// The resource store (see main.cpp). Lookups are by exact URL.
+std::shared_ptr<Resource> getResource(std::string url);
+std::shared_ptr<Resource> createResource(std::string url);
+bool deleteResource(std::string url);
+// Deletes 'res' (e.g. a truncated upload), unless it was replaced by a new
+// upload of 'url' meanwhile.
+void discardResource(std::string const& url, std::shared_ptr<Resource> const& res);
+std::vector<std::pair<std::string, std::shared_ptr<Resource>>> listResources();
@@ -0,0 +1,46 @@
+#pragma once
+
+// Spill tier: complete resources that have not changed for a while are moved
+// out of the heap, into one file per resource in a spill directory. They're
+// then served straight from a read-only mapping of that file, which bounds
+// the memory needed by a long DVR window by the page cache instead of RAM.
+//
+// The files outlive the process: on startup, the resources found in the spill
+// directory are put back in the store without copying their data, so a
+// restarted relay serves its DVR window again immediately.
+//
+// File layout: a SpillFileHeader, the URL, the data.
+//
+// Each spilled resource holds a mapping of its own, and a process can only
+// hold vm.max_map_count of them (65530 by default). The spill tier keeps the
+// mappings under half of it: past that, the resources stay in memory, and
+// the extra files found on startup are left on disk without being restored.
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+struct Resource;
+
+struct SpillFileHeader
+{
+  char magic[8]; // "LLDSPIL1"
+  uint32_t urlLength;
+  uint32_t reserved;
+  uint64_t dataLength;
+};
+
+// Restores the resources spilled to 'dir' by a previous run, by passing them
+// to 'restore', then spills the resources completed more than 'after_ms' ago,
+// from a background thread. 'dir' is created if needed.
+// Throws if 'dir' can't be used.
+void startSpill(const std::string& dir, int after_ms, std::function<void(const std::string& url, std::shared_ptr<Resource> res)> restore);
+
+// Counts a mapping of resource data ('delta': 1 when mapped, -1 when
+// unmapped). The mappings received on upgrade (see upgrade.h) count too.
+void trackMapping(int delta);
+
+// Removes the spilled copy of 'url', if any: to be called when 'url' is
+// republished or deleted. Does nothing if the spill tier isn't started.
+void forgetSpilled(const std::string& url);
@@ -0,0 +1,430 @@
+#include "spill.h"
+#include "resource.h"
+#include "tcp_server.h" // DbgTrace
+
+#include <algorithm> // min, max
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio> // fopen, perror, snprintf
+#include <cstring> // memcmp, memcpy, strerror
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+// OS-specific
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h> // close, rename, unlink, write
+
+namespace
+{
+const char Magic[8] = { 'L', 'L', 'D', 'S', 'P', 'I', 'L', '1' };
+const char Suffix[] = ".spill";
+
+// Longest wait between two spill attempts, after repeated failures.
+const auto MaxBackoff = std::chrono::milliseconds(60 * 1000);
+
+string g_dir;
+
+// see 'trackMapping'
+std::atomic<int> g_mappings { 0 };
+int g_maxMappings = 65530 / 2;
+
+// Serializes the renaming of a freshly written file with its removal on
+// republishing, so a stale copy can't be left behind.
+std::mutex g_spillMutex;
+
+struct MappedFile : SpilledData
+{
+  ~MappedFile()
+  {
+    if(base)
+    {
+      munmap(base, mappedSize);
+      trackMapping(-1);
+    }
+  }
+
+  // Reopens the file by its path: fails if it was removed or replaced since.
+  int openFile(uint64_t& offset) const override
+  {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0)
+      return -1;
+
+    struct stat st;
+
+    if(fstat(fd, &st) < 0 || st.st_dev != dev || st.st_ino != ino)
+    {
+      close(fd);
+      return -1;
+    }
+
+    offset = data - (const uint8_t*)base;
+    return fd;
+  }
+
+  void* base = nullptr;
+  size_t mappedSize = 0;
+
+  string path;
+  dev_t dev = 0;
+  ino_t ino = 0;
+};
+
+string pathOf(const string& url)
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  for(auto c : url)
+  {
+    hash ^= (uint8_t)c;
+    hash *= 0x100000001b3ull;
+  }
+
+  char name[32];
+  snprintf(name, sizeof name, "%016llx", (unsigned long long)hash);
+  return g_dir + "/" + name + Suffix;
+}
+
+bool endsWith(const string& s, const char* suffix)
+{
+  auto const n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Maps a spill file, and checks its header.
+// Returns nullptr if the file can't be mapped (e.g. out of file
+// descriptors), or isn't valid: then 'invalid' is set.
+std::shared_ptr<MappedFile> mapFile(const string& path, string& url, bool& invalid)
+{
+  invalid = false;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0)
+    return nullptr;
+
+  struct stat st;
+
+  if(fstat(fd, &st) < 0)
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  if((size_t)st.st_size < sizeof(SpillFileHeader))
+  {
+    close(fd);
+    invalid = true;
+    return nullptr;
+  }
+
+  auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the file alive
+
+  if(p == MAP_FAILED)
+    return nullptr;
+
+  auto file = make_shared<MappedFile>();
+  file->base = p;
+  trackMapping(1);
+  file->mappedSize = st.st_size;
+  file->path = path;
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+
+  SpillFileHeader hdr;
+  memcpy(&hdr, p, sizeof hdr);
+
+  if(memcmp(hdr.magic, Magic, sizeof Magic) != 0)
+  {
+    invalid = true;
+    return nullptr;
+  }
+
+  if(sizeof hdr + hdr.urlLength + hdr.dataLength != file->mappedSize)
+  {
+    invalid = true;
+    return nullptr; // truncated
+  }
+
+  auto const base = (const uint8_t*)p;
+  url.assign((const char*)base + sizeof hdr, hdr.urlLength);
+  file->data = base + sizeof hdr + hdr.urlLength;
+  file->size = hdr.dataLength;
+
+  return file;
+}
+
+bool writeAll(int fd, const void* data, size_t len)
+{
+  auto p = (const uint8_t*)data;
+
+  while(len > 0)
+  {
+    auto n = ::write(fd, p, len);
+
+    if(n < 0 && errno == EINTR)
+      continue;
+
+    if(n <= 0)
+      return false;
+
+    p += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+std::shared_ptr<MappedFile> writeFile(const string& path, const string& url, const uint8_t* data, size_t len)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+  if(fd < 0)
+    return nullptr;
+
+  SpillFileHeader hdr {};
+  memcpy(hdr.magic, Magic, sizeof Magic);
+  hdr.urlLength = url.size();
+  hdr.dataLength = len;
+
+  auto ok = writeAll(fd, &hdr, sizeof hdr)
+    && writeAll(fd, url.data(), url.size())
+    && writeAll(fd, data, len);
+
+  close(fd);
+
+  string check;
+  bool invalid;
+
+  if(ok)
+  {
+    auto file = mapFile(path, check, invalid);
+
+    if(file)
+      return file;
+  }
+
+  unlink(path.c_str());
+  return nullptr;
+}
+
+void restoreAll(std::function<void(const std::string& url, std::shared_ptr<Resource> res)> restore)
+{
+  auto const start = monotonicMicros();
+  int count = 0;
+
+  auto dir = opendir(g_dir.c_str());
+
+  if(!dir)
+  {
+    perror("opendir");
+    throw runtime_error("Can't read spill directory '" + g_dir + "'");
+  }
+
+  while(auto entry = readdir(dir))
+  {
+    string const name = entry->d_name;
+    string const path = g_dir + "/" + name;
+
+    // left over by an interrupted spill
+    if(endsWith(name, ".tmp"))
+    {
+      unlink(path.c_str());
+      continue;
+    }
+
+    if(!endsWith(name, Suffix))
+      continue;
+
+    if(g_mappings >= g_maxMappings)
+    {
+      DbgTrace("event=spill_not_restored path=%s reason=mapping_limit\n", path.c_str());
+      continue;
+    }
+
+    string url;
+    bool invalid;
+    auto file = mapFile(path, url, invalid);
+
+    if(!file)
+    {
+      if(invalid)
+      {
+        DbgTrace("event=spill_invalid_file path=%s\n", path.c_str());
+        unlink(path.c_str());
+      }
+      else
+      {
+        // e.g. out of file descriptors: the file may still be good
+        DbgTrace("event=spill_not_restored path=%s reason=%s\n", path.c_str(), strerror(errno));
+      }
+
+      continue;
+    }
+
+    auto res = make_shared<Resource>(url);
+    res->restore(file);
+    restore(url, res);
+    count++;
+  }
+
+  closedir(dir);
+
+  DbgTrace("event=spill_restored dir=%s count=%d duration_us=%lld\n", g_dir.c_str(), count, (long long)(monotonicMicros() - start));
+}
+
+// Returns false if the file couldn't be written (e.g. the disk is full).
+bool spillOne(const string& url, std::shared_ptr<Resource> res)
+{
+  auto const path = pathOf(url);
+  auto const tmpPath = path + ".tmp";
+  size_t size = 0;
+  bool written = false;
+  bool failed = false;
+
+  auto store = [&] (const uint8_t* data, size_t len) -> std::shared_ptr<const SpilledData>
+    {
+      size = len;
+      auto file = writeFile(tmpPath, url, data, len);
+      written = file != nullptr;
+      failed = !written;
+
+      // renamed below
+      if(file)
+        file->path = path;
+
+      return file;
+    };
+
+  if(!res->spill(store))
+  {
+    // uploaded again while being written
+    if(written)
+      unlink(tmpPath.c_str());
+
+    return !failed;
+  }
+
+  std::unique_lock<std::mutex> lock(g_spillMutex);
+
+  // republished or deleted meanwhile
+  if(getResource(url) != res)
+  {
+    unlink(tmpPath.c_str());
+    return true;
+  }
+
+  if(rename(tmpPath.c_str(), path.c_str()) < 0)
+  {
+    perror("rename");
+    unlink(tmpPath.c_str());
+    return false;
+  }
+
+  DbgTrace("event=resource_spilled url=%s size=%zu\n", url.c_str(), size);
+  return true;
+}
+
+void spillThread(int after_ms)
+{
+  auto const period = std::chrono::milliseconds(std::max(10, std::min(after_ms, 1000)));
+
+  // after a failure, e.g. ENOSPC: retrying every period would only
+  // hammer the disk.
+  auto backoff = period;
+  bool limitReached = false;
+
+  while(1)
+  {
+    std::this_thread::sleep_for(backoff);
+
+    auto const threshold = monotonicMicros() - (int64_t)after_ms * 1000;
+    bool failed = false;
+    bool limited = false;
+
+    for(auto& entry : listResources())
+    {
+      auto const completedAt = entry.second->completedAt();
+
+      if(completedAt == 0 || completedAt > threshold)
+        continue;
+
+      // the resources left stay in memory
+      if(g_mappings >= g_maxMappings)
+      {
+        limited = true;
+        break;
+      }
+
+      if(!spillOne(entry.first, entry.second))
+      {
+        failed = true;
+        break;
+      }
+    }
+
+    if(limited && !limitReached)
+      DbgTrace("event=spill_limit_reached dir=%s mappings=%d\n", g_dir.c_str(), g_mappings.load());
+
+    limitReached = limited;
+
+    if(failed)
+    {
+      backoff = std::min<std::chrono::milliseconds>(backoff * 2, MaxBackoff);
+      DbgTrace("event=spill_failed dir=%s retry_in_ms=%lld\n", g_dir.c_str(), (long long)backoff.count());
+    }
+    else
+    {
+      backoff = period;
+    }
+  }
+}
+}
+
+void startSpill(const std::string& dir, int after_ms, std::function<void(const std::string& url, std::shared_ptr<Resource> res)> restore)
+{
+  if(mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+  {
+    perror("mkdir");
+    throw runtime_error("Can't create spill directory '" + dir + "'");
+  }
+
+  g_dir = dir;
+
+  if(auto f = fopen("/proc/sys/vm/max_map_count", "r"))
+  {
+    int maxMapCount;
+
+    if(fscanf(f, "%d", &maxMapCount) == 1 && maxMapCount > 0)
+      g_maxMappings = maxMapCount / 2;
+
+    fclose(f);
+  }
+
+  restoreAll(restore);
+
+  thread(spillThread, after_ms).detach();
+}
+
+void forgetSpilled(const std::string& url)
+{
+  if(g_dir.empty())
+    return;
+
+  std::unique_lock<std::mutex> lock(g_spillMutex);
+  unlink(pathOf(url).c_str());
+}
+
+void trackMapping(int delta)
+{
+  g_mappings += delta;
+}
@@ -0,0 +1,107 @@
+#include "subscriptions.h"
+
+#include <chrono>
+#include <map>
+#include <unordered_map>
+
+using namespace std;
+
+namespace
+{
+// Beyond this amount of undelivered changes, a subscriber is considered too
+// slow, and is dropped (it can subscribe again).
+const size_t MaxPendingChanges = 1024;
+
+std::mutex g_mutex;
+std::unordered_map<std::string, std::vector<Subscription*>> g_subscribers; // by prefix
+std::map<size_t, int> g_prefixLengths; // subscribed prefix length -> prefix count
+}
+
+const char* eventName(ResourceEvent event)
+{
+  switch(event)
+  {
+  case ResourceEvent::Created: return "created";
+  case ResourceEvent::Completed: return "completed";
+  case ResourceEvent::Deleted: return "deleted";
+  }
+
+  return "unknown";
+}
+
+Subscription::Subscription(std::string prefix_) : prefix(std::move(prefix_))
+{
+  std::unique_lock<std::mutex> lock(g_mutex);
+  auto& subscribers = g_subscribers[prefix];
+
+  if(subscribers.empty())
+    g_prefixLengths[prefix.size()]++;
+
+  subscribers.push_back(this);
+}
+
+Subscription::~Subscription()
+{
+  std::unique_lock<std::mutex> lock(g_mutex);
+  auto const i_subscribers = g_subscribers.find(prefix);
+  auto& subscribers = i_subscribers->second;
+
+  for(auto i = subscribers.begin(); i != subscribers.end(); ++i)
+  {
+    if(*i == this)
+    {
+      subscribers.erase(i);
+      break;
+    }
+  }
+
+  if(subscribers.empty())
+  {
+    g_subscribers.erase(i_subscribers);
+
+    if(--g_prefixLengths[prefix.size()] == 0)
+      g_prefixLengths.erase(prefix.size());
+  }
+}
+
+bool Subscription::wait(int timeout_ms, std::vector<ResourceChange>& changes)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  if(m_pending.empty() && !m_overflow)
+    m_changed.wait_for(lock, std::chrono::milliseconds(timeout_ms));
+
+  for(auto& change : m_pending)
+    changes.push_back(std::move(change));
+
+  m_pending.clear();
+  return !m_overflow;
+}
+
+void publishResourceEvent(ResourceEvent event, std::string const& url)
+{
+  std::unique_lock<std::mutex> lock(g_mutex);
+
+  for(auto& length : g_prefixLengths)
+  {
+    if(length.first > url.size())
+      break;
+
+    auto const i_subscribers = g_subscribers.find(url.substr(0, length.first));
+
+    if(i_subscribers == g_subscribers.end())
+      continue;
+
+    for(auto subscriber : i_subscribers->second)
+    {
+      std::unique_lock<std::mutex> subscriberLock(subscriber->m_mutex);
+
+      if(subscriber->m_pending.size() >= MaxPendingChanges)
+        subscriber->m_overflow = true;
+      else
+        subscriber->m_pending.push_back(ResourceChange { event, url });
+
+      subscriber->m_changed.notify_one();
+    }
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+// Resource change notifications: a player subscribes to a URL prefix (e.g.
+// "/live/channel1/"), and is told as soon as a resource under it is
+// created, completed or deleted, instead of polling for it.
+//
+// The subscribers are indexed by prefix, and by prefix length: publishing
+// an event costs one lookup per distinct subscribed prefix length, plus the
+// matching subscribers.
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class ResourceEvent
+{
+  Created,
+  Completed,
+  Deleted,
+};
+
+const char* eventName(ResourceEvent event);
+
+struct ResourceChange
+{
+  ResourceEvent event;
+  std::string url;
+};
+
+// Registered while it exists.
+struct Subscription
+{
+  explicit Subscription(std::string prefix);
+  ~Subscription();
+
+  Subscription(Subscription const &) = delete;
+  Subscription & operator = (Subscription const &) = delete;
+
+  // Waits at most 'timeout_ms' for changes, and moves them to 'changes'.
+  // Returns false if the subscriber fell too far behind: changes were lost.
+  bool wait(int timeout_ms, std::vector<ResourceChange>& changes);
+
+  const std::string prefix;
+
+private:
+  friend void publishResourceEvent(ResourceEvent event, std::string const& url);
+
+  std::mutex m_mutex;
+  std::condition_variable m_changed;
+  std::deque<ResourceChange> m_pending;
+  bool m_overflow = false;
+};
+
+// Notifies the subscribers of the prefixes of 'url'. Doesn't block.
+void publishResourceEvent(ResourceEvent event, std::string const& url);
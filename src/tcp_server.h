@@ -5,6 +5,22 @@
 #include <functional>
 #include <memory>
 
+// Socket options for one direction of the traffic (ingest or egress).
+// Zero leaves the OS default.
+struct SocketProfile
+{
+  bool no_delay = false; // TCP_NODELAY: don't hold back small writes (Nagle)
+  int not_sent_lowat = 0; // TCP_NOTSENT_LOWAT (not on Windows): at most this many unsent bytes are queued
+  int send_buffer = 0; // SO_SNDBUF, in bytes
+  int receive_buffer = 0; // SO_RCVBUF, in bytes
+  uint64_t max_pacing_rate = 0; // SO_MAX_PACING_RATE (Linux only), in bytes per second
+
+  bool isDefault() const
+  {
+    return !no_delay && !not_sent_lowat && !send_buffer && !receive_buffer && !max_pacing_rate;
+  }
+};
+
 struct IStream
 {
   IStream(int long_poll_timeout_ms_) : long_poll_timeout_ms(long_poll_timeout_ms_) {}
@@ -12,10 +28,59 @@ struct IStream
   virtual void write(const uint8_t* data, size_t len) = 0;
   virtual size_t read(uint8_t* data, size_t len) = 0;
 
+  // Unblocks any pending read or write, and makes the following ones fail.
+  // Can be called from any thread.
+  virtual void abort() {}
+
+  // Tunes the underlying socket, if any, once the direction of the traffic
+  // is known.
+  virtual void applyProfile(SocketProfile const&) {}
+
+  // Waits until data can be read, wakeUp() is called, or 'timeout_ms'
+  // expires (-1: no timeout). Returns whether data can be read.
+  // Streams that can't wait return true: the next read blocks.
+  virtual bool waitReadable(int /* timeout_ms */) { return true; }
+
+  // Interrupts a waitReadable(). Can be called from any thread.
+  virtual void wakeUp() {}
+
   int long_poll_timeout_ms;
 };
 
-void runTcpServer(int tcpPort, int long_poll_timeout_ms, std::function<void(std::unique_ptr<IStream> s)> clientFunc);
+struct TcpServerConfig
+{
+  int port = 9000;
+  int long_poll_timeout_ms = 2000;
+
+  // Linux only: do the socket I/O through io_uring.
+  // Falls back to plain socket calls if the kernel doesn't support it.
+  bool io_uring = false;
+
+  // Not on Windows: an already listening socket (e.g. inherited from the
+  // relay being upgraded) to accept connections from, instead of binding 'port'.
+  int listen_fd = -1;
+
+  // Called with the listening socket, once connections are being accepted.
+  std::function<void(int listen_fd)> onListening;
+};
+
+void runTcpServer(TcpServerConfig const& cfg, std::function<void(std::unique_ptr<IStream> s)> clientFunc);
+
+// Not on Windows: makes runTcpServer stop accepting connections and return,
+// leaving the listening socket open (e.g. for another process to use).
+// Returns once no more connections are accepted. The connections already
+// accepted are still being served.
+// Then, either resumeTcpServer() accepts connections again (e.g. the
+// listening socket couldn't be handed over), or releaseTcpServer() makes
+// runTcpServer return.
+// These can be called from any thread.
+void stopTcpServer();
+void resumeTcpServer();
+void releaseTcpServer();
+
+// Opens an outgoing TCP connection. Throws on failure.
+// Each connection attempt gives up after 'timeout_ms' (0: the system's).
+std::unique_ptr<IStream> connectTcp(const char* host, int port, int timeout_ms = 0);
 
 void DbgTrace(const char* format, ...);
 
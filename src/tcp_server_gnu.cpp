@@ -8,6 +8,10 @@
 #include <csignal>
 #include <chrono>
 #include <ctime>
+#include <cerrno>
+#include <atomic>
+#include <mutex> // call_once
+#include <condition_variable>
 
 using namespace std;
 
@@ -15,57 +19,417 @@ using namespace std;
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY, TCP_NOTSENT_LOWAT
+#include <netdb.h> // getaddrinfo
 #include <unistd.h> // close
+#include <poll.h>
+#include <fcntl.h>
 
-static int g_socket;
-static void sigIntHandler(int)
+#ifdef __linux__
+#include "io_ring.h"
+#include "buffer_pool.h"
+#include "probes.h"
+#include <algorithm> // min
+#include <cstring> // memcpy
+#endif
+
+static void setOption(int fd, int level, int option, const char* name, const void* value, socklen_t len)
 {
-  auto socket = g_socket;
-  g_socket = -1;
-  shutdown(socket, SHUT_RD); // unblock call to 'accept' below
-  close(socket);
+  // not fatal: the connection still works with the default
+  if(setsockopt(fd, level, option, value, len) < 0)
+    DbgTrace("event=socket_option_failed option=%s errno=%d\n", name, errno);
+}
+
+static void applySocketProfile(int fd, SocketProfile const& profile)
+{
+  if(profile.no_delay)
+  {
+    int one = 1;
+    setOption(fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", &one, sizeof one);
+  }
+
+#ifdef TCP_NOTSENT_LOWAT
+
+  if(profile.not_sent_lowat)
+    setOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", &profile.not_sent_lowat, sizeof profile.not_sent_lowat);
+#endif
+
+  if(profile.send_buffer)
+    setOption(fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", &profile.send_buffer, sizeof profile.send_buffer);
+
+  if(profile.receive_buffer)
+    setOption(fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", &profile.receive_buffer, sizeof profile.receive_buffer);
+
+#ifdef SO_MAX_PACING_RATE
+
+  if(profile.max_pacing_rate)
+  {
+    // 64-bit since Linux 4.20, older kernels read the low 32 bits
+    uint64_t rate = profile.max_pacing_rate;
+    setOption(fd, SOL_SOCKET, SO_MAX_PACING_RATE, "SO_MAX_PACING_RATE", &rate, sizeof rate);
+  }
+#endif
 }
 
-void runTcpServer(int tcpPort, int long_poll_timeout_ms, std::function<void(std::unique_ptr<IStream> s)> clientFunc)
+// Interrupts the poll() of a stream from another thread.
+// The pipe is only created by the streams that wait (e.g. HTTP/2).
+struct Waker
 {
-  struct SocketStream : IStream
+  ~Waker()
   {
-    SocketStream(int fd_, int long_poll_timeout_ms) : IStream(long_poll_timeout_ms), fd(fd_)
+    if(fds[0] >= 0)
     {
+      close(fds[0]);
+      close(fds[1]);
     }
+  }
 
-    ~SocketStream()
+  int fd()
+  {
+    std::call_once(created, [this] ()
+      {
+        if(pipe(fds) < 0)
+        {
+          perror("pipe");
+          throw runtime_error("can't create pipe");
+        }
+
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+      });
+
+    return fds[0];
+  }
+
+  void wake()
+  {
+    // before the first wait, fds[1] is -1: there's nobody to wake up.
+    // If the pipe is full, a wakeup is already pending.
+    uint8_t c = 0;
+    auto ret = ::write(fds[1], &c, 1);
+    (void)ret;
+  }
+
+  void drain()
+  {
+    uint8_t buffer[64];
+
+    while(::read(fds[0], buffer, sizeof buffer) > 0)
     {
-      close(fd);
     }
+  }
 
-    void write(const uint8_t* data, size_t len) override
-    {
-      int flags = MSG_WAITALL;
+  int fds[2] = { -1, -1 };
+  std::once_flag created;
+};
+
+static bool waitReadable(int fd, Waker& waker, int timeout_ms)
+{
+  pollfd fds[2] = {
+    { fd, POLLIN, 0 },
+    { waker.fd(), POLLIN, 0 },
+  };
+
+  auto ret = poll(fds, 2, timeout_ms);
+
+  if(fds[1].revents)
+    waker.drain();
+
+  // errors and hangups are readable: the read reports them
+  return ret > 0 && fds[0].revents;
+}
+
+struct SocketStream : IStream
+{
+  SocketStream(int fd_, int long_poll_timeout_ms) : IStream(long_poll_timeout_ms), fd(fd_)
+  {
+  }
+
+  ~SocketStream()
+  {
+    close(fd);
+  }
+
+  void write(const uint8_t* data, size_t len) override
+  {
+    int flags = MSG_WAITALL;
 #ifdef MSG_NOSIGNAL
-      flags |= MSG_NOSIGNAL;
+    flags |= MSG_NOSIGNAL;
 #endif
-      ::send(fd, data, len, flags);
-    }
+    PROBE2(send_begin, fd, len);
+    auto const ret = ::send(fd, data, len, flags);
+    PROBE2(send_end, fd, len);
 
-    size_t read(uint8_t* data, size_t len) override
-    {
-      int flags = MSG_WAITALL;
+    // e.g. the client went away: the writer stops there
+    if(ret < 0)
+      throw runtime_error("socket error on send()");
+  }
+
+  size_t read(uint8_t* data, size_t len) override
+  {
+    int flags = MSG_WAITALL;
 #ifdef MSG_NOSIGNAL
-      flags |= MSG_NOSIGNAL;
+    flags |= MSG_NOSIGNAL;
 #endif
-      return ::recv(fd, data, len, flags);
+    auto ret = ::recv(fd, data, len, flags);
+
+    // errors are reported as end of stream: callers only check for zero
+    return ret < 0 ? 0 : ret;
+  }
+
+  void abort() override
+  {
+    ::shutdown(fd, SHUT_RDWR);
+  }
+
+  void applyProfile(SocketProfile const& profile) override
+  {
+    applySocketProfile(fd, profile);
+  }
+
+  bool waitReadable(int timeout_ms) override
+  {
+    return ::waitReadable(fd, waker, timeout_ms);
+  }
+
+  void wakeUp() override
+  {
+    waker.wake();
+  }
+
+  const int fd;
+  Waker waker;
+};
+
+#ifdef __linux__
+// Same as SocketStream, but the I/O goes through the shared io_uring.
+// Small reads (e.g. the request headers, which are read byte per byte) are
+// served from what the last receive brought in, instead of costing a
+// syscall each.
+struct RingStream : IStream
+{
+  RingStream(IoRing* ring_, int fd_, int long_poll_timeout_ms) : IStream(long_poll_timeout_ms), ring(ring_), fd(fd_)
+  {
+  }
+
+  ~RingStream()
+  {
+    close(fd);
+  }
+
+  void write(const uint8_t* data, size_t len) override
+  {
+    while(len > 0)
+    {
+      PROBE2(send_begin, fd, len);
+      auto ret = ring->send(fd, data, len, MSG_WAITALL | MSG_NOSIGNAL);
+      PROBE2(send_end, fd, len);
+
+      if(ret <= 0)
+        throw runtime_error("socket error on send()");
+
+      data += ret;
+      len -= ret;
     }
+  }
 
-    const int fd;
-  };
+  size_t read(uint8_t* data, size_t len) override
+  {
+    size_t done = 0;
+
+    while(done < len)
+    {
+      if(m_readPos < m_readAhead.size())
+      {
+        auto n = std::min(len - done, m_readAhead.size() - m_readPos);
+        memcpy(data + done, m_readAhead.data() + m_readPos, n);
+        m_readPos += n;
+        done += n;
+        continue;
+      }
+
+      m_readAhead.clear();
+      m_readPos = 0;
+
+      int ret;
+
+      if(len - done >= ReadAheadSize)
+      {
+        // big reads (e.g. chunk payloads) go straight to the caller's buffer
+        ret = ring->recv(fd, data + done, len - done, MSG_WAITALL);
+
+        if(ret > 0)
+          done += ret;
+      }
+      else if(ring->hasProvidedBuffers())
+      {
+        auto consume = [&] (const uint8_t* buf, size_t n)
+          {
+            auto direct = std::min(n, len - done);
+            memcpy(data + done, buf, direct);
+            done += direct;
+            m_readAhead.append(buf + direct, n - direct);
+          };
+        ret = ring->recvProvided(fd, consume);
+      }
+      else
+      {
+        m_readAhead.resize(ReadAheadSize);
+        ret = ring->recv(fd, m_readAhead.data(), m_readAhead.size(), 0);
+        m_readAhead.resize(ret > 0 ? ret : 0);
+      }
+
+      if(ret == 0)
+        break;
+
+      if(ret < 0)
+        throw runtime_error("socket error on recv()");
+    }
+
+    return done;
+  }
+
+  void abort() override
+  {
+    ::shutdown(fd, SHUT_RDWR);
+  }
+
+  void applyProfile(SocketProfile const& profile) override
+  {
+    applySocketProfile(fd, profile);
+  }
+
+  bool waitReadable(int timeout_ms) override
+  {
+    if(m_readPos < m_readAhead.size())
+      return true;
+
+    return ::waitReadable(fd, waker, timeout_ms);
+  }
+
+  void wakeUp() override
+  {
+    waker.wake();
+  }
+
+  enum { ReadAheadSize = 16 * 1024 };
+
+  IoRing* const ring;
+  const int fd;
+  Waker waker;
+  PooledBuffer m_readAhead;
+  size_t m_readPos = 0;
+};
+#endif
+
+enum class AcceptState
+{
+  Accepting,
+  Stopping, // stopTcpServer() waits for the accept loop
+  Stopped, // the accept loop waits for resumeTcpServer() or releaseTcpServer()
+  Released,
+};
+
+static std::mutex g_acceptMutex;
+static std::condition_variable g_acceptChanged;
+static AcceptState g_acceptState = AcceptState::Accepting;
+static std::atomic<bool> g_stop; // mirrors 'Stopping', polled by the accept loop
+static bool g_acceptLoopExited = false;
+
+void stopTcpServer()
+{
+  std::unique_lock<std::mutex> lock(g_acceptMutex);
+  g_acceptState = AcceptState::Stopping;
+  g_stop = true;
+
+  while(g_acceptState == AcceptState::Stopping && !g_acceptLoopExited)
+    g_acceptChanged.wait(lock);
+}
+
+void resumeTcpServer()
+{
+  std::unique_lock<std::mutex> lock(g_acceptMutex);
+  g_acceptState = AcceptState::Accepting;
+  g_acceptChanged.notify_all();
+}
+
+static std::atomic<int> g_socket { -1 };
+
+void releaseTcpServer()
+{
+  // handed over: the listening socket isn't ours to close on SIGINT anymore
+  g_socket = -1;
+
+  std::unique_lock<std::mutex> lock(g_acceptMutex);
+  g_acceptState = AcceptState::Released;
+  g_acceptChanged.notify_all();
+}
+
+// Called by the accept loop once it stopped accepting.
+// Returns true if accepting is resumed, false if the loop must exit.
+static bool waitResumed()
+{
+  std::unique_lock<std::mutex> lock(g_acceptMutex);
+  g_acceptState = AcceptState::Stopped;
+  g_stop = false;
+  g_acceptChanged.notify_all();
+
+  while(g_acceptState == AcceptState::Stopped)
+    g_acceptChanged.wait(lock);
+
+  return g_acceptState == AcceptState::Accepting;
+}
+
+// The accept loop polls, and notices the closed socket: no shutdown(),
+// which would also stop the other processes sharing the listening socket
+// (e.g. during an upgrade).
+static void sigIntHandler(int)
+{
+  auto socket = g_socket.exchange(-1);
+
+  if(socket != -1)
+    close(socket);
+}
+
+void runTcpServer(TcpServerConfig const& cfg, std::function<void(std::unique_ptr<IStream> s)> clientFunc)
+{
+  auto const tcpPort = cfg.port;
+  auto const long_poll_timeout_ms = cfg.long_poll_timeout_ms;
+
+#ifdef __linux__
+  IoRing* ring = nullptr;
+
+  if(cfg.io_uring)
+  {
+    ring = IoRing::create(4096);
+
+    if(!ring)
+      DbgTrace("event=io_uring_unavailable fallback=sockets\n");
+  }
+
+  auto clientThread = [clientFunc, long_poll_timeout_ms, ring] (int clientSocket) {
+      std::unique_ptr<IStream> s;
+
+      if(ring)
+        s = make_unique<RingStream>(ring, clientSocket, long_poll_timeout_ms);
+      else
+        s = make_unique<SocketStream>(clientSocket, long_poll_timeout_ms);
+
+      clientFunc(std::move(s));
+    };
+#else
+
+  if(cfg.io_uring)
+    DbgTrace("event=io_uring_unavailable fallback=sockets\n");
 
   auto clientThread = [clientFunc, long_poll_timeout_ms] (int clientSocket) {
       auto s = make_unique<SocketStream>(clientSocket, long_poll_timeout_ms);
       clientFunc(std::move(s));
     };
+#endif
 
-  const int sock = socket(AF_INET, SOCK_STREAM, 0);
+  const bool inherited = cfg.listen_fd >= 0;
+  const int sock = inherited ? cfg.listen_fd : socket(AF_INET, SOCK_STREAM, 0);
 
   if(sock < 0)
   {
@@ -78,6 +442,7 @@ void runTcpServer(int tcpPort, int long_poll_timeout_ms, std::function<void(std:
     std::signal(SIGINT, sigIntHandler);
   }
 
+  if(!inherited)
   {
     int one = 1;
     int ret = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
@@ -89,6 +454,7 @@ void runTcpServer(int tcpPort, int long_poll_timeout_ms, std::function<void(std:
     }
   }
 
+  if(!inherited)
   {
     sockaddr_in serverAddress;
     serverAddress.sin_family = AF_INET;
@@ -104,6 +470,7 @@ void runTcpServer(int tcpPort, int long_poll_timeout_ms, std::function<void(std:
     }
   }
 
+  if(!inherited)
   {
     int ret = listen(sock, 64);
 
@@ -114,14 +481,104 @@ void runTcpServer(int tcpPort, int long_poll_timeout_ms, std::function<void(std:
     }
   }
 
-  DbgTrace("Server listening on: %d\n", tcpPort);
+  DbgTrace("Server listening on: %d%s\n", tcpPort, inherited ? " (inherited)" : "");
+
+#ifdef __linux__
+
+  if(ring)
+  {
+    DbgTrace("event=io_backend backend=io_uring provided_buffers=%s\n", ring->hasProvidedBuffers() ? "true" : "false");
+    ring->startAccept(sock);
+  }
+#endif
+
+  if(cfg.onListening)
+    cfg.onListening(sock);
+
+  auto serve = [&] (int clientSocket)
+    {
+      PROBE1(connection_accepted, clientSocket);
+      auto t = thread(clientThread, clientSocket);
+      t.detach();
+    };
+
+  bool released = false;
 
   while(1)
   {
-    sockaddr_in client_address;
-    socklen_t address_len = sizeof(client_address);
+    if(g_stop)
+    {
+#ifdef __linux__
+
+      if(ring)
+      {
+        ring->stopAccept();
 
-    int clientSocket = accept(sock, (sockaddr*)&client_address, &address_len);
+        // the connections accepted before the cancellation are still served
+        int clientSocket;
+
+        while((clientSocket = ring->nextAccepted(0)) >= 0)
+          serve(clientSocket);
+      }
+#endif
+
+      if(!waitResumed())
+      {
+        released = true;
+        break;
+      }
+
+      DbgTrace("Server resumed accepting\n");
+
+#ifdef __linux__
+
+      if(ring)
+        ring->startAccept(sock);
+#endif
+
+      continue;
+    }
+
+    int clientSocket;
+
+#ifdef __linux__
+
+    if(ring)
+    {
+      // the signal handler can't wake us up: poll for it
+      clientSocket = ring->nextAccepted(100);
+
+      if(clientSocket < 0)
+      {
+        if(g_socket == -1)
+          break; // exit thread
+
+        if(clientSocket != -ETIMEDOUT && clientSocket != -ECANCELED)
+        {
+          errno = -clientSocket;
+          perror("accept");
+        }
+
+        continue;
+      }
+    }
+    else
+#endif
+    {
+      // wake up regularly, to notice stopTcpServer()
+      pollfd pfd { sock, POLLIN, 0 };
+
+      if(g_socket != -1 && poll(&pfd, 1, 100) == 0)
+        continue;
+
+      if(g_stop)
+        continue;
+
+      sockaddr_in client_address;
+      socklen_t address_len = sizeof(client_address);
+
+      clientSocket = accept(sock, (sockaddr*)&client_address, &address_len);
+    }
 
     if(clientSocket < 0)
     {
@@ -129,13 +586,83 @@ void runTcpServer(int tcpPort, int long_poll_timeout_ms, std::function<void(std:
         break; // exit thread
 
       perror("accept");
+      continue;
     }
 
-    auto t = thread(clientThread, clientSocket);
-    t.detach();
+    serve(clientSocket);
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(g_acceptMutex);
+    g_acceptLoopExited = true;
+    g_acceptChanged.notify_all();
+  }
+
+  DbgTrace(released ? "Server stopped accepting\n" : "Server closed\n");
+}
+
+// connect(), giving up after 'timeout_ms' (0: the system's timeout).
+static bool connectWithin(int sock, const sockaddr* address, socklen_t len, int timeout_ms)
+{
+  if(!timeout_ms)
+    return connect(sock, address, len) == 0;
+
+  auto const flags = fcntl(sock, F_GETFL);
+  fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+  bool ok = connect(sock, address, len) == 0;
+
+  if(!ok && errno == EINPROGRESS)
+  {
+    pollfd pfd { sock, POLLOUT, 0 };
+    int err = 0;
+    socklen_t errLen = sizeof err;
+
+    ok = poll(&pfd, 1, timeout_ms) == 1
+      && getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errLen) == 0
+      && err == 0;
   }
 
-  DbgTrace("Server closed\n");
+  fcntl(sock, F_SETFL, flags);
+  return ok;
+}
+
+std::unique_ptr<IStream> connectTcp(const char* host, int port, int timeout_ms)
+{
+  addrinfo hints {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  char service[16];
+  snprintf(service, sizeof service, "%d", port);
+
+  addrinfo* addresses = nullptr;
+
+  if(getaddrinfo(host, service, &hints, &addresses) != 0)
+    throw runtime_error(string("can't resolve '") + host + "'");
+
+  int sock = -1;
+
+  for(auto ai = addresses; ai; ai = ai->ai_next)
+  {
+    sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+    if(sock < 0)
+      continue;
+
+    if(connectWithin(sock, ai->ai_addr, ai->ai_addrlen, timeout_ms))
+      break;
+
+    close(sock);
+    sock = -1;
+  }
+
+  freeaddrinfo(addresses);
+
+  if(sock < 0)
+    throw runtime_error(string("can't connect to '") + host + ":" + service + "'");
+
+  return make_unique<SocketStream>(sock, 0);
 }
 
 void DbgTrace(const char* format, ...)
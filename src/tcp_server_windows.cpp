@@ -14,55 +14,90 @@ using namespace std;
 // OS-specific
 #define WIN32_LEAN_AND_MEAN
 #include <winsock2.h>
+#include <ws2tcpip.h> // getaddrinfo
 #include <windows.h>
 
-static SOCKET g_socket;
-static void sigIntHandler(int)
+struct SocketStream : IStream
 {
-  auto socket = g_socket;
-  g_socket = -1;
-  closesocket(socket); // unblock call to 'accept' below
-}
+  SocketStream(SOCKET fd_, int long_poll_timeout_ms) : IStream(long_poll_timeout_ms), fd(fd_)
+  {
+  }
 
-void runTcpServer(int tcpPort, int long_poll_timeout_ms, std::function<void(std::unique_ptr<IStream> s)> clientFunc)
-{
-  struct SocketStream : IStream
+  ~SocketStream()
+  {
+    closesocket(fd);
+  }
+
+  void write(const uint8_t* data, size_t len) override
   {
-    SocketStream(SOCKET fd_, int long_poll_timeout_ms) : IStream(long_poll_timeout_ms), fd(fd_)
+    auto res = ::send(fd, (const char*)data, len, 0);
+
+    if(res < 0)
     {
+      fprintf(stderr, "send() last error: %d\n", WSAGetLastError());
+      throw runtime_error("socket error on send()");
     }
+  }
+
+  size_t read(uint8_t* data, size_t len) override
+  {
+    auto res = ::recv(fd, (char*)data, len, MSG_WAITALL);
 
-    ~SocketStream()
+    if(res < 0)
     {
-      closesocket(fd);
+      fprintf(stderr, "recv() error: %d\n", WSAGetLastError());
+      throw runtime_error("socket error on recv()");
     }
 
-    void write(const uint8_t* data, size_t len) override
-    {
-      auto res = ::send(fd, (const char*)data, len, 0);
+    return res;
+  }
 
-      if(res < 0)
-      {
-        fprintf(stderr, "send() last error: %d\n", WSAGetLastError());
-        throw runtime_error("socket error on send()");
-      }
-    }
+  void abort() override
+  {
+    ::shutdown(fd, SD_BOTH);
+  }
 
-    size_t read(uint8_t* data, size_t len) override
+  // TCP_NOTSENT_LOWAT and pacing aren't available
+  void applyProfile(SocketProfile const& profile) override
+  {
+    if(profile.no_delay)
     {
-      auto res = ::recv(fd, (char*)data, len, MSG_WAITALL);
+      BOOL one = TRUE;
+      setOption(IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", (const char*)&one, sizeof one);
+    }
 
-      if(res < 0)
-      {
-        fprintf(stderr, "recv() error: %d\n", WSAGetLastError());
-        throw runtime_error("socket error on recv()");
-      }
+    if(profile.send_buffer)
+      setOption(SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", (const char*)&profile.send_buffer, sizeof profile.send_buffer);
 
-      return res;
-    }
+    if(profile.receive_buffer)
+      setOption(SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", (const char*)&profile.receive_buffer, sizeof profile.receive_buffer);
+  }
+
+  void setOption(int level, int option, const char* name, const char* value, int len)
+  {
+    // not fatal: the connection still works with the default
+    if(setsockopt(fd, level, option, value, len) != 0)
+      DbgTrace("event=socket_option_failed option=%s error=%d\n", name, WSAGetLastError());
+  }
+
+  const SOCKET fd;
+};
+
+static SOCKET g_socket;
+static void sigIntHandler(int)
+{
+  auto socket = g_socket;
+  g_socket = -1;
+  closesocket(socket); // unblock call to 'accept' below
+}
+
+void runTcpServer(TcpServerConfig const& cfg, std::function<void(std::unique_ptr<IStream> s)> clientFunc)
+{
+  auto const tcpPort = cfg.port;
+  auto const long_poll_timeout_ms = cfg.long_poll_timeout_ms;
 
-    const SOCKET fd;
-  };
+  if(cfg.io_uring)
+    DbgTrace("event=io_uring_unavailable fallback=sockets\n");
 
   auto clientThread = [clientFunc, long_poll_timeout_ms] (int clientSocket) {
       auto s = make_unique<SocketStream>(clientSocket, long_poll_timeout_ms);
@@ -149,6 +184,72 @@ void runTcpServer(int tcpPort, int long_poll_timeout_ms, std::function<void(std:
   DbgTrace("Server closed\n");
 }
 
+// connect(), giving up after 'timeout_ms' (0: the system's timeout).
+static bool connectWithin(SOCKET sock, const sockaddr* address, int len, int timeout_ms)
+{
+  if(!timeout_ms)
+    return connect(sock, address, len) == 0;
+
+  u_long nonBlocking = 1;
+  ioctlsocket(sock, FIONBIO, &nonBlocking);
+
+  bool ok = connect(sock, address, len) == 0;
+
+  if(!ok && WSAGetLastError() == WSAEWOULDBLOCK)
+  {
+    fd_set writable, failed;
+    FD_ZERO(&writable);
+    FD_SET(sock, &writable);
+    FD_ZERO(&failed);
+    FD_SET(sock, &failed);
+
+    timeval timeout { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    ok = select(0, nullptr, &writable, &failed, &timeout) == 1 && FD_ISSET(sock, &writable);
+  }
+
+  nonBlocking = 0;
+  ioctlsocket(sock, FIONBIO, &nonBlocking);
+  return ok;
+}
+
+std::unique_ptr<IStream> connectTcp(const char* host, int port, int timeout_ms)
+{
+  addrinfo hints {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  char service[16];
+  snprintf(service, sizeof service, "%d", port);
+
+  addrinfo* addresses = nullptr;
+
+  if(getaddrinfo(host, service, &hints, &addresses) != 0)
+    throw runtime_error(string("can't resolve '") + host + "'");
+
+  SOCKET sock = INVALID_SOCKET;
+
+  for(auto ai = addresses; ai; ai = ai->ai_next)
+  {
+    sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+    if(sock == INVALID_SOCKET)
+      continue;
+
+    if(connectWithin(sock, ai->ai_addr, (int)ai->ai_addrlen, timeout_ms))
+      break;
+
+    closesocket(sock);
+    sock = INVALID_SOCKET;
+  }
+
+  freeaddrinfo(addresses);
+
+  if(sock == INVALID_SOCKET)
+    throw runtime_error(string("can't connect to '") + host + ":" + service + "'");
+
+  return make_unique<SocketStream>(sock, 0);
+}
+
 static std::mutex g_debugTraceMutex;
 
 void DbgTrace(const char* format, ...)
@@ -0,0 +1,240 @@
+#include "timer_wheel.h"
+
+#include <algorithm> // max, min
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+const int TickMs = 10;
+const int SlotBits = 6;
+const int Slots = 1 << SlotBits;
+const int Levels = 4;
+const uint64_t MaxDelayTicks = ((uint64_t)1 << (SlotBits * Levels)) - 1;
+
+uint64_t nowTicks()
+{
+  auto const now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(now).count() / TickMs;
+}
+
+std::chrono::steady_clock::time_point timeOfTick(uint64_t tick)
+{
+  return std::chrono::steady_clock::time_point(std::chrono::milliseconds(tick * TickMs));
+}
+}
+
+struct TimerWheel
+{
+  static TimerWheel& instance()
+  {
+    // never destroyed: its thread runs until exit
+    static auto wheel = new TimerWheel;
+    return *wheel;
+  }
+
+  void arm(Timer* t, int delay_ms, std::function<void()> onExpiry)
+  {
+    uint64_t const delay = (std::max(delay_ms, 0) + TickMs - 1) / TickMs;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if(t->m_next)
+      unlink(t);
+
+    // the wheel didn't turn while it was empty
+    if(m_count == 0)
+      m_current = std::max(m_current, nowTicks());
+
+    t->m_onExpiry = std::move(onExpiry);
+    t->m_expiry = m_current + std::min(std::max<uint64_t>(delay, 1), MaxDelayTicks);
+    insert(t);
+
+    if(m_count == 1)
+      m_wakeUp.notify_one();
+  }
+
+  bool cancel(Timer* t)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if(t->m_next)
+    {
+      unlink(t);
+      t->m_onExpiry = nullptr;
+      return true;
+    }
+
+    // called from its own expiry
+    if(std::this_thread::get_id() == m_threadId)
+      return false;
+
+    while(m_running == t)
+      m_done.wait(lock);
+
+    return false;
+  }
+
+private:
+  TimerWheel()
+  {
+    for(auto& level : m_slots)
+      for(auto& slot : level)
+        slot.m_prev = slot.m_next = &slot;
+
+    m_expired.m_prev = m_expired.m_next = &m_expired;
+    m_current = nowTicks();
+
+    std::thread thread([this] () { run(); });
+    m_threadId = thread.get_id();
+    thread.detach();
+  }
+
+  static void link(Timer* head, Timer* t)
+  {
+    t->m_prev = head->m_prev;
+    t->m_next = head;
+    head->m_prev->m_next = t;
+    head->m_prev = t;
+  }
+
+  void unlink(Timer* t)
+  {
+    t->m_prev->m_next = t->m_next;
+    t->m_next->m_prev = t->m_prev;
+    t->m_prev = t->m_next = nullptr;
+    m_count--;
+  }
+
+  // in the slot of the lowest level whose range covers the delay
+  void insert(Timer* t)
+  {
+    m_count++;
+
+    if(t->m_expiry <= m_current)
+    {
+      link(&m_expired, t);
+      return;
+    }
+
+    auto const delay = t->m_expiry - m_current;
+    int level = 0;
+
+    while(level < Levels - 1 && delay >= ((uint64_t)1 << (SlotBits * (level + 1))))
+      level++;
+
+    auto const slot = (t->m_expiry >> (SlotBits * level)) & (Slots - 1);
+    link(&m_slots[level][slot], t);
+  }
+
+  // moves all the timers of 'head' to 'dst'
+  static void splice(Timer* head, Timer* dst)
+  {
+    if(head->m_next == head)
+      return;
+
+    auto first = head->m_next;
+    auto last = head->m_prev;
+
+    first->m_prev = dst->m_prev;
+    dst->m_prev->m_next = first;
+    last->m_next = dst;
+    dst->m_prev = last;
+
+    head->m_prev = head->m_next = head;
+  }
+
+  void advance()
+  {
+    m_current++;
+
+    // a lower level wrapped around: spread the next slot of the upper one
+    for(int level = 1; level < Levels; ++level)
+    {
+      if(m_current & (((uint64_t)1 << (SlotBits * level)) - 1))
+        break;
+
+      Timer cascading;
+      cascading.m_prev = cascading.m_next = &cascading;
+      splice(&m_slots[level][(m_current >> (SlotBits * level)) & (Slots - 1)], &cascading);
+
+      while(cascading.m_next != &cascading)
+      {
+        auto t = cascading.m_next;
+        unlink(t);
+        insert(t);
+      }
+    }
+
+    splice(&m_slots[0][m_current & (Slots - 1)], &m_expired);
+  }
+
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while(1)
+    {
+      if(m_count == 0)
+      {
+        m_wakeUp.wait(lock);
+        continue;
+      }
+
+      auto const now = nowTicks();
+
+      while(m_current < now)
+        advance();
+
+      // the expiries run without the lock: they can arm timers
+      while(m_expired.m_next != &m_expired)
+      {
+        auto t = m_expired.m_next;
+        unlink(t);
+
+        auto onExpiry = std::move(t->m_onExpiry);
+        t->m_onExpiry = nullptr;
+        m_running = t;
+
+        lock.unlock();
+        onExpiry();
+        lock.lock();
+
+        m_running = nullptr;
+        m_done.notify_all();
+      }
+
+      m_wakeUp.wait_until(lock, timeOfTick(m_current + 1));
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_wakeUp; // the first timer was armed
+  std::condition_variable m_done; // an expiry returned
+  std::thread::id m_threadId;
+
+  Timer m_slots[Levels][Slots]; // list heads
+  Timer m_expired; // list head: waiting for their expiry to run
+  uint64_t m_current = 0; // in ticks
+  int64_t m_count = 0; // armed timers, including the expired ones
+  Timer* m_running = nullptr; // whose expiry is running
+};
+
+Timer::~Timer()
+{
+  if(m_used)
+    cancel();
+}
+
+void Timer::arm(int delay_ms, std::function<void()> onExpiry)
+{
+  m_used = true;
+  TimerWheel::instance().arm(this, delay_ms, std::move(onExpiry));
+}
+
+bool Timer::cancel()
+{
+  return TimerWheel::instance().cancel(this);
+}
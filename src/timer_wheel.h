@@ -0,0 +1,43 @@
+#pragma once
+
+// Timers for the connections: request deadlines, idle keep-alive, write
+// deadlines, long polling.
+//
+// All the timers live in one hierarchical timing wheel, driven by a single
+// thread: 4 levels of 64 slots, 10ms per tick on the first level. Arming and
+// cancelling a timer are O(1) (unlink/link in a slot). Each tick, the timers
+// of the current slot expire as a batch, and the timers of the upper levels
+// cascade down when the lower level wraps around: the cost per tick doesn't
+// grow with the number of armed timers.
+
+#include <cstdint>
+#include <functional>
+
+struct Timer
+{
+  Timer() = default;
+  ~Timer(); // cancels
+
+  Timer(Timer const &) = delete;
+  Timer & operator = (Timer const &) = delete;
+
+  // (Re)arms the timer: 'onExpiry' will be called from the timer thread, in
+  // 'delay_ms' (rounded up to the next tick, capped to ~46 hours).
+  // 'onExpiry' must return quickly, e.g. call IStream::abort().
+  void arm(int delay_ms, std::function<void()> onExpiry);
+
+  // Disarms the timer. If 'onExpiry' is running, waits for it to return.
+  // Returns false if the timer wasn't armed anymore (e.g. it expired).
+  bool cancel();
+
+private:
+  friend struct TimerWheel;
+
+  // links in the slot (or the expired list) the timer is in
+  Timer* m_prev = nullptr;
+  Timer* m_next = nullptr;
+
+  uint64_t m_expiry = 0; // in ticks
+  std::function<void()> m_onExpiry;
+  bool m_used = false; // was ever armed
+};
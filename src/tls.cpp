@@ -2,8 +2,17 @@
 // TLS wrapper: adds encryption layer, and forwards to httpMain (above)
 
 #include "tcp_server.h" // IStream
+#include "latency.h" // monotonicMicros
+#include "probes.h"
+#include "timer_wheel.h"
+#include <algorithm> // min
+#include <chrono>
+#include <condition_variable>
+#include <cstring> // memcmp
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <string>
 
 #define WIN32_LEAN_AND_MEAN
 #include <openssl/ssl.h>
@@ -12,27 +21,81 @@
 using namespace std;
 
 extern void httpMain(IStream* s);
+extern void http2Main(IStream* s);
+extern int g_headerTimeout_ms;
+extern int g_tlsHandshakeConcurrency;
+
+struct HandshakeSlot;
 
 // Allows OpenSSL to talk to a IStream
 struct BioAdapter
 {
   IStream* tcpStream {};
 
+  // during the handshake: released while waiting for the network
+  HandshakeSlot* slot {};
+
+  // What the stream threw: exceptions can't unwind through OpenSSL, so they
+  // are caught here, and rethrown once the SSL_* call has returned.
+  std::string error;
+
   // SSL wants to read data
   static int staticRead(BIO* bio, char* buf, int size)
   {
     auto pThis = (BioAdapter*)BIO_get_data(bio);
-    return pThis->tcpStream->read((uint8_t*)buf, size);
+    BIO_clear_retry_flags(bio);
+    pThis->releaseSlot();
+    int n;
+
+    try
+    {
+      n = (int)pThis->tcpStream->read((uint8_t*)buf, size);
+    }
+    catch(std::exception const& e)
+    {
+      pThis->error = e.what();
+      return -1;
+    }
+
+    if(n > 0 && !pThis->acquireSlot())
+      return -1;
+
+    return n;
   }
 
   // SSL wants to write data
   static int staticWrite(BIO* bio, const char* buf, int size)
   {
     auto pThis = (BioAdapter*)BIO_get_data(bio);
-    pThis->tcpStream->write((const uint8_t*)buf, size);
+    BIO_clear_retry_flags(bio);
+    pThis->releaseSlot();
+
+    try
+    {
+      pThis->tcpStream->write((const uint8_t*)buf, size);
+    }
+    catch(std::exception const& e)
+    {
+      pThis->error = e.what();
+      return -1;
+    }
+
+    if(!pThis->acquireSlot())
+      return -1;
+
     return size;
   }
 
+  // Rethrows what the stream threw during the last SSL_* call, if anything.
+  void rethrow()
+  {
+    if(!error.empty())
+      throw runtime_error(error);
+  }
+
+  void releaseSlot();
+  bool acquireSlot();
+
   static long staticCtrl(BIO*, int cmd, long, void*)
   {
     switch(cmd)
@@ -44,6 +107,13 @@ struct BioAdapter
     case BIO_CTRL_POP:
       return -1;
 
+#ifdef BIO_CTRL_GET_KTLS_SEND
+    // no kernel TLS through this BIO
+    case BIO_CTRL_GET_KTLS_SEND:
+    case BIO_CTRL_GET_KTLS_RECV:
+      return 0;
+#endif
+
     default:
       fprintf(stderr, "BioAdapter: unhandled BIO_CTRL: %d\n", cmd);
       return 0;
@@ -57,21 +127,39 @@ struct StreamAdapter : IStream
   StreamAdapter(int long_poll_timeout_ms) : IStream(long_poll_timeout_ms) {}
 
   SSL* sslStream;
-
-  // HTTP wants to write data
+  IStream* tcpStream;
+  BioAdapter* bioAdapter;
+
+  // HTTP wants to write data.
+  // Record sizing: the start of a response goes in records that fit in one
+  // TCP segment, so the client can decrypt the first bytes as soon as they
+  // arrive, instead of waiting for a whole 16KB record. Once the response
+  // has grown, full-size records cost less per byte.
   void write(const uint8_t* data, size_t len) override
   {
-    auto remaining = (int)len;
+    auto const now = monotonicMicros();
 
-    while(remaining > 0)
+    // an idle connection starts over with small records (new response)
+    if(now - m_lastWrite > RecordResetIdle_us)
+      m_sentSinceIdle = 0;
+
+    m_lastWrite = now;
+
+    while(len > 0)
     {
-      auto writtenBytes = SSL_write(sslStream, data, remaining);
+      auto const recordSize = m_sentSinceIdle < SmallRecordsBytes ? SmallRecordSize : FullRecordSize;
+      auto const size = (int)std::min<size_t>(len, recordSize);
+      auto writtenBytes = SSL_write(sslStream, data, size);
 
-      if(writtenBytes < 0)
+      if(writtenBytes <= 0)
+      {
+        bioAdapter->rethrow();
         throw runtime_error("SSL write error");
+      }
 
-      remaining -= writtenBytes;
+      len -= writtenBytes;
       data += writtenBytes;
+      m_sentSinceIdle += writtenBytes;
     }
   }
 
@@ -84,57 +172,213 @@ struct StreamAdapter : IStream
     {
       auto readBytes = SSL_read(sslStream, data, remaining);
 
+      if(readBytes <= 0)
+        bioAdapter->rethrow();
+
       if(readBytes < 0)
         throw runtime_error("SSL read error");
 
+      if(readBytes == 0)
+        break; // connection closed
+
       remaining -= readBytes;
       data += readBytes;
     }
 
-    return len;
+    return len - remaining;
   }
+
+  void abort() override
+  {
+    tcpStream->abort();
+  }
+
+  void applyProfile(SocketProfile const& profile) override
+  {
+    tcpStream->applyProfile(profile);
+  }
+
+  bool waitReadable(int timeout_ms) override
+  {
+    // already decrypted
+    if(SSL_pending(sslStream) > 0)
+      return true;
+
+    return tcpStream->waitReadable(timeout_ms);
+  }
+
+  void wakeUp() override
+  {
+    tcpStream->wakeUp();
+  }
+
+  // a TCP segment, minus the IP/TCP headers and the TLS record overhead
+  static const size_t SmallRecordSize = 1400 - 40 - 29;
+  static const size_t FullRecordSize = 16 * 1024;
+  static const size_t SmallRecordsBytes = 64 * 1024;
+  static const int64_t RecordResetIdle_us = 1000 * 1000;
+
+  int64_t m_lastWrite = 0; // monotonicMicros()
+  size_t m_sentSinceIdle = 0;
 };
 
-void tlsMain(IStream* tcpStream)
+// Picks "h2" if the client offers it, otherwise lets the handshake go on
+// without ALPN (HTTP/1.1).
+static int selectProtocol(SSL*, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void*)
 {
-  auto ctx = std::shared_ptr<SSL_CTX>(SSL_CTX_new(TLS_server_method()), &SSL_CTX_free);
+  static const unsigned char h2[] = { 2, 'h', '2' };
+
+  if(SSL_select_next_proto((unsigned char**)out, outlen, h2, sizeof h2, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+
+  return SSL_TLSEXT_ERR_OK;
+}
 
-  if(!ctx)
+// The certificate, the key, and the session cache are loaded/shared once for
+// all the connections.
+struct TlsContext
+{
+  TlsContext()
   {
-    perror("Unable to create SSL context");
-    throw runtime_error("Unable to create SSL context");
+    ctx = std::shared_ptr<SSL_CTX>(SSL_CTX_new(TLS_server_method()), &SSL_CTX_free);
+
+    if(!ctx)
+    {
+      perror("Unable to create SSL context");
+      throw runtime_error("Unable to create SSL context");
+    }
+
+    SSL_CTX_set_ecdh_auto(ctx.get(), 1);
+
+    // Set certification
+    if(SSL_CTX_use_certificate_file(ctx.get(), "cert.pem", SSL_FILETYPE_PEM) <= 0)
+    {
+      ERR_print_errors_fp(stderr);
+      throw runtime_error("TLS: can't load certificate 'cert.pem'");
+    }
+
+    // Set private key
+    if(SSL_CTX_use_PrivateKey_file(ctx.get(), "key.pem", SSL_FILETYPE_PEM) <= 0)
+    {
+      ERR_print_errors_fp(stderr);
+      throw runtime_error("TLS: can't load private key 'key.pem'");
+    }
+
+#ifndef _WIN32
+    // HTTP/2 needs waitReadable(), which isn't implemented on Windows
+    SSL_CTX_set_alpn_select_cb(ctx.get(), &selectProtocol, nullptr);
+#endif
+
+    biom = std::shared_ptr<BIO_METHOD>(BIO_meth_new(1234, "MyStream"), &BIO_meth_free);
+
+    if(!biom)
+    {
+      ERR_print_errors_fp(stderr);
+      throw runtime_error("TLS: can't create custom BIO method");
+    }
+
+    BIO_meth_set_read(biom.get(), &BioAdapter::staticRead);
+    BIO_meth_set_write(biom.get(), &BioAdapter::staticWrite);
+    BIO_meth_set_ctrl(biom.get(), &BioAdapter::staticCtrl);
   }
 
-  SSL_CTX_set_ecdh_auto(ctx.get(), 1);
+  std::shared_ptr<SSL_CTX> ctx;
+  std::shared_ptr<BIO_METHOD> biom;
+};
+
+static TlsContext& tlsContext()
+{
+  // retried by the next connection if it throws
+  static TlsContext context;
+  return context;
+}
+
+// The handshake stage: at most 'g_tlsHandshakeConcurrency' handshakes
+// compute at once (0: no limit), the other connections wait for a slot, so a
+// reconnection storm can't take the CPU away from the streams already
+// established.
+// Only the CPU work is counted: the slot is released while the handshake
+// waits for the network (see BioAdapter), so slow or stalling clients can't
+// hold the slots. Waiting for a slot gives up at 'deadline'.
+struct HandshakeSlot
+{
+  HandshakeSlot(std::chrono::steady_clock::time_point deadline_) : deadline(deadline_) {}
 
-  // Set certification
-  if(SSL_CTX_use_certificate_file(ctx.get(), "cert.pem", SSL_FILETYPE_PEM) <= 0)
+  ~HandshakeSlot()
   {
-    ERR_print_errors_fp(stderr);
-    throw runtime_error("TLS: can't load certificate 'cert.pem'");
+    release();
   }
 
-  // Set private key
-  if(SSL_CTX_use_PrivateKey_file(ctx.get(), "key.pem", SSL_FILETYPE_PEM) <= 0)
+  HandshakeSlot(HandshakeSlot const &) = delete;
+  HandshakeSlot & operator = (HandshakeSlot const &) = delete;
+
+  // Returns false if no slot was available before the deadline.
+  bool acquire()
   {
-    ERR_print_errors_fp(stderr);
-    throw runtime_error("TLS: can't load private key 'key.pem'");
-  }
+    if(!g_tlsHandshakeConcurrency || held)
+      return true;
 
-  auto ssl = std::shared_ptr<SSL>(SSL_new(ctx.get()), &SSL_free);
-  auto biom = std::shared_ptr<BIO_METHOD>(BIO_meth_new(1234, "MyStream"), &BIO_meth_free);
+    auto const start = monotonicMicros();
+    std::unique_lock<std::mutex> lock(mutex);
 
-  if(!biom)
+    while(running >= g_tlsHandshakeConcurrency)
+    {
+      if(!g_headerTimeout_ms)
+        released.wait(lock);
+      else if(released.wait_until(lock, deadline) == std::cv_status::timeout && running >= g_tlsHandshakeConcurrency)
+        return false;
+    }
+
+    running++;
+    held = true;
+    queued_us += monotonicMicros() - start;
+    return true;
+  }
+
+  void release()
   {
-    ERR_print_errors_fp(stderr);
-    throw runtime_error("TLS: can't create custom BIO method");
+    if(!held)
+      return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    running--;
+    held = false;
+    released.notify_one();
   }
 
-  BIO_meth_set_read(biom.get(), &BioAdapter::staticRead);
-  BIO_meth_set_write(biom.get(), &BioAdapter::staticWrite);
-  BIO_meth_set_ctrl(biom.get(), &BioAdapter::staticCtrl);
+  const std::chrono::steady_clock::time_point deadline;
+  bool held = false;
+  int64_t queued_us = 0; // total time spent waiting for a slot
+
+  static std::mutex mutex;
+  static std::condition_variable released;
+  static int running;
+};
 
-  auto bio = BIO_new(biom.get());
+std::mutex HandshakeSlot::mutex;
+std::condition_variable HandshakeSlot::released;
+int HandshakeSlot::running;
+
+void BioAdapter::releaseSlot()
+{
+  if(slot)
+    slot->release();
+}
+
+bool BioAdapter::acquireSlot()
+{
+  if(!slot || slot->acquire())
+    return true;
+
+  DbgTrace("event=connection_timeout phase=handshake_queue\n");
+  return false;
+}
+
+void tlsMain(IStream* tcpStream)
+{
+  auto& context = tlsContext();
+  auto ssl = std::shared_ptr<SSL>(SSL_new(context.ctx.get()), &SSL_free);
+  auto bio = BIO_new(context.biom.get());
 
   if(!bio)
   {
@@ -142,21 +386,60 @@ void tlsMain(IStream* tcpStream)
     throw runtime_error("TLS: can't create new BIO");
   }
 
-  StreamAdapter streamAdapter(tcpStream->long_poll_timeout_ms);
-  streamAdapter.sslStream = ssl.get();
-
   BioAdapter bioAdapter {};
   bioAdapter.tcpStream = tcpStream;
 
+  StreamAdapter streamAdapter(tcpStream->long_poll_timeout_ms);
+  streamAdapter.sslStream = ssl.get();
+  streamAdapter.tcpStream = tcpStream;
+  streamAdapter.bioAdapter = &bioAdapter;
+
   BIO_set_data(bio, &bioAdapter);
   BIO_set_init(bio, 1);
 
   SSL_set_bio(ssl.get(), bio, bio);
 
-  int ret = SSL_accept(ssl.get());
+  // a client stalling the handshake (or waiting for a slot) doesn't hold the thread
+  Timer handshakeDeadline;
+
+  if(g_headerTimeout_ms)
+  {
+    auto onExpiry = [tcpStream] ()
+      {
+        DbgTrace("event=connection_timeout phase=handshake\n");
+        tcpStream->abort();
+      };
+
+    handshakeDeadline.arm(g_headerTimeout_ms, onExpiry);
+  }
+
+  auto const start = monotonicMicros();
+  int ret;
+  int64_t queued_us;
+
+  {
+    // acquired once the ClientHello has arrived
+    HandshakeSlot slot(std::chrono::steady_clock::now() + std::chrono::milliseconds(g_headerTimeout_ms));
+    bioAdapter.slot = &slot;
+
+    PROBE(tls_handshake_begin);
+    ret = SSL_accept(ssl.get());
+    PROBE2(tls_handshake_end, monotonicMicros() - start - slot.queued_us, SSL_session_reused(ssl.get()));
+
+    bioAdapter.slot = nullptr;
+    queued_us = slot.queued_us;
+  }
+
+  if(g_headerTimeout_ms)
+    handshakeDeadline.cancel();
+
+  auto const end = monotonicMicros();
+  DbgTrace("event=tls_handshake queued_us=%lld duration_us=%lld resumed=%s\n",
+           (long long)queued_us, (long long)(end - start - queued_us), SSL_session_reused(ssl.get()) ? "true" : "false");
 
   if(ret <= 0)
   {
+    bioAdapter.rethrow();
     ERR_print_errors_fp(stderr);
     fprintf(stderr, "SSL_accept failed: %d '%d'\n",
             ret,
@@ -166,6 +449,13 @@ void tlsMain(IStream* tcpStream)
     throw runtime_error("TLS: can't accept connection");
   }
 
-  httpMain(&streamAdapter);
+  const unsigned char* protocol = nullptr;
+  unsigned int protocolLength = 0;
+  SSL_get0_alpn_selected(ssl.get(), &protocol, &protocolLength);
+
+  if(protocolLength == 2 && memcmp(protocol, "h2", 2) == 0)
+    http2Main(&streamAdapter);
+  else
+    httpMain(&streamAdapter);
 }
 
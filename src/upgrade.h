@@ -0,0 +1,69 @@
+#pragma once
+
+// Zero-downtime upgrades: a new relay process takes over from a running one,
+// without dropping connections nor losing the resource store.
+//
+// The running relay listens on a unix-domain SOCK_SEQPACKET socket. When its
+// successor connects, the old relay sends, one message each, in order:
+// - every complete resource, its data in an attached file: the spill file
+//   (see spill.h) if the resource was spilled, a memfd otherwise,
+// - its listening TCP socket (SCM_RIGHTS), once it has stopped accepting:
+//   from then on, the successor accepts the new connections (meanwhile,
+//   they wait in the listen backlog). The successor acknowledges it with the
+//   same message, without the socket. Without acknowledgement, the old relay
+//   accepts connections again, and waits for another successor.
+// - the uploads still in progress (or arriving on the connections it's still
+//   serving), forwarded chunk by chunk as they arrive.
+// The resources deleted from the old relay meanwhile are deleted from the
+// successor too.
+// The old relay then drains its in-flight requests, and exits, which closes
+// the connection.
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+struct Resource;
+
+enum UpgradeOp : uint32_t
+{
+  Upgrade_Resource = 1, // complete resource, with an attached file
+  Upgrade_Listen = 2, // with the attached listening socket
+  Upgrade_Begin = 3,
+  Upgrade_Append = 4, // followed by the data
+  Upgrade_End = 5,
+  Upgrade_Delete = 6,
+};
+
+struct UpgradeHeader
+{
+  uint32_t op; // UpgradeOp
+  uint32_t urlLength; // the URL follows the header
+  uint64_t length; // Upgrade_Resource: size of the data
+  uint64_t offset; // Upgrade_Resource: where the data starts in the attached file
+};
+
+// Successor side: takes over from the relay listening on 'path'.
+// The complete resources are passed to 'restore'.
+// Returns the listening socket, or -1 if no relay is listening on 'path'.
+// Throws if the takeover fails midway: the running relay keeps serving.
+// The forwarded uploads keep arriving in the background.
+int takeOver(const char* path, std::function<void(const std::string& url, std::shared_ptr<Resource> res)> restore);
+
+// Running relay side: listens on 'path' (replacing any stale socket file)
+// for a successor, and hands it the resources and 'listenFd'.
+// 'stopAccepting' is called before the listening socket is sent, and must
+// return once no more connections are accepted from it. Then 'handedOver'
+// is called with whether the successor took the listening socket over: if
+// not, connections must be accepted again.
+// Throws if the socket can't be set up.
+void startUpgradeListener(const char* path, int listenFd, std::function<void()> stopAccepting, std::function<void(bool)> handedOver);
+
+// Running relay side: forwards the deletion of 'url' to the successor, if a
+// hand over is in progress.
+void handOverDeletion(const std::string& url);
+
+// Waits (at most 'timeout_ms') for the forwarded uploads to complete,
+// and closes the connection to the successor.
+void finishHandOver(int timeout_ms);
@@ -0,0 +1,627 @@
+#include "upgrade.h"
+#include "resource.h"
+#include "spill.h" // trackMapping
+#include "tcp_server.h" // DbgTrace
+
+#include <algorithm> // min
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint> // INT64_MAX
+#include <cstdio> // perror
+#include <cstring> // memcpy, strlen
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// OS-specific
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h> // close, unlink, write
+
+namespace
+{
+// Forwarded appends are split into messages of at most this size.
+const size_t MaxInlineSize = 128 * 1024;
+
+// A read-only mapping of a memfd or spill file received from the old relay.
+struct MappedRegion : SpilledData
+{
+  ~MappedRegion()
+  {
+    if(base)
+    {
+      munmap(base, mappedSize);
+      trackMapping(-1);
+    }
+  }
+
+  void* base = nullptr;
+  size_t mappedSize = 0;
+};
+
+bool makeAddress(const char* path, sockaddr_un& address)
+{
+  address = sockaddr_un {};
+  address.sun_family = AF_UNIX;
+
+  if(strlen(path) >= sizeof address.sun_path)
+    return false;
+
+  strcpy(address.sun_path, path);
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// old relay side
+/////////////////////////////////////////////////////////////////////////////
+
+int g_successor = -1; // guarded by g_sendMutex
+std::mutex g_sendMutex;
+
+std::atomic<bool> g_finishing { false };
+std::atomic<bool> g_scanDone { false }; // no more uploads to forward
+std::atomic<int> g_forwarding { 0 }; // uploads being forwarded
+
+// How long the old relay waits for the successor to acknowledge the
+// listening socket.
+const int ListenAckTimeout_ms = 5000;
+
+// Sends a message to the successor.
+// If 'current' is set, the message is only sent if 'current' is still the
+// resource of 'url': otherwise, it was republished or deleted, and the
+// successor gets the newer version, or the deletion, instead. Checked under
+// the send lock, so a later deletion can't overtake the message.
+bool sendMessage(UpgradeOp op, const string& url, const uint8_t* data, size_t len, int attachedFd, const Resource* current = nullptr, uint64_t length = 0, uint64_t offset = 0)
+{
+  UpgradeHeader hdr {};
+  hdr.op = op;
+  hdr.urlLength = url.size();
+  hdr.length = length;
+  hdr.offset = offset;
+
+  iovec iov[3];
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof hdr;
+  iov[1].iov_base = (void*)url.data();
+  iov[1].iov_len = url.size();
+  iov[2].iov_base = (void*)data;
+  iov[2].iov_len = len;
+
+  char control[CMSG_SPACE(sizeof(int))] {};
+
+  msghdr mh {};
+  mh.msg_iov = iov;
+  mh.msg_iovlen = 3;
+
+  if(attachedFd >= 0)
+  {
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof control;
+
+    auto cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &attachedFd, sizeof attachedFd);
+  }
+
+  std::unique_lock<std::mutex> lock(g_sendMutex);
+
+  if(g_successor < 0)
+    return false;
+
+  if(current && getResource(url).get() != current)
+    return true;
+
+  return sendmsg(g_successor, &mh, MSG_NOSIGNAL) >= 0;
+}
+
+// Sends a complete resource. A spilled one is passed as its spill file,
+// the data of the others is copied to a memfd.
+bool sendComplete(const string& url, std::shared_ptr<Resource> res)
+{
+  if(auto spilled = res->spilled())
+  {
+    uint64_t offset = 0;
+    int fd = spilled->openFile(offset);
+
+    if(fd >= 0)
+    {
+      auto ok = sendMessage(Upgrade_Resource, url, nullptr, 0, fd, res.get(), spilled->size, offset);
+      close(fd);
+      return ok;
+    }
+  }
+
+  int fd = memfd_create("lldash-relay-upgrade", MFD_CLOEXEC);
+
+  if(fd < 0)
+  {
+    perror("memfd_create");
+    return false;
+  }
+
+  bool ok = true;
+  uint64_t size = 0;
+
+  auto copy = [&] (const uint8_t* data, size_t len)
+    {
+      while(ok && len > 0)
+      {
+        auto n = ::write(fd, data, len);
+
+        if(n < 0 && errno == EINTR)
+          continue;
+
+        if(n <= 0)
+        {
+          ok = false;
+          break;
+        }
+
+        data += n;
+        len -= n;
+        size += n;
+      }
+    };
+
+  // complete: doesn't block
+  res->sendWhole(copy, INT64_MAX);
+
+  ok = ok && sendMessage(Upgrade_Resource, url, nullptr, 0, fd, res.get(), size);
+  close(fd);
+
+  return ok;
+}
+
+// Forwards an upload in progress, as it arrives.
+void forwardUpload(string url, std::shared_ptr<Resource> res)
+{
+  bool ok = sendMessage(Upgrade_Begin, url, nullptr, 0, -1, res.get());
+
+  auto append = [&] (const uint8_t* data, size_t len)
+    {
+      while(ok && len > 0)
+      {
+        auto const n = std::min(len, MaxInlineSize);
+        ok = sendMessage(Upgrade_Append, url, data, n, -1);
+        data += n;
+        len -= n;
+      }
+    };
+
+  res->sendWhole(append, INT64_MAX);
+
+  if(ok)
+    sendMessage(Upgrade_End, url, nullptr, 0, -1);
+
+  g_forwarding--;
+}
+
+// Waits for the successor to acknowledge the listening socket.
+bool waitListenAck(int successor)
+{
+  pollfd pfd { successor, POLLIN, 0 };
+
+  if(poll(&pfd, 1, ListenAckTimeout_ms) <= 0)
+    return false;
+
+  UpgradeHeader ack;
+  return recv(successor, &ack, sizeof ack, 0) == sizeof ack && ack.op == Upgrade_Listen;
+}
+
+// Returns false if the successor didn't take over the listening socket.
+bool handOver(int successor, int listenFd, std::function<void()> stopAccepting, std::function<void(bool)> handedOver)
+{
+  {
+    std::unique_lock<std::mutex> lock(g_sendMutex);
+    g_successor = successor;
+  }
+
+  std::set<std::shared_ptr<Resource>> forwarded;
+  int count = 0;
+
+  auto forward = [&] ()
+    {
+      for(auto& entry : listResources())
+      {
+        auto& res = entry.second;
+
+        if(!forwarded.insert(res).second)
+          continue;
+
+        if(res->completedAt() != 0)
+        {
+          if(sendComplete(entry.first, res))
+            count++;
+        }
+        else
+        {
+          g_forwarding++;
+          thread(forwardUpload, entry.first, res).detach();
+        }
+      }
+    };
+
+  // the complete resources go first: they're there before the successor
+  // gets its first request.
+  for(auto& entry : listResources())
+  {
+    if(entry.second->completedAt() != 0 && forwarded.insert(entry.second).second)
+      if(sendComplete(entry.first, entry.second))
+        count++;
+  }
+
+  // the connections arriving meanwhile wait in the backlog
+  stopAccepting();
+
+  if(!sendMessage(Upgrade_Listen, string(), nullptr, 0, listenFd) || !waitListenAck(successor))
+  {
+    DbgTrace("event=upgrade_failed reason=no_takeover\n");
+
+    {
+      std::unique_lock<std::mutex> lock(g_sendMutex);
+      g_successor = -1;
+    }
+
+    close(successor);
+    handedOver(false);
+    return false;
+  }
+
+  handedOver(true);
+  DbgTrace("event=upgrade_handed_over resources=%d\n", count);
+
+  // uploads in progress, or arriving on the connections still being served
+  while(1)
+  {
+    auto const last = g_finishing.load();
+    forward();
+
+    if(last)
+      break;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  g_scanDone = true;
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// successor side
+/////////////////////////////////////////////////////////////////////////////
+
+struct Receiver
+{
+  Receiver(int fd_, std::function<void(const std::string& url, std::shared_ptr<Resource> res)> restore_)
+    : fd(fd_), restore(restore_)
+  {
+    msg.resize(sizeof(UpgradeHeader) + 64 * 1024 + MaxInlineSize);
+  }
+
+  ~Receiver()
+  {
+    // don't leave readers blocked on an upload that won't complete,
+    // nor publish what was received of it
+    for(auto& upload : uploads)
+    {
+      upload.second->resAbort();
+      discardResource(upload.first, upload.second);
+      DbgTrace("event=upgrade_upload_discarded url=%s\n", upload.first.c_str());
+    }
+
+    close(fd);
+  }
+
+  // Returns false once the connection is closed.
+  // Sets 'listenFd' on Upgrade_Listen.
+  bool receiveOne(int& listenFd)
+  {
+    iovec iov;
+    iov.iov_base = msg.data();
+    iov.iov_len = msg.size();
+
+    char control[CMSG_SPACE(sizeof(int))];
+
+    msghdr mh {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof control;
+
+    auto n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+
+    if(n <= 0)
+      return false;
+
+    int attachedFd = -1;
+
+    for(auto cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+    {
+      if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&attachedFd, CMSG_DATA(cmsg), sizeof attachedFd);
+    }
+
+    UpgradeHeader hdr;
+
+    if((size_t)n < sizeof hdr || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+    {
+      if(attachedFd >= 0)
+        close(attachedFd);
+
+      return false;
+    }
+
+    memcpy(&hdr, msg.data(), sizeof hdr);
+
+    if(hdr.urlLength > n - sizeof hdr)
+      return false;
+
+    string url((const char*)msg.data() + sizeof hdr, hdr.urlLength);
+    auto const payload = msg.data() + sizeof hdr + hdr.urlLength;
+    auto const payloadLength = n - sizeof hdr - hdr.urlLength;
+
+    switch(hdr.op)
+    {
+    case Upgrade_Listen:
+      listenFd = attachedFd;
+      break;
+
+    case Upgrade_Resource:
+      {
+        auto data = mapRegion(attachedFd, hdr.offset, hdr.length);
+
+        if(attachedFd >= 0)
+          close(attachedFd);
+
+        if(!data)
+          break;
+
+        auto res = make_shared<Resource>(url);
+        res->restore(data);
+        restore(url, res);
+        break;
+      }
+
+    case Upgrade_Begin:
+      {
+        auto& res = uploads[url];
+
+        if(res)
+          res->resEnd();
+
+        res = createResource(url);
+        res->resBegin();
+        break;
+      }
+
+    case Upgrade_Append:
+      {
+        auto i_upload = uploads.find(url);
+
+        if(i_upload != uploads.end())
+          i_upload->second->resAppend(payload, payloadLength);
+
+        break;
+      }
+
+    case Upgrade_End:
+      {
+        auto i_upload = uploads.find(url);
+
+        if(i_upload != uploads.end())
+        {
+          i_upload->second->resEnd();
+          uploads.erase(i_upload);
+          DbgTrace("event=upgrade_upload_received url=%s\n", url.c_str());
+        }
+
+        break;
+      }
+
+    case Upgrade_Delete:
+      {
+        auto i_upload = uploads.find(url);
+
+        if(i_upload != uploads.end())
+        {
+          i_upload->second->resEnd();
+          uploads.erase(i_upload);
+        }
+
+        deleteResource(url);
+        DbgTrace("event=upgrade_resource_deleted url=%s\n", url.c_str());
+        break;
+      }
+
+    default:
+      if(attachedFd >= 0)
+        close(attachedFd);
+
+      break;
+    }
+
+    return true;
+  }
+
+private:
+  // Maps the data at 'offset' in the file 'fd'.
+  static std::shared_ptr<const SpilledData> mapRegion(int fd, uint64_t offset, uint64_t length)
+  {
+    if(length == 0)
+      return make_shared<SpilledData>();
+
+    if(fd < 0 || offset + length < offset)
+      return nullptr;
+
+    // the offset of a spill file isn't page-aligned: map from the start
+    auto p = mmap(nullptr, offset + length, PROT_READ, MAP_SHARED, fd, 0);
+
+    if(p == MAP_FAILED)
+      return nullptr;
+
+    auto region = make_shared<MappedRegion>();
+    region->base = p;
+    trackMapping(1);
+    region->mappedSize = offset + length;
+    region->data = (const uint8_t*)p + offset;
+    region->size = length;
+    return region;
+  }
+
+  const int fd;
+  std::function<void(const std::string& url, std::shared_ptr<Resource> res)> restore;
+  PooledBuffer msg;
+  std::map<std::string, std::shared_ptr<Resource>> uploads;
+};
+}
+
+int takeOver(const char* path, std::function<void(const std::string& url, std::shared_ptr<Resource> res)> restore)
+{
+  sockaddr_un address;
+
+  if(!makeAddress(path, address))
+    throw runtime_error("upgrade socket path is too long");
+
+  const int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+  if(sock < 0)
+  {
+    perror("socket");
+    throw runtime_error("can't create upgrade socket");
+  }
+
+  // nobody to take over from: first start
+  if(connect(sock, (sockaddr*)&address, sizeof address) < 0)
+  {
+    close(sock);
+    return -1;
+  }
+
+  DbgTrace("event=upgrade_takeover_started path=%s\n", path);
+
+  auto receiver = make_shared<Receiver>(sock, restore);
+  int listenFd = -1;
+
+  while(listenFd < 0)
+  {
+    if(!receiver->receiveOne(listenFd))
+    {
+      DbgTrace("event=upgrade_failed reason=disconnected\n");
+      throw runtime_error("the upgrade failed, the running relay keeps serving");
+    }
+  }
+
+  UpgradeHeader ack {};
+  ack.op = Upgrade_Listen;
+
+  if(::send(sock, &ack, sizeof ack, MSG_NOSIGNAL) != sizeof ack)
+  {
+    close(listenFd);
+    DbgTrace("event=upgrade_failed reason=disconnected\n");
+    throw runtime_error("the upgrade failed, the running relay keeps serving");
+  }
+
+  DbgTrace("event=upgrade_takeover_completed\n");
+
+  auto receiveUploads = [receiver] ()
+    {
+      int unused = -1;
+
+      while(receiver->receiveOne(unused))
+      {
+      }
+
+      DbgTrace("event=upgrade_previous_relay_exited\n");
+    };
+
+  thread(receiveUploads).detach();
+
+  return listenFd;
+}
+
+void startUpgradeListener(const char* path, int listenFd, std::function<void()> stopAccepting, std::function<void(bool)> handedOver)
+{
+  sockaddr_un address;
+
+  if(!makeAddress(path, address))
+    throw runtime_error("upgrade socket path is too long");
+
+  const int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+  if(sock < 0)
+  {
+    perror("socket");
+    throw runtime_error("can't create upgrade socket");
+  }
+
+  unlink(path);
+
+  if(::bind(sock, (sockaddr*)&address, sizeof address) < 0)
+  {
+    perror("bind");
+    throw runtime_error("Can't bind upgrade socket");
+  }
+
+  if(listen(sock, 1) < 0)
+  {
+    perror("listen");
+    throw runtime_error("Can't listen on upgrade socket");
+  }
+
+  DbgTrace("event=upgrade_listening path=%s\n", path);
+
+  auto acceptThread = [sock, listenFd, stopAccepting, handedOver] ()
+    {
+      while(1)
+      {
+        int successor = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+
+        if(successor < 0)
+        {
+          if(errno == EINTR || errno == ECONNABORTED)
+            continue;
+
+          perror("accept");
+          return;
+        }
+
+        DbgTrace("event=upgrade_successor_connected\n");
+
+        // only one successor: the path now belongs to it
+        if(handOver(successor, listenFd, stopAccepting, handedOver))
+          break;
+      }
+
+      close(sock);
+    };
+
+  thread(acceptThread).detach();
+}
+
+void handOverDeletion(const std::string& url)
+{
+  sendMessage(Upgrade_Delete, url, nullptr, 0, -1);
+}
+
+void finishHandOver(int timeout_ms)
+{
+  g_finishing = true;
+
+  auto const deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+  while((!g_scanDone || g_forwarding > 0) && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  std::unique_lock<std::mutex> lock(g_sendMutex);
+  shutdown(g_successor, SHUT_RDWR);
+}
@@ -0,0 +1,319 @@
+#include "upstream.h"
+#include "http.h"
+#include "resource.h"
+#include "tcp_server.h"
+#include "timer_wheel.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio> // snprintf, sscanf
+#include <cstdlib> // atoll
+#include <atomic>
+#include <map>
+#include <memory> // make_unique
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+typedef std::chrono::steady_clock Clock;
+
+string g_host;
+int g_port = 0;
+int g_ttl_ms = 0;
+int g_timeout_ms = 0;
+
+// A pending upstream request: the first reader missing a URL issues it,
+// the others wait for its outcome.
+struct Fetch
+{
+  std::mutex mutex;
+  std::condition_variable done;
+  bool complete = false;
+  std::shared_ptr<Resource> res;
+};
+
+struct Pulled
+{
+  std::weak_ptr<Resource> res;
+  Clock::time_point when;
+};
+
+std::mutex g_upstreamMutex;
+std::map<std::string, std::shared_ptr<Fetch>> g_fetches;
+std::map<std::string, Pulled> g_pulled;
+
+// The connection to the upstream relay: aborted when a read or a write
+// makes no progress for 'g_timeout_ms', so a hung upstream can't block the
+// readers waiting for the pull.
+struct UpstreamStream : IStream
+{
+  UpstreamStream(std::unique_ptr<IStream> s_, string const& url_) : IStream(0), s(std::move(s_)), url(url_) {}
+
+  size_t read(uint8_t* data, size_t len) override
+  {
+    arm();
+    auto const n = s->read(data, len);
+    deadline.cancel();
+    return n;
+  }
+
+  void write(const uint8_t* data, size_t len) override
+  {
+    arm();
+    s->write(data, len);
+    deadline.cancel();
+  }
+
+  void abort() override { s->abort(); }
+
+  void arm()
+  {
+    if(!g_timeout_ms)
+      return;
+
+    auto onExpiry = [this] ()
+      {
+        DbgTrace("event=upstream_timeout url=%s\n", url.c_str());
+        expired = true;
+        s->abort();
+      };
+
+    deadline.arm(g_timeout_ms, onExpiry);
+  }
+
+  const std::unique_ptr<IStream> s;
+  const string url;
+  std::atomic<bool> expired { false };
+  Timer deadline; // last: destroyed first, waits for a running expiry
+};
+
+// Copies the response body into 'res', as it arrives.
+// Returns false if the body was cut short.
+bool pumpBody(UpstreamStream* s, map<string, string>& headers, Resource* res, string const& url)
+{
+  PooledBuffer buffer;
+  long long total = 0;
+
+  if(headers["Transfer-Encoding"] == "chunked")
+  {
+    string sizeLine;
+
+    while(1)
+    {
+      readLine(s, sizeLine);
+
+      int size = 0;
+
+      if(sscanf(sizeLine.c_str(), "%x", &size) != 1 || size < 0)
+        return false;
+
+      if(size > 0)
+      {
+        buffer.resize(size);
+
+        if(s->read(buffer.data(), buffer.size()) != buffer.size())
+          return false;
+
+        res->resAppend(buffer.data(), buffer.size());
+        total += size;
+      }
+
+      uint8_t eol[2];
+      s->read(eol, sizeof eol);
+
+      if(size == 0)
+        break;
+    }
+  }
+  else
+  {
+    auto const hasLength = headers.count("Content-Length") != 0;
+    auto remaining = atoll(headers["Content-Length"].c_str());
+
+    buffer.resize(64 * 1024);
+
+    while(!hasLength || remaining > 0)
+    {
+      size_t len = buffer.size();
+
+      if(hasLength && remaining < (long long)len)
+        len = remaining;
+
+      auto n = s->read(buffer.data(), len);
+
+      if(n == 0)
+      {
+        // without a length, the body ends with the connection
+        if(hasLength || s->expired)
+          return false;
+
+        break;
+      }
+
+      res->resAppend(buffer.data(), n);
+      total += n;
+      remaining -= n;
+    }
+  }
+
+  DbgTrace("event=upstream_pull_completed url=%s size=%lld\n", url.c_str(), total);
+  return true;
+}
+
+// Sends the request, and reads the response head.
+// On success, the resource is created, and its body is filled in the background.
+std::shared_ptr<Resource> fetch(string const& url)
+{
+  DbgTrace("event=upstream_pull url=%s upstream=%s:%d\n", url.c_str(), g_host.c_str(), g_port);
+
+  std::unique_ptr<UpstreamStream> s;
+  map<string, string> headers;
+
+  try
+  {
+    s = make_unique<UpstreamStream>(connectTcp(g_host.c_str(), g_port, g_timeout_ms), url);
+
+    char line[256];
+    writeLine(s.get(), ("GET " + url + " HTTP/1.1").c_str());
+    snprintf(line, sizeof line, "Host: %s:%d", g_host.c_str(), g_port);
+    writeLine(s.get(), line);
+    writeLine(s.get(), "Connection: close");
+    writeLine(s.get(), "");
+
+    auto statusLine = readLine(s.get());
+    string version, status;
+    size_t pos = 0;
+    nextWord(statusLine, pos, version);
+    nextWord(statusLine, pos, status);
+
+    parseHeaders(s.get(), headers);
+
+    if(status != "200")
+    {
+      DbgTrace("event=upstream_miss url=%s status=%s\n", url.c_str(), status.empty() ? "none" : status.c_str());
+      return nullptr;
+    }
+  }
+  catch(std::exception const& e)
+  {
+    DbgTrace("event=upstream_error url=%s error=%s\n", url.c_str(), e.what());
+    return nullptr;
+  }
+
+  auto res = createResource(url);
+  res->resBegin();
+
+  auto pump = [s = std::move(s), headers, res, url] () mutable
+    {
+      bool complete = false;
+
+      try
+      {
+        complete = pumpBody(s.get(), headers, res.get(), url);
+      }
+      catch(std::exception const& e)
+      {
+        DbgTrace("event=upstream_error url=%s error=%s\n", url.c_str(), e.what());
+      }
+
+      // also wakes up the readers of a truncated pull
+      res->resEnd();
+
+      // don't serve (or cache, or spill) a truncated copy
+      if(!complete)
+      {
+        DbgTrace("event=upstream_pull_truncated url=%s\n", url.c_str());
+        discardResource(url, res);
+      }
+    };
+
+  thread(std::move(pump)).detach();
+
+  return res;
+}
+}
+
+void setUpstream(std::string host, int port, int ttl_ms, int timeout_ms)
+{
+  g_host = host;
+  g_port = port;
+  g_ttl_ms = ttl_ms;
+  g_timeout_ms = timeout_ms;
+}
+
+bool hasUpstream()
+{
+  return !g_host.empty();
+}
+
+std::shared_ptr<Resource> pullFromUpstream(const std::string& url, std::shared_ptr<Resource> cached)
+{
+  std::shared_ptr<Fetch> pending;
+  bool leader = false;
+
+  {
+    std::unique_lock<std::mutex> lock(g_upstreamMutex);
+
+    if(cached)
+    {
+      auto i_pulled = g_pulled.find(url);
+
+      // published locally, not ours to refresh
+      if(i_pulled == g_pulled.end() || i_pulled->second.res.lock() != cached)
+        return cached;
+
+      if(g_ttl_ms <= 0 || Clock::now() - i_pulled->second.when < std::chrono::milliseconds(g_ttl_ms))
+        return cached;
+    }
+
+    auto& f = g_fetches[url];
+
+    if(!f)
+    {
+      f = make_shared<Fetch>();
+      leader = true;
+    }
+
+    pending = f;
+  }
+
+  if(leader)
+  {
+    auto res = fetch(url);
+
+    {
+      std::unique_lock<std::mutex> lock(g_upstreamMutex);
+      g_fetches.erase(url);
+
+      if(res)
+      {
+        // forget about the pulled resources that were deleted since
+        if(g_pulled.size() >= 1024)
+        {
+          for(auto i = g_pulled.begin(); i != g_pulled.end();)
+            i = i->second.res.expired() ? g_pulled.erase(i) : std::next(i);
+        }
+
+        g_pulled[url] = Pulled { res, Clock::now() };
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(pending->mutex);
+    pending->res = res;
+    pending->complete = true;
+    pending->done.notify_all();
+  }
+  else
+  {
+    std::unique_lock<std::mutex> lock(pending->mutex);
+
+    while(!pending->complete)
+      pending->done.wait(lock);
+  }
+
+  // if upstream failed, keep serving what we have
+  return pending->res ? pending->res : cached;
+}
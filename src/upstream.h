@@ -0,0 +1,25 @@
+#pragma once
+
+// Origin-pull ("edge") mode: resources missing from the local store are
+// fetched from an upstream relay, and served to local readers while they
+// arrive. This allows building relay trees, each tier multiplying the
+// fan-out capacity of the one above.
+
+#include <memory>
+#include <string>
+
+struct Resource;
+
+// 'ttl_ms': how long a pulled resource is served before being pulled again
+// (e.g. for manifests that get republished). 0 means until it's deleted.
+// 'timeout_ms': how long the upstream relay can stay silent (connecting,
+// before its response, or in the middle of the body) before the pull is
+// given up (0: forever). A pull that doesn't complete is discarded.
+void setUpstream(std::string host, int port, int ttl_ms, int timeout_ms);
+bool hasUpstream();
+
+// Returns the resource to serve for 'url', given the locally 'cached' one
+// (which may be null): either 'cached', or a fresh resource, already in the
+// store, that's being filled from upstream.
+// Concurrent misses on the same URL share a single upstream request.
+std::shared_ptr<Resource> pullFromUpstream(const std::string& url, std::shared_ptr<Resource> cached);
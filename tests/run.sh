@@ -18,6 +18,25 @@ function main
   run_test test_not_found
   run_test test_invalid_method
   run_test test_invalid_port
+  run_test test_io_uring
+  run_test test_local_ingest
+  run_test test_cascade
+  run_test test_upstream_failures
+  run_test test_push
+  run_test test_truncated_upload
+  run_test test_keep_alive
+  run_test test_propagation_latency
+  run_test test_compressed_manifest
+  run_test test_spill
+  run_test test_upgrade
+  run_test test_upgrade_failed
+  run_test test_socket_profile
+  run_test test_http2
+  run_test test_tls_handshakes
+  run_test test_timeouts
+  run_test test_subscription
+  run_test test_egress_scheduler
+  run_test test_request_timing
   run_test test_big_file
 
   echo OK
@@ -156,7 +175,7 @@ function test_big_file
     -H "Transfer-Encoding: chunked" \
     -H "Expect: 100-continue" \
     -X PUT \
-    -d "@$scriptDir/big_file_ref.txt" \
+    --data-binary "@$tmpDir/big_file_ref.txt" \
     http://$host/ThisIsABigFile
 
   curl \
@@ -167,7 +186,7 @@ function test_big_file
   kill -INT $pid
   wait $pid
 
-  compare $scriptDir/big_file_ref.txt $tmpDir/big_file_new.txt
+  compare $tmpDir/big_file_ref.txt $tmpDir/big_file_new.txt
 }
 
 function test_not_found
@@ -231,6 +250,1026 @@ function test_invalid_port
   fi
 }
 
+function test_io_uring
+{
+  local readonly port=18442
+  # falls back to plain sockets if io_uring isn't usable here
+  $BIN/evanescent.exe --port $port --io-uring &
+  local readonly pid=$!
+  local readonly host="127.0.0.1:$port"
+
+  # bigger than all the provided buffers (256 x 16kB), so they get recycled
+  seq 1000000 > $tmpDir/io_uring_ref.txt
+
+  sleep 0.1
+
+  # readers waiting for the resource (long-poll), then a chunked upload
+  local readers=""
+  for i in 1 2 3 ; do
+    curl --silent --fail http://$host/io_uring.txt > $tmpDir/io_uring_$i.txt &
+    readers="$readers $!"
+  done
+
+  sleep 0.1
+
+  curl --silent --fail -X PUT -H "Transfer-Encoding: chunked" --data-binary "@$tmpDir/io_uring_ref.txt" http://$host/io_uring.txt
+  curl --silent --fail http://$host/io_uring.txt > $tmpDir/io_uring_4.txt
+
+  wait $readers
+  kill -INT $pid
+  wait $pid
+
+  for i in 1 2 3 4 ; do
+    compare $tmpDir/io_uring_ref.txt $tmpDir/io_uring_$i.txt
+  done
+}
+
+function test_local_ingest
+{
+  local readonly port=18444
+  local readonly sock=$tmpDir/ingest.sock
+  $BIN/evanescent.exe --port $port --local-ingest $sock &
+  local readonly pid=$!
+  local readonly host="127.0.0.1:$port"
+
+  sleep 0.1
+
+  # publish one resource from a shared region, and one inline
+  python3 - "$sock" "$scriptDir/expected.txt" <<'PYTHON'
+import errno, fcntl, os, socket, struct, sys
+
+s = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+s.connect(sys.argv[1])
+
+def call(op, url, offset=0, length=0, payload=b"", fds=[], expected=0):
+    msg = struct.pack("=IIQQ", op, len(url), offset, length) + url + payload
+    socket.send_fds(s, [msg], fds)
+    status, = struct.unpack("=i", s.recv(4))
+    assert status == expected, status
+
+data = open(sys.argv[2], "rb").read()
+region = os.memfd_create("chunks", os.MFD_ALLOW_SEALING)
+os.write(region, data)
+
+# the producer could shrink an unsealed region under the relay's mapping
+call(1, b"/shared.txt", fds=[region], expected=-errno.EPERM)
+
+fcntl.fcntl(region, fcntl.F_ADD_SEALS, fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW)
+call(1, b"/shared.txt", fds=[region])
+call(2, b"/shared.txt", 0, 6)
+call(2, b"/shared.txt", 6, len(data) - 6)
+call(3, b"/shared.txt")
+
+call(1, b"/inline.txt")
+call(2, b"/inline.txt", payload=data)
+call(3, b"/inline.txt")
+
+# a producer going away mid-upload
+call(1, b"/cut.txt")
+call(2, b"/cut.txt", payload=data[:6])
+s.close()
+PYTHON
+
+  curl --silent --fail http://$host/shared.txt > $tmpDir/shared.txt
+  curl --silent --fail http://$host/inline.txt > $tmpDir/inline.txt
+
+  sleep 0.1
+  exitCode=0
+  curl --silent --fail --max-time 2 http://$host/cut.txt >/dev/null || exitCode=$?
+
+  kill -INT $pid
+  wait $pid
+
+  compare $scriptDir/expected.txt $tmpDir/shared.txt
+  compare $scriptDir/expected.txt $tmpDir/inline.txt
+
+  if [ $exitCode = 0 ] ; then
+    echo "An unfinished local upload was published" >&2
+    exit 1
+  fi
+}
+
+function test_cascade
+{
+  local readonly originPort=18555
+  local readonly edgePort=18556
+  $BIN/evanescent.exe --port $originPort --long-poll 0 &
+  local readonly originPid=$!
+  $BIN/evanescent.exe --port $edgePort --long-poll 0 --upstream 127.0.0.1:$originPort &
+  local readonly edgePid=$!
+
+  sleep 0.1
+
+  # push to the origin, pull from the edge
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://127.0.0.1:$originPort/segment.m4s
+  curl --silent --fail http://127.0.0.1:$edgePort/segment.m4s > $tmpDir/pulled.txt
+
+  # served from the edge's own store once the origin forgot it
+  curl --silent --fail -X DELETE http://127.0.0.1:$originPort/segment.m4s
+  curl --silent --fail http://127.0.0.1:$edgePort/segment.m4s > $tmpDir/cached.txt
+
+  exitCode=0
+  curl --silent --fail http://127.0.0.1:$edgePort/IDontExist >/dev/null || exitCode=$?
+
+  kill -INT $edgePid $originPid
+  wait $edgePid $originPid
+
+  compare $scriptDir/expected.txt $tmpDir/pulled.txt
+  compare $scriptDir/expected.txt $tmpDir/cached.txt
+
+  if [ ! $exitCode = 22 ] ; then
+    echo "The edge did not report a missing resource (curl exit code: $exitCode (expected 22))" >&2
+    exit 1
+  fi
+}
+
+function test_upstream_failures
+{
+  local readonly originPort=18571
+  local readonly edgePort=18572
+
+  # an origin that hangs on the first request, and cuts the next ones short
+  python3 - $originPort > $tmpDir/origin_requests.txt <<'PYTHON' &
+import socket, sys, time
+server = socket.socket()
+server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+server.bind(("127.0.0.1", int(sys.argv[1])))
+server.listen(8)
+server.settimeout(10)
+hung, _ = server.accept()
+for i in range(2):
+    conn, _ = server.accept()
+    request = b""
+    while not request.endswith(b"\r\n\r\n"):
+        request += conn.recv(4096)
+    conn.sendall(b"HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\nHello")
+    conn.close()
+    print("truncated", flush=True)
+PYTHON
+  local readonly originPid=$!
+
+  $BIN/evanescent.exe --port $edgePort --long-poll 0 --upstream 127.0.0.1:$originPort --upstream-timeout 300 &
+  local readonly edgePid=$!
+
+  sleep 0.2
+
+  # the pull is given up
+  exitCode=0
+  curl --silent --fail --max-time 3 http://127.0.0.1:$edgePort/hung.m4s >/dev/null || exitCode=$?
+
+  if [ ! $exitCode = 22 ] ; then
+    echo "The hung pull was not given up (curl exit code: $exitCode (expected 22))" >&2
+    exit 1
+  fi
+
+  # a truncated pull isn't kept: the next reader pulls again
+  curl --silent http://127.0.0.1:$edgePort/truncated.m4s >/dev/null || true
+  sleep 0.1
+  curl --silent http://127.0.0.1:$edgePort/truncated.m4s >/dev/null || true
+
+  wait $originPid
+
+  kill -INT $edgePid
+  wait $edgePid
+
+  if [ "$(cat $tmpDir/origin_requests.txt | wc -l)" != 2 ] ; then
+    echo "The truncated pull was kept" >&2
+    exit 1
+  fi
+}
+
+function test_push
+{
+  local readonly edgePort=18557
+  local readonly originPort=18558
+  local readonly sock=$tmpDir/push_ingest.sock
+
+  # the peers push to each other: what's replicated isn't replicated back
+  $BIN/evanescent.exe --port $edgePort --long-poll 0 --push-to 127.0.0.1:$originPort &
+  local readonly edgePid=$!
+  $BIN/evanescent.exe --port $originPort --long-poll 0 --push-to 127.0.0.1:$edgePort --local-ingest $sock 2> $tmpDir/push_origin.log &
+  local readonly originPid=$!
+
+  sleep 0.1
+
+  # several uploads, replicated over the same persistent connection
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://127.0.0.1:$originPort/seg1.m4s
+  curl --silent --fail -X PUT -H "Transfer-Encoding: chunked" --data-binary "@$scriptDir/expected.txt" http://127.0.0.1:$originPort/seg2.m4s
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://127.0.0.1:$originPort/seg3.m4s
+  curl --silent --fail -X DELETE http://127.0.0.1:$originPort/seg3.m4s
+
+  # local uploads are replicated too
+  python3 - "$sock" "$scriptDir/expected.txt" <<'PYTHON'
+import socket, struct, sys
+
+s = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+s.connect(sys.argv[1])
+
+def call(op, url, payload=b""):
+    s.send(struct.pack("=IIQQ", op, len(url), 0, 0) + url + payload)
+    status, = struct.unpack("=i", s.recv(4))
+    assert status == 0, status
+
+call(1, b"/seg4.m4s")
+call(2, b"/seg4.m4s", open(sys.argv[2], "rb").read())
+call(3, b"/seg4.m4s")
+PYTHON
+
+  sleep 0.2
+
+  curl --silent --fail http://127.0.0.1:$edgePort/seg1.m4s > $tmpDir/seg1.txt
+  curl --silent --fail http://127.0.0.1:$edgePort/seg2.m4s > $tmpDir/seg2.txt
+  curl --silent --fail http://127.0.0.1:$edgePort/seg4.m4s > $tmpDir/seg4.txt
+
+  exitCode=0
+  curl --silent --fail http://127.0.0.1:$edgePort/seg3.m4s >/dev/null || exitCode=$?
+
+  kill -INT $originPid $edgePid
+  wait $originPid $edgePid
+
+  compare $scriptDir/expected.txt $tmpDir/seg1.txt
+  compare $scriptDir/expected.txt $tmpDir/seg2.txt
+  compare $scriptDir/expected.txt $tmpDir/seg4.txt
+
+  if [ ! $exitCode = 22 ] ; then
+    echo "The deletion was not replicated (curl exit code: $exitCode (expected 22))" >&2
+    exit 1
+  fi
+
+  # only the 3 PUTs and the DELETE from curl
+  local readonly received=$(grep -c "event=request_received" $tmpDir/push_origin.log)
+
+  if [ ! $received = 4 ] ; then
+    echo "The edge replicated back to the origin ($received requests received, expected 4)" >&2
+    exit 1
+  fi
+}
+
+function test_propagation_latency
+{
+  local readonly port=18560
+  $BIN/evanescent.exe --port $port --trace-sample 1 2> $tmpDir/latency.log &
+  local readonly pid=$!
+  local readonly host="127.0.0.1:$port"
+
+  sleep 0.1
+
+  # the reader is waiting when the data arrives
+  curl --silent --fail http://$host/live.m4s > $tmpDir/live.txt &
+  local readonly readerPid=$!
+
+  sleep 0.2
+
+  curl --silent --fail -X PUT -H "Transfer-Encoding: chunked" --data-binary "@$scriptDir/expected.txt" http://$host/live.m4s
+  wait $readerPid
+
+  kill -INT $pid
+  wait $pid
+
+  compare $scriptDir/expected.txt $tmpDir/live.txt
+
+  if ! grep -q "event=chunk_propagation url=/live.m4s" $tmpDir/latency.log || grep -q "event=propagation_report count=0" $tmpDir/latency.log ; then
+    echo "The propagation delay was not recorded" >&2
+    cat $tmpDir/latency.log >&2
+    exit 1
+  fi
+}
+
+function test_compressed_manifest
+{
+  local readonly port=18561
+  $BIN/evanescent.exe --port $port --long-poll 0 &
+  local readonly pid=$!
+  local readonly host="127.0.0.1:$port"
+
+  sleep 0.1
+
+  # big enough to be worth compressing
+  for i in $(seq 100) ; do
+    echo "<SegmentURL media=\"segment-$i.m4s\" duration=\"2000\"/>"
+  done > $tmpDir/live.mpd
+
+  curl --silent --fail -X PUT --data-binary "@$tmpDir/live.mpd" http://$host/live.mpd
+
+  curl --silent --fail --compressed --dump-header $tmpDir/headers.txt http://$host/live.mpd > $tmpDir/decoded.txt
+  curl --silent --fail http://$host/live.mpd > $tmpDir/plain.txt
+
+  kill -INT $pid
+  wait $pid
+
+  compare $tmpDir/live.mpd $tmpDir/decoded.txt
+  compare $tmpDir/live.mpd $tmpDir/plain.txt
+
+  if ! grep -qi "^Content-Encoding: gzip" $tmpDir/headers.txt ; then
+    echo "The manifest was not served compressed" >&2
+    cat $tmpDir/headers.txt >&2
+    exit 1
+  fi
+}
+
+function test_spill
+{
+  local readonly port=18562
+  local readonly host="127.0.0.1:$port"
+  local readonly spillDir=$tmpDir/spill
+
+  $BIN/evanescent.exe --port $port --long-poll 0 --spill-dir $spillDir --spill-after 100 &
+  local pid=$!
+
+  sleep 0.1
+
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://$host/dvr/seg1.m4s
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://$host/dvr/seg2.m4s
+
+  sleep 0.5
+
+  # served from the spilled copy
+  curl --silent --fail http://$host/dvr/seg1.m4s > $tmpDir/spilled.txt
+
+  kill -INT $pid
+  wait $pid
+
+  # warm restart
+  $BIN/evanescent.exe --port $port --long-poll 0 --spill-dir $spillDir --spill-after 100 &
+  pid=$!
+
+  sleep 0.1
+
+  curl --silent --fail http://$host/dvr/seg1.m4s > $tmpDir/restored.txt
+  curl --silent --fail -X DELETE http://$host/dvr/seg2.m4s
+
+  kill -INT $pid
+  wait $pid
+
+  compare $scriptDir/expected.txt $tmpDir/spilled.txt
+  compare $scriptDir/expected.txt $tmpDir/restored.txt
+
+  if [ "$(ls $spillDir | wc -l)" != 1 ] ; then
+    echo "Unexpected spill directory contents" >&2
+    ls -l $spillDir >&2
+    exit 1
+  fi
+}
+
+function test_tls_handshakes
+{
+  local readonly port=18570
+  local readonly host="127.0.0.1:$port"
+
+  $BIN/evanescent.exe --tls --port $port --tls-handshake-concurrency 1 &
+  local readonly pid=$!
+
+  sleep 0.1
+
+  seq 200000 > $tmpDir/records.txt
+  curl --silent --fail --insecure -X PUT --data-binary "@$tmpDir/records.txt" https://$host/records.txt
+
+  # a client that doesn't send its ClientHello doesn't hold the only slot
+  python3 -c 'import socket, sys, time; s = socket.create_connection(("127.0.0.1", int(sys.argv[1]))); time.sleep(3)' $port &
+  local readonly stallerPid=$!
+
+  sleep 0.2
+
+  curl --silent --fail --insecure --max-time 2 https://$host/records.txt > $tmpDir/records_1.txt
+
+  # more handshakes than slots: they queue, but all complete
+  local readers=()
+
+  for i in $(seq 2 10) ; do
+    curl --silent --fail --insecure --max-time 5 https://$host/records.txt > $tmpDir/records_$i.txt &
+    readers+=($!)
+  done
+
+  for reader in ${readers[@]} ; do
+    wait $reader
+  done
+
+  # record sizing: the start of a response comes in records fitting in a
+  # TCP segment, the rest in full-size records.
+  python3 - $port <<'PYTHON'
+import socket, ssl, struct, sys
+
+ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+ctx.check_hostname = False
+ctx.verify_mode = ssl.CERT_NONE
+
+incoming = ssl.MemoryBIO()
+outgoing = ssl.MemoryBIO()
+tls = ctx.wrap_bio(incoming, outgoing)
+
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+records = []
+pending = b""
+
+def send():
+    data = outgoing.read()
+    if data:
+        s.sendall(data)
+
+# feeds the TLS layer with whole records, noting their sizes
+def receive():
+    global pending
+    data = s.recv(65536)
+    if not data:
+        return False
+    pending += data
+    while len(pending) >= 5:
+        length = struct.unpack(">H", pending[3:5])[0]
+        if len(pending) < 5 + length:
+            break
+        records.append(length)
+        incoming.write(pending[:5 + length])
+        pending = pending[5 + length:]
+    return True
+
+while True:
+    try:
+        tls.do_handshake()
+        break
+    except ssl.SSLWantReadError:
+        send()
+        receive()
+
+send()
+del records[:]
+
+tls.write(b"GET /records.txt HTTP/1.1\r\nConnection: close\r\n\r\n")
+send()
+
+received = 0
+
+while True:
+    try:
+        data = tls.read(65536)
+        if not data:
+            break
+        received += len(data)
+    except ssl.SSLWantReadError:
+        if not receive():
+            break
+    except ssl.SSLZeroReturnError:
+        break
+
+if received < 200000 or not records:
+    sys.exit("The response was not received")
+
+# 16 bytes of AEAD tag, and the inner content type (TLS 1.3)
+small = [length for length in records if length <= 1400]
+if records[0] > 1400 or len(small) < 40 or max(records) < 16384:
+    sys.exit("Unexpected record sizes: %s" % records[:60])
+PYTHON
+
+  kill $stallerPid
+  wait $stallerPid || true
+
+  kill -INT $pid
+  wait $pid
+
+  for i in $(seq 1 10) ; do
+    compare $tmpDir/records.txt $tmpDir/records_$i.txt
+  done
+}
+
+function test_http2
+{
+  local readonly port=18565
+  local readonly host="127.0.0.1:$port"
+
+  $BIN/evanescent.exe --tls --port $port &
+  local readonly pid=$!
+
+  sleep 0.1
+
+  seq 100000 > $tmpDir/segment.txt
+  curl --silent --fail --insecure --http2 -X PUT --data-binary "@$tmpDir/segment.txt" https://$host/seg1.m4s
+  curl --silent --fail --insecure --http2 -X PUT --data-binary "@$scriptDir/expected.txt" https://$host/live.mpd
+
+  # a segment still being uploaded: must not hold back the other streams
+  (echo "Dick Jones"; sleep 1; echo "is the guy") | curl --silent --fail --http1.1 --insecure -T - https://$host/live.m4s &
+  local readonly uploadPid=$!
+
+  sleep 0.2
+
+  # all on one connection
+  curl --silent --fail --insecure --http2 --parallel \
+    --write-out "%{http_version} %{url_effective} %{time_total}\n" \
+    https://$host/live.m4s -o $tmpDir/live.txt \
+    https://$host/seg1.m4s -o $tmpDir/seg1.txt \
+    https://$host/live.mpd -o $tmpDir/live.mpd > $tmpDir/transfers.txt
+
+  wait $uploadPid
+
+  # a small header block expanding past SETTINGS_MAX_HEADER_LIST_SIZE
+  python3 - $port <<'PYTHON'
+import socket, ssl, struct, sys
+
+ctx = ssl.create_default_context()
+ctx.check_hostname = False
+ctx.verify_mode = ssl.CERT_NONE
+ctx.set_alpn_protocols(["h2"])
+s = ctx.wrap_socket(socket.create_connection(("127.0.0.1", int(sys.argv[1]))))
+
+def frame(type, flags, stream, payload):
+    return struct.pack(">I", len(payload))[1:] + bytes([type, flags]) + struct.pack(">I", stream) + payload
+
+def read(n):
+    data = b""
+    while len(data) < n:
+        chunk = s.recv(n - len(data))
+        assert chunk, "connection closed"
+        data += chunk
+    return data
+
+# GET /, then a 3000-byte field, indexed, then referenced 30 times
+block = b"\x82\x84\x87" + b"\x40\x03x-a\x7f\xb9\x16" + b"v" * 3000 + b"\xbe" * 30
+s.sendall(b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + frame(4, 0, 0, b"") + frame(1, 5, 1, block))
+
+advertised = False
+
+while True:
+    header = read(9)
+    length = int.from_bytes(header[:3], "big")
+    type, flags = header[3], header[4]
+    payload = read(length)
+
+    if type == 4 and not flags & 1:
+        settings = [struct.unpack(">HI", payload[i:i + 6]) for i in range(0, len(payload), 6)]
+        advertised = any(id == 6 for id, value in settings)
+
+    if type == 1:
+        assert b"431" in payload, payload
+        break
+
+assert advertised, "SETTINGS_MAX_HEADER_LIST_SIZE not advertised"
+PYTHON
+
+  kill -INT $pid
+  wait $pid
+
+  compare $tmpDir/segment.txt $tmpDir/seg1.txt
+  compare $scriptDir/expected.txt $tmpDir/live.mpd
+
+  if [ "$(cat $tmpDir/live.txt)" != "$(printf 'Dick Jones\nis the guy')" ] ; then
+    echo "The live segment was not fully received" >&2
+    exit 1
+  fi
+
+  if grep -qv "^2 " $tmpDir/transfers.txt ; then
+    echo "HTTP/2 was not negotiated" >&2
+    cat $tmpDir/transfers.txt >&2
+    exit 1
+  fi
+
+  # the manifest didn't wait for the end of the live segment
+  if ! awk '/live.mpd/ { exit !($3 < 0.5) }' $tmpDir/transfers.txt ; then
+    echo "The manifest was blocked by the live segment" >&2
+    cat $tmpDir/transfers.txt >&2
+    exit 1
+  fi
+}
+
+function test_timeouts
+{
+  local readonly port=18566
+  local readonly host="127.0.0.1:$port"
+
+  $BIN/evanescent.exe --port $port --header-timeout 300 --idle-timeout 300 --write-timeout 300 &
+  local readonly pid=$!
+
+  sleep 0.1
+
+  # a client trickling its request headers is disconnected
+  python3 - $port <<'PYTHON'
+import socket, sys, time
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+s.settimeout(3)
+start = time.time()
+s.sendall(b"GET /slow.txt HTTP/1.1\r\n")
+if s.recv(1) != b"" or time.time() - start > 2:
+    sys.exit("The slow client was not disconnected")
+PYTHON
+
+  # an idle keep-alive connection is closed
+  python3 - $port <<'PYTHON'
+import http.client, sys, time
+conn = http.client.HTTPConnection("127.0.0.1", int(sys.argv[1]))
+conn.request("PUT", "/idle.txt", body=b"Hello")
+conn.getresponse().read()
+start = time.time()
+conn.sock.settimeout(3)
+if conn.sock.recv(1) != b"" or time.time() - start > 2:
+    sys.exit("The idle connection was not closed")
+PYTHON
+
+  # an uploader that stops sending its body is disconnected
+  python3 - $port <<'PYTHON'
+import socket, sys, time
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+s.settimeout(3)
+start = time.time()
+s.sendall(b"PUT /stalled.txt HTTP/1.1\r\nContent-Length: 100\r\n\r\nHello")
+if s.recv(1) != b"" or time.time() - start > 2:
+    sys.exit("The stalled uploader was not disconnected")
+PYTHON
+
+  # a slow uploader is not, as long as its body keeps progressing
+  python3 - $port <<'PYTHON'
+import socket, sys, time
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+s.settimeout(3)
+s.sendall(b"PUT /slow_upload.txt HTTP/1.1\r\nContent-Length: 1000000\r\n\r\n")
+for i in range(10):
+    time.sleep(0.1)
+    s.sendall(b"x" * 100000)
+if not s.recv(100).startswith(b"HTTP/1.1 200"):
+    sys.exit("The slow upload failed")
+PYTHON
+
+  # a reader that doesn't read the response is disconnected
+  seq 2000000 > $tmpDir/unread.txt
+  curl --silent --fail -X PUT --data-binary "@$tmpDir/unread.txt" http://$host/unread.txt
+
+  python3 - $port $(stat -c %s $tmpDir/unread.txt) <<'PYTHON'
+import socket, sys, time
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+s.connect(("127.0.0.1", int(sys.argv[1])))
+s.sendall(b"GET /unread.txt HTTP/1.1\r\n\r\n")
+time.sleep(1.5)
+s.settimeout(3)
+received = 0
+try:
+    while True:
+        data = s.recv(65536)
+        if not data:
+            break
+        received += len(data)
+except ConnectionResetError:
+    pass
+if received >= int(sys.argv[2]):
+    sys.exit("The stalled reader was not disconnected")
+PYTHON
+
+  # a long-polling GET is served as soon as the resource is created
+  curl --silent --fail http://$host/late.txt > $tmpDir/late.txt &
+  local readonly reader=$!
+  sleep 0.5
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://$host/late.txt
+  wait $reader
+
+  kill -INT $pid
+  wait $pid
+
+  # the same for an HTTP/2 request body: its stream is reset
+  $BIN/evanescent.exe --tls --port $port --idle-timeout 300 --long-poll 0 &
+  local readonly tlsPid=$!
+
+  sleep 0.1
+
+  exitCode=0
+  (echo "Dick Jones"; sleep 2) | curl --silent --fail --insecure --http2 --max-time 5 -T - https://$host/stalled.m4s || exitCode=$?
+
+  # and the truncated upload isn't served
+  if curl --silent --fail --insecure --http2 https://$host/stalled.m4s > /dev/null ; then
+    echo "The truncated HTTP/2 upload was served" >&2
+    exit 1
+  fi
+
+  kill -INT $tlsPid
+  wait $tlsPid
+
+  # 28: curl timed out, the upload wasn't reset
+  if [ $exitCode = 0 ] || [ $exitCode = 28 ] ; then
+    echo "The stalled HTTP/2 upload was not reset (curl: $exitCode)" >&2
+    exit 1
+  fi
+
+  compare $scriptDir/expected.txt $tmpDir/late.txt
+}
+
+function test_subscription
+{
+  local readonly port=18567
+  local readonly host="127.0.0.1:$port"
+
+  $BIN/evanescent.exe --port $port &
+  local readonly pid=$!
+
+  sleep 0.1
+
+  curl --silent --no-buffer -H "Accept: text/event-stream" "http://$host/live/channel1/*" > $tmpDir/events.txt &
+  local readonly subscriber=$!
+  sleep 0.2
+
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://$host/live/channel1/seg1.m4s
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://$host/live/channel2/seg1.m4s
+  curl --silent --fail -X DELETE http://$host/live/channel1/seg1.m4s
+  sleep 0.2
+
+  kill $subscriber
+  wait $subscriber || true
+  kill -INT $pid
+  wait $pid
+
+  printf 'event: created\ndata: /live/channel1/seg1.m4s\n\nevent: completed\ndata: /live/channel1/seg1.m4s\n\nevent: deleted\ndata: /live/channel1/seg1.m4s\n\n' > $tmpDir/events_expected.txt
+  compare $tmpDir/events_expected.txt $tmpDir/events.txt
+}
+
+function test_egress_scheduler
+{
+  local readonly port=18568
+  local readonly host="127.0.0.1:$port"
+
+  $BIN/evanescent.exe --port $port --long-poll 0 --egress-rate 400000 &
+  local readonly pid=$!
+
+  sleep 0.1
+
+  head -c 600000 /dev/urandom > $tmpDir/old.m4s
+  head -c 30000 /dev/urandom > $tmpDir/live.mpd
+  curl --silent --fail -X PUT --data-binary "@$tmpDir/old.m4s" http://$host/old.m4s
+  curl --silent --fail -X PUT --data-binary "@$tmpDir/live.mpd" http://$host/live.mpd
+
+  # two catch-up readers saturate the egress rate...
+  local readonly start=$(date +%s%N)
+  curl --silent --fail http://$host/old.m4s > $tmpDir/old1.m4s &
+  local readonly reader1=$!
+  curl --silent --fail http://$host/old.m4s > $tmpDir/old2.m4s &
+  local readonly reader2=$!
+  sleep 0.3
+
+  # ...and the manifest still goes first
+  local readonly manifestStart=$(date +%s%N)
+  curl --silent --fail http://$host/live.mpd > $tmpDir/live_received.mpd
+  local readonly manifest_ms=$(( ($(date +%s%N) - manifestStart) / 1000000 ))
+
+  wait $reader1 $reader2
+  local readonly elapsed_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+
+  kill -INT $pid
+  wait $pid
+
+  compare $tmpDir/old.m4s $tmpDir/old1.m4s
+  compare $tmpDir/old.m4s $tmpDir/old2.m4s
+  compare $tmpDir/live.mpd $tmpDir/live_received.mpd
+
+  # 1.2MB at 400KB/s
+  if [ $elapsed_ms -lt 2500 ] ; then
+    echo "The egress was not rate limited: took ${elapsed_ms}ms" >&2
+    exit 1
+  fi
+
+  if [ $manifest_ms -gt 500 ] ; then
+    echo "The manifest was not prioritized: took ${manifest_ms}ms" >&2
+    exit 1
+  fi
+}
+
+function test_request_timing
+{
+  local readonly port=18569
+  local readonly host="127.0.0.1:$port"
+
+  $BIN/evanescent.exe --port $port --request-timing > $tmpDir/timing.log 2>&1 &
+  local readonly pid=$!
+
+  sleep 0.1
+
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://$host/timed.txt
+  curl --silent --fail http://$host/timed.txt > $tmpDir/timed.txt
+
+  kill -INT $pid
+  wait $pid
+
+  compare $scriptDir/expected.txt $tmpDir/timed.txt
+
+  if ! grep -q "event=request_timing method=GET url=/timed.txt total_us=[0-9]* .*lookup_us=[0-9]* .*send_us=[0-9]*" $tmpDir/timing.log ; then
+    echo "No timing breakdown for the GET" >&2
+    cat $tmpDir/timing.log >&2
+    exit 1
+  fi
+}
+
+function test_socket_profile
+{
+  local readonly port=18564
+  local readonly host="127.0.0.1:$port"
+
+  $BIN/evanescent.exe --port $port --long-poll 0 \
+    --ingest-socket nodelay,rcvbuf=65536 \
+    --egress-socket live,sndbuf=65536,pacing=300000 &
+  local readonly pid=$!
+
+  sleep 0.1
+
+  head -c 600000 /dev/urandom > $tmpDir/paced.bin
+  curl --silent --fail -X PUT --data-binary "@$tmpDir/paced.bin" http://$host/paced.m4s
+
+  local readonly start=$(date +%s%N)
+  curl --silent --fail http://$host/paced.m4s > $tmpDir/received.bin
+  local readonly elapsed_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+
+  kill -INT $pid
+  wait $pid
+
+  compare $tmpDir/paced.bin $tmpDir/received.bin
+
+  # 600KB at 300KB/s, minus the initial burst
+  if [ $elapsed_ms -lt 1000 ] ; then
+    echo "The egress was not paced: took ${elapsed_ms}ms" >&2
+    exit 1
+  fi
+}
+
+function test_upgrade
+{
+  local readonly port=18563
+  local readonly host="127.0.0.1:$port"
+  local readonly upgradeSocket=$tmpDir/upgrade.sock
+
+  $BIN/evanescent.exe --port $port --upgrade-socket $upgradeSocket &
+  local readonly oldPid=$!
+
+  sleep 0.1
+
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://$host/seg1.m4s
+
+  # still uploading to the old relay during the upgrade
+  (echo "Dick Jones"; sleep 0.5; echo "is the guy") | curl --silent --fail -T - http://$host/live.m4s &
+  local readonly uploadPid=$!
+
+  sleep 0.2
+
+  $BIN/evanescent.exe --port $port --upgrade-socket $upgradeSocket &
+  local readonly newPid=$!
+
+  sleep 0.1
+
+  curl --silent --fail http://$host/seg1.m4s > $tmpDir/upgraded.txt
+  curl --silent --fail http://$host/live.m4s > $tmpDir/live.txt
+
+  wait $uploadPid
+
+  # the old relay exits once drained
+  wait $oldPid
+
+  kill -INT $newPid
+  wait $newPid
+
+  compare $scriptDir/expected.txt $tmpDir/upgraded.txt
+
+  if [ "$(cat $tmpDir/live.txt)" != "$(printf 'Dick Jones\nis the guy')" ] ; then
+    echo "The upload in progress was not handed over" >&2
+    cat $tmpDir/live.txt >&2
+    exit 1
+  fi
+}
+
+function test_upgrade_failed
+{
+  local readonly port=18564
+  local readonly host="127.0.0.1:$port"
+  local readonly upgradeSocket=$tmpDir/upgrade_failed.sock
+  local readonly spillDir=$tmpDir/upgrade_spill
+
+  $BIN/evanescent.exe --port $port --long-poll 0 --spill-dir $spillDir --spill-after 100 --upgrade-socket $upgradeSocket &
+  local readonly pid=$!
+
+  sleep 0.1
+
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://$host/seg1.m4s
+
+  sleep 0.5
+
+  # a successor crashing before taking the listening socket over:
+  # the spilled resource comes as its spill file.
+  python3 - $upgradeSocket $scriptDir/expected.txt <<'PYTHON'
+import array, mmap, socket, struct, sys
+
+Header = struct.Struct("=IIQQ")
+
+s = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+s.connect(sys.argv[1])
+
+while True:
+    msg, anc, flags, addr = s.recvmsg(1024, socket.CMSG_SPACE(4))
+    op, urlLength, length, offset = Header.unpack_from(msg)
+    fds = array.array("i")
+
+    for level, kind, data in anc:
+        fds.frombytes(data)
+
+    if op == 2:
+        break
+
+    assert op == 1 and offset > 0, "not passed as a spill file"
+    mapped = mmap.mmap(fds[0], offset + length, prot=mmap.PROT_READ)
+    assert mapped[offset:] == open(sys.argv[2], "rb").read()
+
+s.close()
+PYTHON
+
+  # the old relay accepts connections again
+  curl --silent --fail --max-time 5 http://$host/seg1.m4s > $tmpDir/resumed.txt
+
+  # a successor taking over: the deletions still reaching the old relay
+  # are forwarded.
+  python3 - $upgradeSocket $port <<'PYTHON'
+import http.client, socket, struct, sys
+
+Header = struct.Struct("=IIQQ")
+
+conn = http.client.HTTPConnection("127.0.0.1", int(sys.argv[2]))
+conn.request("GET", "/seg1.m4s")
+conn.getresponse().read()
+
+s = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+s.connect(sys.argv[1])
+s.settimeout(5)
+
+while True:
+    msg, anc, flags, addr = s.recvmsg(1024, socket.CMSG_SPACE(4))
+
+    if Header.unpack_from(msg)[0] == 2:
+        break
+
+s.send(Header.pack(2, 0, 0, 0))
+
+# on a connection accepted before the upgrade
+conn.request("DELETE", "/seg1.m4s")
+conn.getresponse().read()
+
+while True:
+    msg = s.recv(1024)
+    op, urlLength = Header.unpack_from(msg)[:2]
+
+    if op == 6:
+        assert msg[Header.size:Header.size + urlLength] == b"/seg1.m4s"
+        break
+PYTHON
+
+  # the old relay exits once drained
+  wait $pid
+
+  compare $scriptDir/expected.txt $tmpDir/resumed.txt
+}
+
+function test_truncated_upload
+{
+  local readonly port=18560
+  $BIN/evanescent.exe --port $port --long-poll 0 &
+  local readonly pid=$!
+  local readonly host="127.0.0.1:$port"
+
+  sleep 0.1
+
+  # the uploader goes away in the middle of the body
+  python3 - $port <<'PYTHON'
+import socket, sys
+
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+s.sendall(b"PUT /truncated.txt HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nHello\r\n100\r\nWorld")
+s.close()
+PYTHON
+
+  sleep 0.1
+
+  exitCode=0
+  curl --silent --fail http://$host/truncated.txt >/dev/null || exitCode=$?
+
+  kill -INT $pid
+  wait $pid
+
+  if [ ! $exitCode = 22 ] ; then
+    echo "A truncated upload is served (curl exit code: $exitCode (expected 22))" >&2
+    exit 1
+  fi
+}
+
+function test_keep_alive
+{
+  local readonly port=18559
+  $BIN/evanescent.exe --port $port --long-poll 0 &
+  local readonly pid=$!
+  local readonly host="127.0.0.1:$port"
+
+  sleep 0.1
+
+  curl --silent --fail -X PUT --data-binary "@$scriptDir/expected.txt" http://$host/a.txt
+
+  # curl reuses the connection for both requests
+  curl --silent --write-out "%{num_connects}\n" http://$host/a.txt http://$host/a.txt > $tmpDir/keep_alive.txt
+
+  kill -INT $pid
+  wait $pid
+
+  if [ "$(grep -c Murphy $tmpDir/keep_alive.txt)" != 2 ] || [ "$(tail -n 1 $tmpDir/keep_alive.txt)" != 0 ] ; then
+    echo "The connection was not reused" >&2
+    cat $tmpDir/keep_alive.txt >&2
+    exit 1
+  fi
+}
+
 function test_tls
 {
   $BIN/evanescent.exe --tls &